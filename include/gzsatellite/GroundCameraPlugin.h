@@ -0,0 +1,75 @@
+#include <string>
+#include <memory>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include <opencv2/opencv.hpp>
+
+#include <ros/ros.h>
+#include <ros/callback_queue.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <std_msgs/UInt32.h>
+
+#include <gazebo/physics/physics.hh>
+#include <gazebo/common/common.hh>
+#include <gazebo/gazebo.hh>
+
+#include "groundcamera.h"
+#include "rosparams.h"
+
+namespace gazebo {
+
+  class GroundCameraPlugin: public ModelPlugin {
+    public:
+      GroundCameraPlugin();
+      ~GroundCameraPlugin();
+
+      void Load(physics::ModelPtr _model, sdf::ElementPtr _sdf);
+
+    private:
+      physics::LinkPtr link_;
+      ignition::math::Pose3d camera_pose_; // in the link frame
+      double period_;
+      common::Time last_update_;
+
+      // the region's tiles, set up by the render thread
+      gzsatellite::GeoParams params_;
+      gzsatellite::GroundCamera::Intrinsics intrinsics_;
+      double max_distance_;
+      std::unique_ptr<gzsatellite::TileLoader> loader_;
+      std::unique_ptr<gzsatellite::GroundCamera> camera_;
+
+      // The world plugin announces every world it loads (and the zoom level
+      // of its tiles) on /gzsatellite/world_zoom; the camera then follows
+      // the region's parameters. Handled on the render thread.
+      ros::CallbackQueue world_queue_;
+      ros::Subscriber world_sub_;
+
+      std::unique_ptr<ros::NodeHandle> nh_;
+      ros::Publisher image_pub_, info_pub_;
+      std::string frame_id_;
+      int missing_tiles_; // last reported
+      event::ConnectionPtr update_connection_;
+
+      // Frames are rendered off the simulation thread. A frame that is due
+      // while the previous one is still rendering is dropped.
+      std::thread render_thread_;
+      std::mutex mutex_;
+      std::condition_variable cond_;
+      bool pending_, stop_;
+      cv::Vec3d position_;
+      cv::Matx33d rotation_;
+      common::Time stamp_;
+
+      void onWorldUpdate(const common::UpdateInfo& info);
+      void onWorldZoom(const std_msgs::UInt32::ConstPtr& msg);
+      void renderLoop();
+
+      // Set up the tiles and the camera for the region at a zoom level
+      void setupCamera(unsigned int zoom);
+      void publish(const cv::Vec3d& position, const cv::Matx33d& rotation,
+                   const common::Time& stamp);
+  };
+}
@@ -4,6 +4,9 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include <boost/filesystem.hpp>
 
@@ -11,23 +14,101 @@
 
 #include <ros/ros.h>
 #include <ros/package.h>
+#include <ros/callback_queue.h>
+#include <std_msgs/UInt32.h>
+#include <std_srvs/Trigger.h>
 
 #include <gazebo/physics/physics.hh>
 #include <gazebo/common/common.hh>
 #include <gazebo/gazebo.hh>
+#include <gazebo/transport/transport.hh>
 
 #include "modelcreator.h"
+#include "mapserver.h"
+#include "rosparams.h"
+#include "tickscheduler.h"
 
 namespace gazebo {
 
   class TilePlugin: public WorldPlugin {
     public:
       TilePlugin();
+      ~TilePlugin();
 
       void Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf);
 
+      void Reset();
+
     private:
       physics::WorldPtr parent_;
+
+      // kept alive for background work on the world's tiles
+      std::unique_ptr<gzsatellite::ModelCreator> creator_;
+      gzsatellite::GeoParams params_;
+      std::string name_;
+      double quality_;
+
+      // Lazy textures: the world image is only built once something renders
+      // the world, i.e., subscribes to its visuals (gzclient, camera sensors)
+      bool lazy_texture_;
+      std::atomic<bool> texture_needed_;
+      std::atomic<bool> texture_pending_;
+      std::atomic<bool> texture_restart_;
+      common::Time next_client_check_;
+      transport::NodePtr gz_node_;
+      transport::PublisherPtr visual_pub_;
+
+      // the world is created off the simulation thread, and can be cancelled
+      std::thread load_thread_;
+      gzsatellite::CancelToken load_cancel_;
+      std::atomic<bool> loaded_;
+      std::mutex load_mutex_;
+
+      // Background work: worker threads run at background_nice_, and the
+      // simulation thread's part is metered per tick by ticks_
+      int background_nice_;
+      gzsatellite::TickScheduler ticks_;
+      std::atomic<bool> loading_;
+
+      // real time factor while there is background work, and without
+      common::Time last_sim_, last_wall_;
+      double busy_sim_, busy_wall_, idle_sim_, idle_wall_;
+      bool busy_;
+
+      // models in the world: the current one, and the ones it replaces
+      std::string model_name_;
+      std::vector<std::string> retired_models_;
+      unsigned int generation_;
+      std::atomic<bool> swap_pending_;
+      std::mutex model_mutex_;
+      event::ConnectionPtr update_connection_;
+
+      // ~reload and ~get_map_crop services, and the ~world_zoom topic
+      std::unique_ptr<ros::NodeHandle> nh_;
+      ros::CallbackQueue queue_;
+      ros::ServiceServer reload_srv_;
+      ros::Publisher world_pub_;
+      std::unique_ptr<gzsatellite::MapServer> map_server_;
+      std::thread ros_thread_;
+
+      // Read the parameters and set up a model creator with them
+      std::unique_ptr<gzsatellite::ModelCreator> createModelCreator();
+
+      // Requires load_mutex_
+      void startLoading();
+      void stopLoading();
+      void loadWorld(gzsatellite::CancelToken cancel);
+
+      bool reload(std_srvs::Trigger::Request& req, std_srvs::Trigger::Response& res);
+      void onWorldUpdate();
+
+      // Start texturing the world model once something renders it
+      void checkRenderingClients();
+      void restartTextured();
+
+      // Account a tick to busy or idle time, and report the real time
+      // factor once background work is done
+      void measureRealTimeFactor();
   };
 }
 
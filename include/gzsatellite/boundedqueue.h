@@ -0,0 +1,71 @@
+/**
+ * BoundedQueue: a blocking multi-producer / multi-consumer FIFO with a
+ * fixed capacity, used to connect the stages of the mosaic pipeline.
+ *
+ * Producers block in push() while the queue is full, which gives the
+ * pipeline backpressure: a fast stage can never run arbitrarily far
+ * ahead of a slow one. Once close() is called, pending items are still
+ * handed out, after which pop() returns false.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+namespace gzsatellite {
+
+  template<typename T>
+  class BoundedQueue
+  {
+  public:
+    explicit BoundedQueue(size_t capacity)
+      : capacity_(capacity > 0 ? capacity : 1), closed_(false) {}
+
+    /// Blocking insert. Returns false if the queue was closed.
+    bool push(T item)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_.wait(lock, [this]{ return closed_ || items_.size() < capacity_; });
+      if (closed_) return false;
+
+      items_.push_back(std::move(item));
+      not_empty_.notify_one();
+      return true;
+    }
+
+    /// Blocking removal. Returns false once closed and drained.
+    bool pop(T& item)
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [this]{ return closed_ || !items_.empty(); });
+      if (items_.empty()) return false;
+
+      item = std::move(items_.front());
+      items_.pop_front();
+      not_full_.notify_one();
+      return true;
+    }
+
+    /// No more items will be pushed; wake up everyone waiting.
+    void close()
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+      not_empty_.notify_all();
+      not_full_.notify_all();
+    }
+
+  private:
+    size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+  };
+
+}
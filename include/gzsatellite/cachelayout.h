@@ -0,0 +1,49 @@
+/**
+ * Layouts of the tile cache directory of a tileserver.
+ *
+ *    flat     x{X}_y{Y}_z{Z}.jpg, all in one directory (the original layout)
+ *    zxy      {Z}/{X}/{Y}.jpg
+ *    sharded  {Z}/{HH}/{X}/{Y}.jpg, HH a hash of X in 256 buckets
+ *
+ * A flat directory holds every tile ever downloaded from a tileserver,
+ * which slows listing, backups and rsync to a crawl once there are
+ * hundreds of thousands of them. The nested layouts keep directories
+ * small while the path of a tile is still computed directly, so a lookup
+ * is a single open/stat.
+ *
+ * The layout of a cache directory is recorded in a `layout` file in it.
+ * A directory without one that already holds flat tiles is flat; any
+ * other one (e.g., empty but for metadata) takes the layout asked for. Flat caches are converted with
+ * gzsatellite_migrate_cache.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+namespace gzsatellite {
+
+  enum class CacheLayout { Flat, Zxy, Sharded };
+
+  /// "flat", "zxy" or "sharded"; throws std::invalid_argument otherwise
+  CacheLayout parseCacheLayout(const std::string& name);
+
+  std::string cacheLayoutName(CacheLayout layout);
+
+  /// Path of tile [x,y,z] relative to the cache directory
+  boost::filesystem::path cacheLayoutPath(CacheLayout layout, int x, int y, int z);
+
+  /// Parse the name of a tile in a flat cache directory
+  bool parseFlatTileName(const std::string& name, int& x, int& y, int& z);
+
+  /// Layout recorded in (or, if none is, found in) a cache directory.
+  /// A directory without flat tiles is given the layout `preferred`, and
+  /// records it.
+  CacheLayout openCacheLayout(const boost::filesystem::path& dir, CacheLayout preferred);
+
+  /// Record the layout of a cache directory
+  bool writeCacheLayout(const boost::filesystem::path& dir, CacheLayout layout);
+
+}
@@ -0,0 +1,65 @@
+/**
+ * CancelToken: cooperative cancellation of long-running work.
+ *
+ * Copies of a token share their state, so whoever holds one copy can
+ * cancel the work that checks another. Blocking operations (downloads,
+ * queue waits, the stages of the mosaic pipeline) poll the token and give
+ * up promptly once it is cancelled. A child token is cancelled along with
+ * its parent, but can also be cancelled on its own.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+
+namespace gzsatellite {
+
+  /// Thrown by work that was cancelled before it could complete
+  class Cancelled : public std::runtime_error
+  {
+  public:
+    Cancelled() : std::runtime_error("cancelled") {}
+  };
+
+  class CancelToken
+  {
+  public:
+    CancelToken() : state_(std::make_shared<State>()) {}
+
+    /// A token that is cancelled when this one is (but not vice versa)
+    CancelToken child() const
+    {
+      CancelToken token;
+      token.state_->parent = state_;
+      return token;
+    }
+
+    void cancel() const { state_->cancelled = true; }
+
+    bool cancelled() const
+    {
+      for (const State* s = state_.get(); s != nullptr; s = s->parent.get())
+        if (s->cancelled) return true;
+      return false;
+    }
+
+    void throwIfCancelled() const
+    {
+      if (cancelled()) throw Cancelled();
+    }
+
+  private:
+    struct State
+    {
+      State() : cancelled(false) {}
+
+      std::atomic<bool> cancelled;
+      std::shared_ptr<const State> parent;
+    };
+
+    std::shared_ptr<State> state_;
+  };
+
+}
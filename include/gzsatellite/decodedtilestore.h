@@ -0,0 +1,108 @@
+/**
+ * DecodedTileStore: a disk tier of decoded tiles, for fast warm rebuilds.
+ *
+ * Rebuilding a world image from a warm cache is bound by JPEG decoding,
+ * not by reading the tiles. This store keeps the decoded pixels of tiles
+ * (at the size they are placed in the mosaic), compressed with LZ4 when
+ * gzsatellite is built with it and raw otherwise, so that the next build
+ * only has to copy them: LZ4 decompresses at memory bandwidth.
+ *
+ * Tiles are added in the background the first time they are decoded (a
+ * tile that does not fit the write queue is simply added another time),
+ * and the least recently used ones are removed once the store is over its
+ * capacity. A tile whose cached image changes is erased.
+ *
+ * Each store holds the tiles of one tileserver at one size, as
+ * <dir>/<z>/<x>/<y>.raw. The files are only meant for the machine that
+ * wrote them.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+
+#include <opencv2/opencv.hpp>
+
+#include "tilerange.h"
+
+namespace gzsatellite {
+
+  class DecodedTileStore
+  {
+  public:
+    /// Tiles of tile_size px in dir, up to capacity bytes of files
+    DecodedTileStore(const std::string& dir, int tile_size, size_t capacity,
+                     size_t max_queued = 256);
+
+    /// Finishes the write in progress; queued tiles are dropped
+    ~DecodedTileStore();
+
+    int tileSize() const { return tile_size_; }
+
+    /// Whether the tile is in the store (and use it, for eviction)
+    bool contains(TileKey key);
+
+    /// File of a tile, to be read and unpacked
+    boost::filesystem::path path(TileKey key) const;
+
+    /// Queue a decoded tile (CV_8UC3 or CV_8UC4) to be added
+    void put(TileKey key, const cv::Mat& image);
+
+    /// Remove a tile, e.g., once its cached image changed
+    void erase(TileKey key);
+
+    /// Image in the contents of a tile's file; empty if they are invalid
+    static cv::Mat unpack(const char* data, size_t size);
+
+    /// Whether tiles are compressed (gzsatellite is built with LZ4)
+    static bool compressed();
+
+  private:
+    typedef std::list<std::pair<TileKey, size_t>> Entries; ///< key, file size
+
+    boost::filesystem::path dir_;
+    int tile_size_;
+    size_t capacity_;
+    size_t max_queued_;
+
+    // files in the store, most recently used first; found on first use
+    bool loaded_;
+    Entries entries_;
+    std::unordered_map<TileKey, Entries::iterator> index_;
+    size_t size_;
+
+    // tiles waiting to be written, and the one being written
+    std::deque<std::pair<TileKey, cv::Mat>> queue_;
+    bool writing_;
+    TileKey writing_key_;
+    bool writing_erased_;
+    bool stopping_;
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    std::thread writer_;
+
+    /// Scan dir for the files of an earlier run; requires mutex_
+    void load();
+
+    /// Add a file to the index, and evict; requires mutex_
+    void add(TileKey key, size_t bytes);
+
+    /// Remove an entry and its file; requires mutex_
+    void remove(Entries::iterator it);
+
+    /// Header and (compressed) pixels of an image
+    static std::string pack(const cv::Mat& image);
+
+    void writeBack();
+  };
+
+}
@@ -0,0 +1,72 @@
+/**
+ * DownloadJournal: the state of every tile of a long download, on disk.
+ *
+ * A prefetch of a large region runs for hours. The journal records the
+ * tile range it works on and, as it goes, the status of each tile, so that
+ * a download that was interrupted resumes where it stopped: tiles that are
+ * done are neither downloaded nor looked up in the cache again, and only
+ * the tiles that had failed, or were not done yet, are retried.
+ *
+ * On disk, a journal is a checkpoint (a header naming the job and the
+ * range, then the packed 2 bit statuses of TileRange) and a log of the
+ * changes since, a fixed size record per change. The log is folded into a
+ * new checkpoint every so many records, and when the journal is closed.
+ * A record that is lost, or torn, in a crash only makes its tile be looked
+ * at again, as is a tile that was in flight.
+ *
+ * Not thread-safe.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+
+#include "tilerange.h"
+
+namespace gzsatellite {
+
+  class DownloadJournal
+  {
+  public:
+    /// Open the journal at path for the tiles of range, of the download
+    /// `job` (e.g., a hash of the tileservers). The statuses it recorded
+    /// for the same job and range are restored into range, with tiles that
+    /// were in flight pending again; otherwise, a new journal is started.
+    DownloadJournal(const std::string& path, const std::string& job, TileRange& range,
+                    size_t checkpoint_interval = 65536);
+
+    /// Writes a final checkpoint
+    ~DownloadJournal();
+
+    /// Set the status of tile i of the range, and record it
+    void record(size_t i, TileStatus status);
+
+    /// Fold the log into a new checkpoint
+    void checkpoint();
+
+    /// Whether statuses were restored from an earlier run
+    bool resumed() const { return resumed_; }
+
+    /// Delete the journal of a finished download
+    void remove();
+
+  private:
+    std::string path_;
+    std::string header_;
+    TileRange& range_;
+    size_t checkpoint_interval_;
+    size_t records_;
+    bool resumed_;
+    bool removed_;
+    std::ofstream log_;
+
+    /// Restore the checkpoint and replay the log. False if there is none
+    /// for this job and range.
+    bool restore();
+
+    std::string logPath() const { return path_ + ".log"; }
+  };
+
+}
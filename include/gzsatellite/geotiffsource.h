@@ -0,0 +1,54 @@
+/**
+ * GeoTiffSource: virtual z/x/y tiles of a local orthophoto.
+ *
+ * A GeoTIFF (or Cloud-Optimized GeoTIFF, also over /vsicurl/) is served as
+ * if it were a tileserver: each tile is warped to Web Mercator from just
+ * the window of the image it covers, from the overview closest to the
+ * tile's resolution, and encoded as a JPEG. Tiles outside the image are
+ * missing, like a 404 of a tileserver.
+ *
+ * GDAL datasets cannot be read from several threads at once, so every
+ * concurrent read gets a dataset of its own, from a pool: tiles are read
+ * in parallel by the fetchers of the mosaic pipeline.
+ *
+ * Requires gzsatellite to be built with GDAL.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace gzsatellite {
+
+  class GeoTiffSource
+  {
+  public:
+    /// Throws std::runtime_error if the image cannot be opened, or without GDAL
+    explicit GeoTiffSource(const std::string& path);
+    ~GeoTiffSource();
+
+    GeoTiffSource(const GeoTiffSource&) = delete;
+    GeoTiffSource& operator=(const GeoTiffSource&) = delete;
+
+    const std::string& path() const { return path_; }
+
+    /// Tile [x,y,z] of tile_size px as a JPEG. False if it is outside the
+    /// image, or on read errors, which set error. Thread safe.
+    bool readTile(int x, int y, int z, int tile_size, std::string& data,
+                  bool* error = nullptr);
+
+  private:
+    std::string path_;
+
+    // datasets that no read is using
+    std::mutex mutex_;
+    std::vector<void*> idle_;
+
+    /// A dataset of the image, null if it cannot be opened
+    void* acquire();
+    void release(void* dataset);
+  };
+
+}
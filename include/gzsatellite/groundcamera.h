@@ -0,0 +1,75 @@
+/**
+ * GroundCamera: renders what a pinhole camera sees of the ground, on the
+ * CPU, from the cached tiles of a region.
+ *
+ * The ground is the plane z = 0 that the world model lies in: the region's
+ * lat/lon is at the model's position, x points east, y north, and a meter
+ * is 1/resolution() pixels of the tiles. The part of the ground the camera
+ * can see is cropped from the tiles, at about the resolution the camera
+ * resolves, and warped into the image with the homography between the two
+ * planes. Pixels above the horizon, or beyond the crop, are sky.
+ */
+
+#pragma once
+
+#include <opencv2/opencv.hpp>
+
+#include "modelcreator.h"
+#include "tileloader.h"
+
+namespace gzsatellite {
+
+  class GroundCamera
+  {
+  public:
+    /// Pinhole intrinsics, in pixels
+    struct Intrinsics
+    {
+      int width, height;
+      double fx, fy, cx, cy;
+
+      /// Square pixels and a centered principal point
+      static Intrinsics fromFov(int width, int height, double hfov);
+    };
+
+    GroundCamera(const TileLoader& loader, const GeoParams& params,
+                 const Intrinsics& intrinsics);
+
+    const Intrinsics& intrinsics() const { return k_; }
+
+    /// Ground farther away than this (m) is not rendered
+    void setMaxDistance(double meters) { max_distance_ = meters; }
+
+    /// Color of the sky, and of ground that is not rendered (BGR)
+    void setSkyColor(const cv::Scalar& bgr) { sky_ = bgr; }
+
+    /// Render the view from position (m) into image (CV_8UC3). The columns
+    /// of rotation are the camera's optical axes (x right, y down, z
+    /// forward) in the world frame. Returns the number of tiles in view
+    /// that are not cached.
+    int render(const cv::Vec3d& position, const cv::Matx33d& rotation,
+               cv::Mat& image) const;
+
+  private:
+    const TileLoader& loader_;
+    Intrinsics k_;
+    double max_distance_;
+    cv::Scalar sky_;
+
+    // the region's center in the world (m) and in pixels of the zoom level
+    double origin_x_, origin_y_;
+    double center_px_, center_py_;
+    double resolution_;
+    unsigned int zoom_;
+
+    cv::Matx33d cameraMatrix() const;
+
+    /// Bounds (m) of the ground the camera sees, false if it sees none
+    bool footprint(const cv::Vec3d& position, const cv::Matx33d& rotation,
+                   double& min_x, double& min_y, double& max_x, double& max_y) const;
+
+    /// Paint the pixels whose rays do not point down
+    void paintSky(const cv::Matx33d& rotation, cv::Mat& image) const;
+  };
+
+}
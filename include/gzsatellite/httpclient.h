@@ -0,0 +1,84 @@
+/**
+ * HttpClient: blocking HTTP GETs on top of libcurl, with hedging.
+ *
+ * Each thread drives its own curl multi handle, so connections are kept
+ * alive between requests of the same thread. A request can be hedged: if
+ * it has not completed after a given delay, the same request is sent again
+ * (to a mirror, or over a second connection), the first response wins and
+ * the other transfer is cancelled.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cancellation.h"
+
+namespace gzsatellite {
+
+  class HttpClient
+  {
+  public:
+    struct Request
+    {
+      Request() : hedge_after(-1), timeout(60), cancel(nullptr) {}
+
+      std::string url;
+      std::string hedge_url;          ///< where to send a hedge (default: url)
+      double hedge_after;             ///< seconds before hedging, < 0: never
+      double timeout;                 ///< seconds before giving up
+      const CancelToken* cancel;      ///< abort the request once cancelled
+      std::vector<std::string> headers; ///< extra header lines, "Name: value"
+      std::string credentials;        ///< "user:password", e.g., for aws_sigv4
+      std::string aws_sigv4;          ///< sign as AWS, e.g., "aws:amz:us-east-1:s3"
+    };
+
+    struct Response
+    {
+      long status;        ///< HTTP status code, 0 if there was no response
+      std::string body;
+      std::string error;  ///< transport error, if any
+      double elapsed;     ///< seconds until the response (or giving up)
+      double primary;     ///< seconds the first transfer ran (lower bound
+                          ///< of its latency if it lost against a hedge)
+      bool hedged;        ///< a hedge was sent
+      bool hedge_won;     ///< the response came from the hedge
+      bool cancelled;
+    };
+
+    /// Blocking GET
+    static Response get(const Request& request);
+
+    /// Blocking PUT of body (e.g., an object into an S3-compatible store).
+    /// Not hedged; succeeds with any 2xx status.
+    static Response put(const Request& request, const std::string& body);
+
+    /// Whether requests can be signed with AWS SigV4 (libcurl 7.75 and up)
+    static bool supportsSigV4();
+  };
+
+  /// Sliding window of recent latencies
+  class LatencyTracker
+  {
+  public:
+    explicit LatencyTracker(size_t window = 512);
+
+    void add(double seconds);
+
+    /// p-th percentile (0-100) of the window, or -1 without samples
+    double percentile(double p) const;
+
+    size_t samples() const;
+
+  private:
+    size_t window_;
+    size_t next_;
+    std::vector<double> samples_;
+    mutable std::mutex mutex_;
+  };
+
+}
@@ -0,0 +1,85 @@
+/**
+ * Thin wrappers around libjpeg for the parts of the mosaic pipeline that
+ * OpenCV's imgcodecs cannot do, e.g., encoding or decoding an image strip
+ * by strip.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <memory>
+
+#include <opencv2/opencv.hpp>
+
+namespace gzsatellite {
+
+  class JpegStripWriter
+  {
+  public:
+    /// Open `path` for a width x height BGR image at the given quality
+    JpegStripWriter(const std::string& path, int width, int height, int quality);
+    ~JpegStripWriter();
+
+    /// Append the rows of a CV_8UC3 strip. Strips must arrive top to bottom.
+    void write(const cv::Mat& strip);
+
+    /// Finish the JPEG stream. Throws if not all rows were written.
+    void finish();
+
+    /// Number of image rows written so far
+    int rowsWritten() const { return rows_written_; }
+
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+    FILE* file_;
+    int width_, height_;
+    int rows_written_;
+  };
+
+  class JpegStripReader
+  {
+  public:
+    /// Open `path` and read its header
+    explicit JpegStripReader(const std::string& path);
+    ~JpegStripReader();
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+
+    /// Skip the next rows without (fully) decoding them
+    void skip(int rows);
+
+    /// Decode the next rows into a CV_8UC3 (BGR) strip
+    cv::Mat read(int rows);
+
+    /// Number of image rows read or skipped so far
+    int rowsRead() const { return rows_read_; }
+
+  private:
+    struct Impl;
+    std::unique_ptr<Impl> impl_;
+    FILE* file_;
+    int width_, height_;
+    int rows_read_;
+
+    void close();
+  };
+
+  /// Decode the region roi of an in-memory JPEG image into dst, a CV_8UC3
+  /// (BGR) image or view of roi's size. Only the rows of roi are decoded,
+  /// and with libjpeg-turbo only the columns of its iMCUs. False if data is
+  /// not a JPEG image, or does not contain roi.
+  bool decodeJpegRegion(const std::string& data, const cv::Rect& roi, cv::Mat& dst);
+
+  /// Decode an in-memory JPEG image at 1/denom (1, 2, 4 or 8) of its size,
+  /// in the DCT domain rather than by downsampling the full image. An empty
+  /// image if data is not a JPEG image.
+  cv::Mat decodeJpegScaled(const char* data, size_t size, int denom);
+
+  /// Whether data starts like a JPEG image
+  inline bool isJpeg(const char* data, size_t size)
+  { return size >= 2 && (unsigned char)data[0] == 0xFF && (unsigned char)data[1] == 0xD8; }
+
+}
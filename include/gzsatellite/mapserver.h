@@ -0,0 +1,44 @@
+/**
+ * MapServer: serves crops of the cached imagery to other ROS nodes.
+ *
+ * ~get_map_crop returns a georeferenced crop for a lat/lon bounding box,
+ * assembled from the tiles the plugin has already cached, so that other
+ * nodes don't have to download (and store) their own copy. Nodes on the
+ * same machine can name a POSIX shared memory object, which the pixels are
+ * written into directly instead of being sent in the response.
+ */
+
+#pragma once
+
+#include <mutex>
+#include <string>
+
+#include <ros/ros.h>
+#include <gzsatellite/GetMapCrop.h>
+
+#include "tileloader.h"
+
+namespace gzsatellite {
+
+  class MapServer
+  {
+  public:
+    /// Advertises get_map_crop in the namespace (and on the queue) of nh
+    explicit MapServer(ros::NodeHandle& nh);
+
+    /// Serve crops from the tiles of this loader. Null: no tiles yet.
+    void setLoader(const TileLoader* loader);
+
+  private:
+    const TileLoader* loader_;
+    std::mutex mutex_;
+    ros::ServiceServer srv_;
+
+    bool getMapCrop(GetMapCrop::Request& req, GetMapCrop::Response& res);
+
+    /// Write the crop into the shared memory object name, created or
+    /// resized to hold it. Returns the number of missing tiles.
+    int cropToSharedMemory(const TileLoader::Crop& crop, const std::string& name);
+  };
+
+}
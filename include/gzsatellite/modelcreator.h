@@ -6,6 +6,7 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <mutex>
 
 #include <boost/filesystem.hpp>
 
@@ -15,15 +16,30 @@
 #include <gazebo/common/common.hh>
 #include <gazebo/gazebo.hh>
 
+#include "mosaicindex.h"
 #include "tileloader.h"
+#include "tilerefresher.h"
+#include "mosaicpipeline.h"
 
 namespace gzsatellite {
 
   struct GeoParams
   {
     std::string tileserver;
+    std::vector<std::string> fallbacks; // tried in order if tileserver fails
+    std::vector<std::string> mirrors; // same imagery, for hedged requests
+    std::vector<std::string> overlays; // tileservers of layers over the imagery
+    double overlay_opacity; // 0..1, times the overlays' own alpha
+    double hedge_percentile; // 0: no hedging
     double lat, lon;
     double zoom;
+    int tile_size; // px, 0: detect from the service
+    int wms_max_size; // px, largest GetMap request of WMS services
+    int texture_downscale; // 1, 2, 4 or 8: world image at 1/n of the tiles' size
+    CacheLayout cache_layout; // of new tile caches
+    std::string cache_shared; // shared tier behind the tile cache: a directory or URL, or empty
+    std::string cache_shared_auth; // for a URL: "aws:<region>", an Authorization header value, or empty
+    double texture_budget_mb; // VRAM for the world texture, 0: no limit
 
     double width, height;
     double shift_x, shift_y;
@@ -36,15 +52,83 @@ namespace gzsatellite {
     // for storing working files, instantiate a model creator obj
     ModelCreator(const GeoParams& params, const std::string& root);
 
-    sdf::SDFPtr createModel(const std::string& name, unsigned int quality);
+    // Throws gzsatellite::Cancelled if cancel is, before the model is done.
+    // An untextured model is plain grey, and needs no tiles at all.
+    sdf::SDFPtr createModel(const std::string& name, unsigned int quality,
+                            const CancelToken& cancel = CancelToken(),
+                            bool textured = true);
+
+    // Whether the world image was built before, e.g., in an earlier run
+    bool hasWorldImage() const { return boost::filesystem::exists(world_img_path_); }
+
+    // Cancel all work on this world: downloads, the world image being
+    // built, tile refresh
+    void abort();
+
+    // Download a tile to detect the tile size, unless it is known (see
+    // TileLoader::detectTileSize). The world image, texture budget and
+    // decoded tiles follow the size. Done by createModel() and prefetch().
+    void detectTileSize(const CancelToken& cancel = CancelToken());
+
+    // Download all tiles of the world, and of its overlays, into the cache
+    // without building the world image. Interrupted (by abort() or cancel)
+    // prefetches resume where they stopped. Returns the number of tiles
+    // that could not be loaded.
+    size_t prefetch(const CancelToken& cancel = CancelToken());
+
+    // Build the world image from the one `previous` built, where they
+    // overlap, instead of from the cached tiles. Only an image that was
+    // built from tiles, at the same quality, is reused, and only without a
+    // decoded tile store (which has the tiles without another re-encoding).
+    void reuse(const ModelCreator& previous);
 
     void getOriginLatLon(double& lat, double& lon);
+
+    // Zoom level of the world, lower than asked for if its texture would
+    // not fit texture_budget_mb
+    unsigned int zoom() const { return geo_params_.zoom; }
+
+    // Estimated VRAM of the world texture in bytes, with its mipmaps
+    size_t textureBytes() const;
+
+    // Tiles of the world, e.g., for crops of the imagery
+    const TileLoader& loader() const { return *loader_; }
+
+    // Crop of the cached imagery for a lat/lon bounding box (degrees), at a
+    // resolution in m/px (0: that of the tiles). Returns the number of
+    // tiles that are not cached yet (see TileLoader::crop).
+    int crop(double north, double west, double south, double east,
+             double resolution, cv::Mat& image) const;
+
+    // Bytes of decoded tiles kept for crops
+    void setCropCacheSize(size_t bytes) { loader_->setDecodedCacheSize(bytes); }
+
+    // Bytes of decoded tiles kept on disk, per tileserver, to rebuild world
+    // images without decoding them again (0: none)
+    void setDecodedStoreSize(size_t bytes);
+
+    // Write downloaded tiles into the cache behind, in batches of up to
+    // this many tiles that are synced together (0: each right away)
+    void setWriteBatch(size_t tiles);
+
+    // Parallelism of the download / stitch / encode pipeline
+    void setPipelineOptions(const MosaicPipeline::Options& options)
+    { pipeline_options_ = options; }
+
+    // Tiles fetched longer than ttl seconds ago are refreshed in the
+    // background after the model is created (0: tiles never expire)
+    void setTileTtl(double ttl) { tile_ttl_ = ttl; }
     
   private:
     // tile loader data
     std::unique_ptr<TileLoader> loader_;
+    std::vector<std::unique_ptr<TileLoader>> overlays_;
+    std::shared_ptr<SharedTileStore> shared_;
+    std::shared_ptr<TileWriteQueue> write_queue_;
+    std::string overlays_hash_;
     GeoParams geo_params_;
-    std::vector<TileLoader::MapTile> tiles_;
+    std::string cache_root_;
+    unsigned int requested_zoom_; // (geo_params_ has the one used)
 
     // relevant directory paths
     boost::filesystem::path materials_dir_;
@@ -56,13 +140,47 @@ namespace gzsatellite {
     boost::filesystem::path world_scr_path_;
     std::string model_name_;
     unsigned int jpg_quality_;
+    MosaicPipeline::Options pipeline_options_;
+
+    // cancels the world image being built, for abort()
+    CancelToken build_cancel_;
+    std::mutex build_mutex_;
+
+    // tiles of the world image built by this creator, if any, and whether
+    // it was built from tiles only (not from a seed)
+    TileRange mosaic_tiles_;
+    bool mosaic_from_tiles_;
+
+    // world images built so far, to crop from
+    std::unique_ptr<MosaicIndex> index_;
+
+    // world image of a previous region to take tiles from, and its quality
+    boost::filesystem::path seed_path_;
+    TileRange seed_tiles_;
+    unsigned int seed_quality_;
+
+    // stale tile refresh, stopped before anything it uses is destroyed
+    double tile_ttl_;
+    std::unique_ptr<TileRefresher> refresher_;
+
+    // of the decoded tile store, to set it up again for another tile size
+    size_t decoded_store_bytes_;
+
+    void createLoader();
+    // Name the world image and script after the loaders
+    void setupImagePaths();
+    // Lower the zoom level of the loaders until the texture fits the budget
+    void fitTextureBudget();
+    size_t textureBytesAt(unsigned int zoom) const;
+    // Imagery that the world image is made of (without the region), and
+    // its JPEG quality
+    std::string imageSource() const;
 
-    void downloadTiles();
-    void createWorldImage();
+    void createWorldImage(const CancelToken& cancel);
+    void refreshStaleTiles();
     void createWorldScript();
-    cv::Mat stitchTiles();
     sdf::ElementPtr createCollision(double xpos, double ypos);
-    sdf::ElementPtr createVisual(double xpos, double ypos);
+    sdf::ElementPtr createVisual(double xpos, double ypos, bool textured);
   };
 
 }
\ No newline at end of file
@@ -0,0 +1,63 @@
+/**
+ * MosaicIndex: the world images built so far, by what they cover.
+ *
+ * World images are named after the exact parameters of their region, so
+ * a region inside one that was built before would be stitched from its
+ * tiles again. The index records every complete world image built from
+ * tiles (not cropped from another one) with the imagery it is made of and
+ * its tile range, in an R-tree of geographic bounds; a new region that an
+ * indexed image covers is then cropped out of that image in a single pass
+ * (see MosaicPipeline::setSeed).
+ *
+ * The index is a text file next to the world images, one image per line,
+ * that is appended to as images are built. Images that no longer exist
+ * are dropped when it is loaded.
+ */
+
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "tilerange.h"
+
+namespace gzsatellite {
+
+  class MosaicIndex
+  {
+  public:
+    struct Entry
+    {
+      std::string image;  ///< path of the world image
+      std::string source; ///< imagery: tileservers, tile size, scale, overlays, quality
+      TileRange tiles;    ///< all Available
+    };
+
+    /// Load the index at path, if there is one
+    explicit MosaicIndex(const std::string& path);
+    ~MosaicIndex();
+
+    /// Record a complete world image
+    void add(const std::string& image, const std::string& source, const TileRange& tiles);
+
+    /// The smallest indexed image of the same source whose tiles include
+    /// all of `tiles`. False if there is none.
+    bool findCovering(const std::string& source, const TileRange& tiles, Entry& found) const;
+
+    size_t size() const;
+
+  private:
+    struct Tree; ///< bounds of the entries (keeps Boost.Geometry out of here)
+
+    std::string path_;
+    std::vector<Entry> entries_;
+    std::unique_ptr<Tree> tree_;
+    mutable std::mutex mutex_;
+
+    /// Add an entry to the tree; requires mutex_
+    void insert(const Entry& entry);
+  };
+
+}
@@ -0,0 +1,259 @@
+/**
+ * MosaicPipeline: builds the stitched world image of a TileLoader's range.
+ *
+ * Rather than downloading every tile, then decoding every tile, then
+ * encoding the result, the work is split into stages connected by
+ * bounded queues, each with its own parallelism:
+ *
+ *    read (cache) -----------------------------------+
+ *      | misses                                       v
+ *    fetch (network) -> validate & persist -> decode -> place -> encode
+ *
+ * Cached tiles are read in large batches (see TileReader); only the tiles
+ * that are missing from the cache go through the network fetchers.
+ *
+ * For WMS services, a fetcher downloads the whole block of tiles around a
+ * missing tile with one GetMap request; the other missing tiles of that
+ * block are then served from the block instead of the network.
+ *
+ * A previous mosaic of an overlapping region (at the same zoom) can seed
+ * the new one: its available tiles are decoded from it, strip by strip,
+ * instead of being read from the cache. They are encoded once more, so a
+ * seed should have been encoded from tiles, at the same quality.
+ *
+ * With a chain of providers, a fetcher first looks for the tile in the
+ * caches of the fallback providers, then downloads it from the first
+ * provider that can serve it, and the tile is cached under that provider.
+ * A shared tier of the cache (see SharedTileStore) is looked at before any
+ * provider is asked; tiles found there are persisted into the local cache.
+ *
+ * Tiles are read in row-major order and the encoder consumes the mosaic
+ * one row of tiles (a strip) at a time, as soon as that strip is complete.
+ * CPU work thus overlaps network latency, and only the strips that are
+ * still being placed have to be held in memory.
+ *
+ * Overlays (e.g., roads or labels from a second tile template) are extra
+ * layers of tiles, each from its own loader and cache. Their tiles go
+ * through the same read, fetch, persist and decode stages as the others,
+ * and the placer blends them, by their alpha and in order, over the tile
+ * below once all layers of that tile are decoded. Tiles taken from a seed
+ * mosaic have their overlays already.
+ *
+ * With a DecodedTileStore for a layer's loader, tiles are read from it,
+ * already decoded, wherever it has them, and the tiles decoded otherwise
+ * are added to it in the background.
+ *
+ * A mosaic can be built at 1/2, 1/4 or 1/8 of the tiles' resolution.
+ * JPEG tiles are then decoded at that size in the first place, which
+ * skips most of the IDCT work of a full decode and its downsampling.
+ *
+ * Once its cancel token is cancelled, the downloads in flight are aborted,
+ * the queues are closed, every stage drops what is left and run() throws
+ * Cancelled. Tiles that were downloaded completely are still cached. An
+ * exception in any stage shuts the pipeline down the same way, and run()
+ * rethrows it.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "boundedqueue.h"
+#include "cancellation.h"
+#include "jpegcodec.h"
+#include "tileloader.h"
+#include "tilereader.h"
+
+namespace gzsatellite {
+
+  class MosaicPipeline
+  {
+  public:
+    struct Options
+    {
+      Options();
+
+      unsigned int read_threads;    ///< cache readers, if io_uring is unavailable
+      unsigned int read_batch;      ///< cache reads submitted at once
+      unsigned int fetch_threads;   ///< concurrent downloads
+      unsigned int persist_threads; ///< concurrent cache writers
+      unsigned int decode_threads;  ///< concurrent image decoders
+      unsigned int queue_depth;     ///< capacity of each inter-stage queue
+      unsigned int downscale;       ///< 1, 2, 4 or 8: mosaic at 1/downscale of the tiles' size
+    };
+
+    struct Stats
+    {
+      unsigned int reused;     ///< tiles taken from the seed mosaic
+      unsigned int cached;     ///< tiles read from the (local) cache
+      unsigned int decoded;    ///< of those, tiles read already decoded
+      unsigned int shared;     ///< tiles promoted from the shared tier
+      unsigned int downloaded; ///< tiles fetched from the tile server
+      unsigned int failed;     ///< tiles left black in the mosaic
+    };
+
+    /// Cancelled by loader.abort()
+    MosaicPipeline(const TileLoader& loader, const Options& options);
+
+    MosaicPipeline(const TileLoader& loader, const Options& options,
+                   const CancelToken& cancel);
+
+    /// Blocking call to build the mosaic and encode it as a JPEG at `path`.
+    /// Throws Cancelled (leaving no file at `path`) if cancelled, or the
+    /// first exception of any stage.
+    Stats run(const std::string& path, int quality);
+
+    /// Reuse the Available tiles of a mosaic at `path`, made of `tiles`
+    void setSeed(const std::string& path, const TileRange& tiles);
+
+    /// Blend the tiles of `layer` (at the same zoom) over the mosaic's, in
+    /// the order overlays are added. Tiles without alpha are opaque.
+    void addOverlay(const TileLoader& layer, double opacity = 1);
+
+    /// Tiles of the mosaic; after run(), either Available or Failed
+    const TileRange& tiles() const { return range_; }
+
+  private:
+    /// Tile `index` of a layer: 0 for the tiles, 1.. for the overlays
+    struct Job
+    {
+      size_t index;
+      int layer;
+      bool decoded;        ///< read from the decoded tile store
+    };
+
+    struct Overlay
+    {
+      const TileLoader* loader;
+      double opacity;
+    };
+
+    struct FetchedTile
+    {
+      size_t index;
+      int layer;
+      bool reused;         ///< from the seed, with its overlays
+      bool downloaded;     ///< (or taken from the shared tier)
+      bool shared;
+      bool unpack;         ///< buffer is from the decoded tile store
+      int provider;        ///< index of the provider it was downloaded from
+      std::string data;    ///< downloaded image
+      PooledBuffer buffer; ///< image read from the cache
+      cv::Mat image;       ///< already decoded image (e.g., a WMS slice)
+    };
+
+    /// A block of tiles that is downloaded with a single request
+    struct Block
+    {
+      Block() : state(Idle), unresolved(0), provider(0) {}
+
+      enum { Idle, Fetching, Done } state;
+      std::vector<cv::Mat> tiles; ///< empty if the request failed
+      int unresolved;             ///< tiles not yet read or taken from the block
+      int provider;               ///< provider that served the block
+    };
+
+    struct DecodedTile
+    {
+      size_t index;
+      int layer;
+      bool reused;
+      cv::Mat image;       ///< CV_8UC4 for overlays
+    };
+
+    struct Strip
+    {
+      int row;
+      cv::Mat image;
+    };
+
+    const TileLoader& loader_;
+    Options options_;
+    CancelToken cancel_; ///< (a child of the caller's, cancelled on errors)
+
+    // first exception thrown by a stage
+    std::exception_ptr error_;
+    std::mutex error_mutex_;
+
+    // tile range being stitched, with the outcome for each tile
+    TileRange range_;
+    int tile_size_;
+
+    BufferPool buffers_;
+
+    // layers above the tiles
+    std::vector<Overlay> overlays_;
+
+    // previous mosaic to take tiles from
+    std::string seed_path_;
+    TileRange seed_;
+
+    // WMS blocks of tiles_per_block_ x tiles_per_block_ tiles
+    int tiles_per_block_;
+    int block_cols_;
+    std::vector<Block> blocks_;
+    std::mutex blocks_mutex_;
+    std::condition_variable block_fetched_;
+
+    BoundedQueue<Job> fetch_queue_;
+    BoundedQueue<FetchedTile> persist_queue_;
+    BoundedQueue<FetchedTile> decode_queue_;
+    BoundedQueue<DecodedTile> place_queue_;
+    BoundedQueue<Strip> encode_queue_;
+
+    std::atomic<unsigned int> num_reused_;
+    std::atomic<unsigned int> num_cached_;
+    std::atomic<unsigned int> num_decoded_;
+    std::atomic<unsigned int> num_shared_;
+    std::atomic<unsigned int> num_downloaded_;
+    std::atomic<unsigned int> num_failed_;
+
+    /// Loader of a layer
+    const TileLoader& layer(int l) const
+    { return l == 0 ? loader_ : *overlays_[l-1].loader; }
+
+    /// Decoded tile store of a layer, if it has one for tiles of our size
+    DecodedTileStore* decodedStore(int l) const;
+
+    /// Index into blocks_ of the block containing tile i
+    size_t blockOf(size_t i) const;
+
+    /// Tile i, from its (downloaded on first use) block. False on failure.
+    bool takeFromBlock(size_t i, cv::Mat& image, int& provider);
+
+    /// Tile i was read from the cache and will not be taken from its block
+    void resolveInBlock(size_t i);
+
+    /// Run a stage, and stop the pipeline if it throws
+    void runStage(const std::function<void()>& stage);
+
+    /// Close every queue so that no stage blocks any longer
+    void closeQueues();
+
+    /// Decoder of the seed mosaic, or null if it cannot be used
+    std::unique_ptr<JpegStripReader> openSeed() const;
+
+    void readStage();
+    void fetchStage();
+    void persistStage();
+    void decodeStage();
+    void placeStage();
+    void encodeStage(const std::string& path, int quality, std::string& error);
+
+    /// Check that data looks like an image before it goes into the cache
+    static bool isImage(const std::string& data);
+
+    /// Blend a CV_8UC4 overlay over a CV_8UC3 tile, in place
+    static void composite(cv::Mat& tile, const cv::Mat& overlay, double opacity);
+  };
+
+}
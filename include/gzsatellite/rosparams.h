@@ -0,0 +1,23 @@
+/**
+ * Parameters of the /gzsatellite namespace that describe the region and
+ * its tileservers. Every plugin that works on the region's tiles reads
+ * them the same way, so that they agree on the tiles and their cache.
+ */
+
+#pragma once
+
+#include <ros/ros.h>
+
+#include "modelcreator.h"
+
+namespace gzsatellite {
+
+  /// Directory of the tile cache and generated materials, relative to the
+  /// working directory of Gazebo
+  static const std::string kRootDir = "./gzsatellite/";
+
+  /// Read the region and tileserver parameters from nh. Throws
+  /// std::invalid_argument for a zoom level beyond kMaxZoom.
+  GeoParams readGeoParams(const ros::NodeHandle& nh);
+
+}
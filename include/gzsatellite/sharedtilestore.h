@@ -0,0 +1,110 @@
+/**
+ * SharedTileStore: a slow, shared tier of the tile cache behind the local
+ * one.
+ *
+ * Hosts with small local disks share a large store of tiles, either a
+ * directory (e.g., on NFS) or an S3-compatible HTTP endpoint (a bucket
+ * URL, e.g., of MinIO). Requests to an endpoint are signed with AWS SigV4,
+ * or carry an Authorization header, or are anonymous. The tiers are, from
+ * fast to slow:
+ *
+ *    memory  decoded tiles of crops (DecodedTileCache)
+ *    local   the tile cache directory (mapscache), usually on a local SSD
+ *    shared  this store
+ *    origin  the tileservers
+ *
+ * A tile that is not in the local cache is looked up here before it is
+ * downloaded, and promoted into the local cache if it is found (read
+ * through). Downloaded tiles are written back to the store in the
+ * background, so that the other hosts find them there.
+ *
+ * Tiles are stored as <service hash>/<z>/<x>/<y>.jpg, whatever the layout
+ * of the local caches.
+ *
+ * Every host promotes what it finds in the store into its own cache, so
+ * whoever can write to the store can replace the imagery of all of them.
+ * Only trusted hosts should have write access.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "cancellation.h"
+
+namespace gzsatellite {
+
+  class SharedTileStore
+  {
+  public:
+    struct Stats
+    {
+      unsigned long hits;           ///< tiles found in the store
+      unsigned long misses;         ///< tiles looked up in vain
+      unsigned long writes;         ///< tiles written back
+      unsigned long write_failures; ///< tiles that could not be written back
+      unsigned long dropped;        ///< write-backs dropped, the queue was full
+    };
+
+    /// A directory, or an http(s):// URL under which tiles are objects.
+    /// For a URL, auth is empty (anonymous requests), "aws:<region>" to
+    /// sign them with the keys in AWS_ACCESS_KEY_ID, AWS_SECRET_ACCESS_KEY
+    /// (and AWS_SESSION_TOKEN), or else the value of an Authorization
+    /// header. Throws std::invalid_argument if the store cannot be used.
+    explicit SharedTileStore(const std::string& location, const std::string& auth = "",
+                             size_t max_queued = 4096);
+
+    /// Writes back what is still queued, for a few seconds at most
+    ~SharedTileStore();
+
+    const std::string& location() const { return location_; }
+
+    /// Blocking read of tile [x,y,z] of a service
+    bool get(const std::string& service_hash, int x, int y, int z, std::string& data,
+             const CancelToken* cancel = nullptr);
+
+    /// Queue tile [x,y,z] of a service to be written back (not for tiles
+    /// that were promoted from the store)
+    void put(const std::string& service_hash, int x, int y, int z, const std::string& data);
+
+    Stats stats() const;
+
+  private:
+    std::string location_;
+    bool http_;
+    std::vector<std::string> headers_; ///< of every request
+    std::string credentials_;
+    std::string aws_sigv4_;
+    size_t max_queued_;
+
+    // write-back queue
+    std::deque<std::pair<std::string, std::string>> queue_;
+    std::mutex mutex_;
+    std::condition_variable queued_;
+    bool stopping_;
+    std::thread writer_;
+
+    std::atomic<unsigned long> num_hits_;
+    std::atomic<unsigned long> num_misses_;
+    std::atomic<unsigned long> num_writes_;
+    std::atomic<unsigned long> num_write_failures_;
+    std::atomic<unsigned long> num_dropped_;
+
+    static std::string key(const std::string& service_hash, int x, int y, int z);
+
+    bool read(const std::string& key, std::string& data, const CancelToken* cancel);
+    bool write(const std::string& key, const std::string& data);
+
+    void writeBack();
+  };
+
+}
@@ -0,0 +1,68 @@
+/**
+ * TickScheduler: background work that stays out of the simulation's way.
+ *
+ * Building a world (downloads, decoding, stitching, encoding) runs on
+ * worker threads, which setBackgroundPriority() moves behind the physics
+ * for the CPU and the disk. The little work that has to happen on the
+ * simulation thread (inserting and removing models) is posted to a
+ * TickScheduler instead, which runs it from the world update callback a
+ * few tasks a tick, within a time budget, so that no single tick stalls.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+namespace gzsatellite {
+
+  /// Lower the CPU priority (to nice) and the I/O priority (to the lowest
+  /// best effort one, or to idle) of the calling thread. Threads that it
+  /// starts later inherit them. Only lowers priorities on Linux.
+  void setBackgroundPriority(int nice, bool idle_io = false);
+
+  class TickScheduler
+  {
+  public:
+    typedef std::function<void()> Task;
+
+    struct Stats
+    {
+      unsigned long tasks;    ///< tasks run
+      unsigned long ticks;    ///< ticks that ran tasks
+      unsigned long deferred; ///< ticks that left tasks for later
+      double max_us;          ///< longest a tick spent on tasks
+    };
+
+    explicit TickScheduler(double budget_us = 2000);
+
+    /// Time per tick to spend on tasks, in us. A tick runs at least one.
+    void setBudget(double budget_us) { budget_us_ = budget_us; }
+
+    /// Queue a task for the next ticks (from any thread)
+    void post(const Task& task);
+
+    /// Run queued tasks, in order, until the budget is spent; called once
+    /// a tick, on the simulation thread
+    void run();
+
+    /// Tasks waiting for a tick
+    size_t pending() const;
+
+    /// Stats since the last reset
+    Stats stats() const;
+    void resetStats();
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    double budget_us_;
+    std::deque<Task> tasks_;
+    mutable std::mutex mutex_;
+    Stats stats_;
+  };
+
+}
@@ -0,0 +1,64 @@
+/**
+ * DecodedTileCache: decoded tile images, least recently used first out.
+ *
+ * Crops of the imagery mostly touch the same few tiles over and over, e.g.,
+ * around a vehicle that moves slowly. Keeping those tiles decoded saves
+ * reading and decoding them again for every crop. The images in the cache
+ * share their pixels with the ones handed out, so they must not be
+ * modified.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <opencv2/opencv.hpp>
+
+#include "tilerange.h"
+
+namespace gzsatellite {
+
+  class DecodedTileCache
+  {
+  public:
+    /// Holds up to capacity bytes of pixels (0: nothing is cached)
+    explicit DecodedTileCache(size_t capacity);
+
+    void setCapacity(size_t capacity);
+
+    /// The decoded image of a tile, if it is in the cache
+    bool get(TileKey key, cv::Mat& image);
+
+    /// Add (or replace) the decoded image of a tile
+    void put(TileKey key, const cv::Mat& image);
+
+    /// Forget a tile, e.g., once its cached file changed
+    void erase(TileKey key);
+
+    /// Bytes of pixels in the cache
+    size_t size() const;
+
+    /// Lookups that found their tile, and that did not
+    unsigned long hits() const;
+    unsigned long misses() const;
+
+  private:
+    typedef std::list<std::pair<TileKey, cv::Mat>> Entries;
+
+    Entries entries_; // most recently used first
+    std::unordered_map<TileKey, Entries::iterator> index_;
+    size_t capacity_;
+    size_t size_;
+    unsigned long hits_, misses_;
+    mutable std::mutex mutex_;
+
+    /// Requires mutex_
+    void remove(Entries::iterator it);
+    void evict();
+  };
+
+}
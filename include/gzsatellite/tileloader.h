@@ -30,47 +30,165 @@
 #include <memory>
 #include <fstream>
 #include <functional>
+#include <mutex>
 #include <stdexcept>
 
 #include <boost/filesystem.hpp>
-#include <boost/regex.hpp>
 
-#include <cpr/cpr.h>
+#include <opencv2/opencv.hpp>
+
+#include "cachelayout.h"
+#include "cancellation.h"
+#include "decodedtilestore.h"
+#include "sharedtilestore.h"
+#include "tilecache.h"
+#include "tileprovider.h"
+#include "tilerange.h"
+#include "tilewritequeue.h"
 
 namespace gzsatellite {
 
   class TileLoader {
   public:
-    class MapTile {
-    public:     
-      MapTile(int x, int y, int z, const boost::filesystem::path& path)
-        : x_(x), y_(y), z_(z), path_(path) {}
-
-      /// X tile coordinate.
-      int x() const { return x_; }
-
-      /// Y tile coordinate.
-      int y() const { return y_; }
-        
-      /// Z tile zoom value.
-      int z() const { return z_; }
-
-      /// Image associated with this tile.
-      const boost::filesystem::path& imagePath() const { return path_; }
-
-    private:
-      int x_;
-      int y_;
-      int z_;
-      boost::filesystem::path path_;
+    /// A crop of the imagery, on the Web Mercator pixel grid of the zoom level
+    struct Crop
+    {
+      int x, y;                 ///< top left pixel at the zoom level
+      int width, height;        ///< size in pixels at the zoom level
+      int out_width, out_height; ///< size of the (rescaled) image
+      int scale;                ///< tiles are decoded at 1/scale of their size
+      double north, west, south, east; ///< outer edges (degrees)
+      double resolution;        ///< m/px of the image at its center
     };
 
+    /// Largest crop in pixels per side, as decoded and after rescaling
+    static constexpr int maxCropSize() { return 8192; }
+
+    /// A tileSize of 0 uses the size recorded for the service, or that of
+    /// its cached center tile. Without either, the size is assumed (and
+    /// not recorded) until detectTileSize() downloads a tile; nothing is
+    /// downloaded here. New caches are created in cacheLayout; existing
+    /// ones keep theirs.
     explicit TileLoader(const std::string& cacheRoot, const std::string& service,
                         double latitude, double longitude,
-                        unsigned int zoom, double width, double height);
+                        unsigned int zoom, double width, double height,
+                        int tileSize = 0, CacheLayout cacheLayout = CacheLayout::Zxy);
+
+    /// Ordered chain of services: the first one is preferred, the others
+    /// are fallbacks for tiles it does not have or while it is unhealthy.
+    /// The tile size is that of the first service.
+    explicit TileLoader(const std::string& cacheRoot,
+                        const std::vector<std::string>& services,
+                        double latitude, double longitude,
+                        unsigned int zoom, double width, double height,
+                        int tileSize = 0, CacheLayout cacheLayout = CacheLayout::Zxy);
+
+    /// blocking call to load all tiles. Without download, only the range
+    /// is set up and the cache is not touched. A download detects the tile
+    /// size first, if it is not known yet. Throws Cancelled if the
+    /// load is aborted. With a journal, a load that was interrupted
+    /// resumes where it stopped. With a write queue, tiles are only
+    /// Available once they are on disk.
+    const TileRange& loadTiles(bool download = true);
+
+    /// Keep a DownloadJournal of loadTiles at path (empty: none). The
+    /// journal is removed once all tiles are loaded.
+    void setJournal(const std::string& path) { journal_path_ = path; }
+
+    /// Blocking download of the image for tile [x,y] from the first
+    /// provider that has it. provider is set to the index of that provider.
+    /// False on failure, or right away if no provider can take requests.
+    /// Without a token, the request is cancelled by abort().
+    bool fetchTile(int x, int y, std::string& data, int* provider = nullptr,
+                   const CancelToken* cancel = nullptr) const;
+
+    /// Write image data of tile [x,y] into the cache of a provider, and
+    /// back to the shared tier unless it was promoted from there. With a
+    /// write queue, the tile is only queued (and true means just that).
+    bool storeTile(int x, int y, const std::string& data, int provider = 0,
+                   bool write_back = true) const;
+
+    /// Encode a decoded image of tile [x,y] into the cache of a provider
+    bool storeTile(int x, int y, const cv::Mat& image, int provider = 0) const;
+
+    /// Path of tile [x,y] in the cache of a fallback provider, if any has it
+    bool findFallbackTile(int x, int y, boost::filesystem::path& path) const;
+
+    /// Look up the tiles of the providers in a shared tier behind their
+    /// caches, and write the tiles stored from now on back to it
+    void setSharedStore(const std::shared_ptr<SharedTileStore>& store) { shared_ = store; }
+
+    /// Tile [x,y] of the first provider that has it in the shared tier;
+    /// provider is set to its index. False without a shared tier.
+    bool findSharedTile(int x, int y, std::string& data, int* provider = nullptr,
+                        const CancelToken* cancel = nullptr) const;
+
+    /// Write the tiles stored from now on behind, in batches (null: write
+    /// them right away)
+    void setWriteQueue(const std::shared_ptr<TileWriteQueue>& queue) { write_queue_ = queue; }
+
+    /// Tile [x,y] of the first provider that has it queued to be written to
+    /// its cache; provider is set to its index
+    bool findQueuedTile(int x, int y, std::string& data, int* provider = nullptr) const;
+
+    /// Whether the service is a WMS GetMap template (with a {bbox} field)
+    bool isWms() const { return providers_[0]->isWms(); }
+
+    /// Largest WMS GetMap image to request, in pixels per side
+    void setMaxRequestSize(int px) { max_request_size_ = px; }
+
+    /// Tiles per side fetched with a single request (1 for XYZ services)
+    int tilesPerRequest() const;
+
+    /// Hedge requests of all providers (see TileProvider::setHedging).
+    /// The mirrors are those of the first service.
+    void setHedging(double percentile, const std::vector<std::string>& mirrors);
+
+    /// Blocking download of a whole block of tiles with a single request
+    /// to the first WMS provider that has it. On success, tiles holds the
+    /// block's images in row-major order.
+    bool fetchBlock(const TileRange& block, std::vector<cv::Mat>& tiles,
+                    int* provider = nullptr, const CancelToken* cancel = nullptr) const;
+
+    /// Crop covering a lat/lon bounding box (degrees), at a ground
+    /// resolution in m/px (0: that of the tiles). Below the tiles'
+    /// resolution, tiles are decoded at 1/2, 1/4 or 1/8 of their size where
+    /// that is still at least the resolution asked for. Throws
+    /// std::invalid_argument for empty, invalid or too large boxes.
+    Crop planCrop(double north, double west, double south, double east,
+                  double resolution = 0) const;
+
+    /// Assemble a crop from the cached tiles (of any provider) into a
+    /// CV_8UC3 image. An image of the right size and type is written in
+    /// place, so it can wrap memory the caller owns. Tiles that are not in
+    /// the cache are black; returns how many there were. Only the tiles
+    /// that intersect the crop are read, from the decoded tile cache if
+    /// they are in it. Thread safe.
+    int crop(const Crop& crop, cv::Mat& image) const;
+
+    /// Bytes of decoded tiles to keep for crops
+    void setDecodedCacheSize(size_t bytes) { decoded_.setCapacity(bytes); }
+
+    /// Decoded tiles kept for crops (the memory tier of the cache)
+    const DecodedTileCache& decodedCache() const { return decoded_; }
+
+    /// Keep the tiles decoded for mosaics on disk, too (null: don't)
+    void setDecodedStore(const std::shared_ptr<DecodedTileStore>& store) { decoded_store_ = store; }
+    DecodedTileStore* decodedStore() const { return decoded_store_.get(); }
+
+    /// Path of the cached image for tile [x,y] of a provider
+    boost::filesystem::path tilePath(int x, int y, int provider = 0) const
+    { return cachedPathForTile(x, y, zoom_, provider); }
+
+    /// The provider chain, in order of preference
+    const std::vector<std::unique_ptr<TileProvider>>& providers() const
+    { return providers_; }
+
+    /// Determine the tile index range for x, y
+    void tileRange(int& min_x, int& max_x, int& min_y, int& max_y) const;
 
-    /// blocking call to load all tiles
-    const std::vector<MapTile>& loadTiles(bool download = true);
+    /// Range of tiles needed, with all tiles pending
+    TileRange range() const;
 
     /// Meters/pixel of the tiles.
     double resolution() const;
@@ -103,28 +221,50 @@ namespace gzsatellite {
     static double zoomToResolution(double lat, unsigned int zoom);
 
     /// Path to tiles on the server.
-    const std::string& objectURI() const { return object_uri_; }
+    const std::string& objectURI() const { return providers_[0]->service(); }
 
-    /// Hash of the tile service provider
+    /// Hash of the tile service provider chain
     const std::string& serviceHash() const { return service_hash_; }
 
     /// Path of the cached images
-    const std::string& cachePath() const { return cache_path_.string(); }
+    std::string cachePath() const { return providers_[0]->cachePath().string(); }
 
-    /// Current set of tiles.
-    const std::vector<MapTile>& tiles() const { return tiles_; }
+    /// Current set of tiles and their status.
+    const TileRange& tiles() const { return tiles_; }
 
-    /// Cancel all current requests.
+    /// Cancel all current requests, and all work using the current token.
+    /// Work started afterwards gets a fresh token.
     void abort();
 
-    /// Size of a square image in pixels
-    static constexpr int imageSize() { return 256; }
+    /// Token that the next abort() cancels
+    CancelToken cancelToken() const;
+
+    /// Size of a square tile image of this service in pixels
+    int imageSize() const { return tile_size_; }
+
+    /// False while the tile size is only assumed: it was neither given,
+    /// recorded nor found in the cache
+    bool tileSizeKnown() const { return !tile_size_pending_; }
+
+    /// Download the center tile to detect the tile size, if it is not
+    /// known yet, and record it. Throws Cancelled if cancelled.
+    void detectTileSize(const CancelToken* cancel = nullptr);
+
+    /// Tile size of the classic slippy map tiles the zoom levels refer to
+    static constexpr int baseTileSize() { return 256; }
 
     const int numTilesToDownload() const;
 
     /// Number of tiles that will be used
     const int numTiles(int* x = nullptr, int* y = nullptr) const;
 
+    /// Number of tiles the region takes at another zoom level
+    int numTilesAt(unsigned int zoom, int* x = nullptr, int* y = nullptr) const;
+
+    /// Move the region to another zoom level: the tile range is set up
+    /// anew, and work in progress is aborted. Not while crops are served.
+    void setZoom(unsigned int zoom);
+
     // A unique hash of this loader's parameters
     const std::string hash() const;
 
@@ -133,6 +273,8 @@ namespace gzsatellite {
     double longitude_;
     unsigned int zoom_;
     double width_, height_;
+    int tile_size_;
+    bool tile_size_pending_; ///< only assumed, see detectTileSize()
     int center_tile_x_;
     int center_tile_y_;
     double origin_offset_x_;
@@ -140,27 +282,50 @@ namespace gzsatellite {
     int x_tiles_below_, x_tiles_above_;
     int y_tiles_below_, y_tiles_above_;
 
-    boost::filesystem::path cache_path_;
-
-    std::string object_uri_;
+    std::vector<std::unique_ptr<TileProvider>> providers_;
     std::string service_hash_;
+    int max_request_size_;
+
+    TileRange tiles_;
+    std::string journal_path_;
 
-    std::vector<MapTile> tiles_;
-    
-    /// URI for tile [x,y]
-    std::string uriForTile(int x, int y) const;
+    CancelToken cancel_;
+    mutable std::mutex cancel_mutex_;
 
-    /// Get name for cached tile [x,y,z]
-    std::string cachedNameForTile(int x, int y, int z) const;
+    mutable DecodedTileCache decoded_;
+    std::shared_ptr<SharedTileStore> shared_;
+    std::shared_ptr<DecodedTileStore> decoded_store_;
+    std::shared_ptr<TileWriteQueue> write_queue_;
 
-    /// Get file path for cached tile [x,y,z].
-    boost::filesystem::path cachedPathForTile(int x, int y, int z) const;
+    /// Provider indices in the order to try them: healthy providers in
+    /// configured order, then degraded ones from best to worst score
+    std::vector<int> providerOrder() const;
+
+    /// Get file path for cached tile [x,y,z] of a provider.
+    boost::filesystem::path cachedPathForTile(int x, int y, int z, int provider = 0) const;
+
+    /// Copy part of tile [x,y], decoded at 1/scale of its size, into dst, a
+    /// view of part's size. False if the tile is not in the cache.
+    bool cropTile(int x, int y, int scale, const cv::Rect& part, cv::Mat& dst) const;
 
     /// Maximum number of tiles for the zoom level
     int maxTiles() const;
 
-    /// Determine the tile index range for x, y
-    void tileRange(int& min_x, int& max_x, int& min_y, int& max_y) const;
+    /// Use the configured, recorded or cached tile size of the service
+    void setupTileSize(int tileSize);
+
+    /// Record the tile size next to the tiles of the service
+    void recordTileSize() const;
+
+    /// Center tile of the region, and the origin's offset within it
+    void computeCenterTile();
+
+    /// Number of tiles needed around the center tile, given the tile size
+    void computeTileCounts();
+
+    /// Tiles needed around the center tile at a zoom level
+    void tileCounts(unsigned int zoom, int& x_below, int& x_above,
+                    int& y_below, int& y_above) const;
   };
 
 }
@@ -0,0 +1,163 @@
+/**
+ * TileProvider: one tileserver of a TileLoader's ordered provider chain.
+ *
+ * A provider knows how to request tiles (XYZ template, WMS GetMap, or a
+ * local GeoTIFF as geotiff://<path>), keeps
+ * its tiles in its own cache namespace, hedges slow requests, and tracks
+ * its health: a moving average of latency and error rate, and a circuit
+ * breaker that stops sending requests to a provider that keeps failing
+ * until a cool-down has passed.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "cachelayout.h"
+#include "cancellation.h"
+#include "geotiffsource.h"
+#include "httpclient.h"
+#include "tilerange.h"
+
+namespace gzsatellite {
+
+  class TileProvider
+  {
+  public:
+    enum class Circuit { Closed, Open, HalfOpen };
+
+    struct Health
+    {
+      unsigned long requests;
+      unsigned long failures;
+      double latency;    ///< moving average of request durations (s)
+      double error_rate; ///< moving average, 0..1
+      Circuit circuit;
+    };
+
+    struct HedgeStats
+    {
+      unsigned long requests;   ///< requests sent
+      unsigned long hedged;     ///< requests that were hedged
+      unsigned long hedge_wins; ///< hedges that answered first
+      double p99;               ///< p99 response time (s)
+      double p99_unhedged;      ///< lower bound of the p99 without hedging (s)
+    };
+
+    /// Tiles of service are cached in cacheRoot/<hash of service>, in the
+    /// layout recorded there (`layout` if the cache is new)
+    TileProvider(const std::string& cacheRoot, const std::string& service,
+                 CacheLayout layout = CacheLayout::Zxy);
+
+    /// Template of the service
+    const std::string& service() const { return service_; }
+
+    /// Hash of the service, naming its cache namespace
+    const std::string& serviceHash() const { return service_hash_; }
+
+    /// Directory of the cached images of this service
+    const boost::filesystem::path& cachePath() const { return cache_path_; }
+
+    /// Path of the cached image of tile [x,y,z]
+    boost::filesystem::path tilePath(int x, int y, int z) const
+    { return cache_path_ / cacheLayoutPath(layout_, x, y, z); }
+
+    CacheLayout cacheLayout() const { return layout_; }
+
+    /// Whether the service is a WMS GetMap template (with a {bbox} field)
+    bool isWms() const { return wms_; }
+
+    /// Whether tiles are rendered from a local GeoTIFF instead of requested
+    bool isLocal() const { return static_cast<bool>(geotiff_); }
+
+    /// Send a duplicate request (to the next mirror, or to the service
+    /// again) once a request takes longer than the given percentile of
+    /// recent response times; the first response wins. 0 disables hedging.
+    /// Mirrors are templates for the same imagery, e.g. on other subdomains.
+    void setHedging(double percentile, const std::vector<std::string>& mirrors);
+
+    HedgeStats hedgeStats() const;
+
+    /// Blocking download of tile [x,y,z] of tile_size px
+    bool fetchTile(int x, int y, int z, int tile_size, std::string& data,
+                   const CancelToken* cancel = nullptr);
+
+    /// Blocking WMS download of a block of tiles as a single image
+    bool fetchBlock(const TileRange& block, int tile_size, std::string& data,
+                    const CancelToken* cancel = nullptr);
+
+    /// Claim the right to send a request: false while the circuit is open,
+    /// or while a half-open circuit is already being probed.
+    bool acquire();
+
+    /// Lower is better: latency, penalized by the error rate. Infinite
+    /// while the circuit is not closed.
+    double score() const;
+
+    Health health() const;
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::string service_;
+    std::string service_hash_;
+    boost::filesystem::path cache_path_;
+    CacheLayout layout_;
+    bool wms_;
+    std::unique_ptr<GeoTiffSource> geotiff_;
+
+    // hedged requests
+    static constexpr size_t kMinHedgeSamples = 20;
+    double hedge_percentile_;
+    std::vector<std::string> mirrors_;
+    std::atomic<unsigned int> next_mirror_;
+    LatencyTracker latency_;         ///< of responses
+    LatencyTracker primary_latency_; ///< of first requests, even if cancelled
+    std::atomic<unsigned long> num_hedged_;
+    std::atomic<unsigned long> num_hedge_wins_;
+
+    // health
+    mutable std::mutex health_mutex_;
+    unsigned long num_requests_;
+    unsigned long num_failures_;
+    unsigned int consecutive_failures_;
+    double latency_avg_;
+    double error_rate_;
+    Circuit circuit_;
+    bool probing_;           ///< a half-open trial request is in flight
+    Clock::time_point retry_at_;
+    double cooldown_;        ///< seconds the circuit stays open
+
+    /// URI for tile [x,y,z] of a service template
+    std::string uriForTile(int x, int y, int z, int tile_size,
+                           const std::string& service) const;
+
+    /// WMS GetMap URI for a block of tiles of a service template
+    std::string uriForBlock(const TileRange& block, int tile_size,
+                            const std::string& service) const;
+
+    /// Service template the next hedged request goes to
+    const std::string& hedgeService();
+
+    /// Blocking (possibly hedged) GET of url. False unless it returns 200.
+    bool get(const std::string& url, const std::string& hedge_url, std::string& data,
+             const CancelToken* cancel);
+
+    void reportSuccess(double latency);
+    void reportFailure(double latency);
+
+    /// A cancelled request says nothing about health, but ends a probe
+    void reportCancelled();
+
+    /// Update the moving average; requires health_mutex_
+    void addLatency(double latency);
+  };
+
+}
@@ -0,0 +1,188 @@
+/**
+ * TileRange: a rectangular range of tiles at one zoom level.
+ *
+ * Instead of materializing one object (and one path) per tile, a range
+ * only stores its bounds and a packed 2 bit status per tile. Individual
+ * tiles are produced on demand by iterating over the range.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace gzsatellite {
+
+  /// Packed (z, x, y) tile identifier: 6 bits of zoom, 29 bits each of x, y
+  typedef uint64_t TileKey;
+
+  /// Highest supported zoom level: its tile indices still fit into a TileKey
+  static constexpr unsigned int kMaxZoom = 29;
+
+  inline TileKey packTileKey(int x, int y, int z)
+  {
+    return (static_cast<uint64_t>(z) << 58)
+         | (static_cast<uint64_t>(x) << 29)
+         |  static_cast<uint64_t>(y);
+  }
+
+  inline void unpackTileKey(TileKey key, int& x, int& y, int& z)
+  {
+    z = static_cast<int>(key >> 58);
+    x = static_cast<int>((key >> 29) & ((1u << 29) - 1));
+    y = static_cast<int>(key & ((1u << 29) - 1));
+  }
+
+  enum class TileStatus : uint8_t
+  {
+    Pending   = 0, ///< not looked at yet
+    InFlight  = 1, ///< being downloaded
+    Available = 2, ///< image is in the cache
+    Failed    = 3  ///< could not be loaded
+  };
+
+  class TileRange
+  {
+  public:
+    /// One tile of the range, produced on demand
+    struct Tile
+    {
+      int x, y, z;
+      size_t index;
+      TileStatus status;
+
+      TileKey key() const { return packTileKey(x, y, z); }
+    };
+
+    class const_iterator
+    {
+    public:
+      typedef std::forward_iterator_tag iterator_category;
+      typedef Tile value_type;
+      typedef std::ptrdiff_t difference_type;
+      typedef const Tile* pointer;
+      typedef Tile reference;
+
+      const_iterator(const TileRange* range, size_t index, unsigned int mask)
+        : range_(range), index_(index), mask_(mask) { skip(); }
+
+      Tile operator*() const { return range_->tile(index_); }
+
+      const_iterator& operator++() { index_++; skip(); return *this; }
+      const_iterator operator++(int) { const_iterator it = *this; ++(*this); return it; }
+
+      bool operator==(const const_iterator& o) const { return index_ == o.index_; }
+      bool operator!=(const const_iterator& o) const { return index_ != o.index_; }
+
+    private:
+      const TileRange* range_;
+      size_t index_;
+      unsigned int mask_; ///< bit per TileStatus to visit
+
+      void skip()
+      {
+        while (index_ < range_->size()
+               && !(mask_ & (1u << static_cast<int>(range_->status(index_)))))
+          index_++;
+      }
+    };
+
+    /// The tiles of a range that have a given status
+    class Selection
+    {
+    public:
+      Selection(const TileRange* range, unsigned int mask) : range_(range), mask_(mask) {}
+      const_iterator begin() const { return const_iterator(range_, 0, mask_); }
+      const_iterator end() const { return const_iterator(range_, range_->size(), mask_); }
+
+    private:
+      const TileRange* range_;
+      unsigned int mask_;
+    };
+
+    TileRange() : min_x_(0), min_y_(0), cols_(0), rows_(0), z_(0) {}
+
+    /// Inclusive bounds [min_x, max_x] x [min_y, max_y] at zoom z
+    TileRange(int min_x, int max_x, int min_y, int max_y, int z)
+      : min_x_(min_x), min_y_(min_y),
+        cols_(std::max(0, max_x - min_x + 1)), rows_(std::max(0, max_y - min_y + 1)),
+        z_(z), status_((size() + 3)/4, 0)
+    {
+      if (z < 0 || static_cast<unsigned int>(z) > kMaxZoom)
+        throw std::invalid_argument("Zoom level " + std::to_string(z) + " too high");
+    }
+
+    int minX() const { return min_x_; }
+    int minY() const { return min_y_; }
+    int maxX() const { return min_x_ + cols_ - 1; }
+    int maxY() const { return min_y_ + rows_ - 1; }
+    int cols() const { return cols_; }
+    int rows() const { return rows_; }
+    int zoom() const { return z_; }
+
+    /// Number of tiles in the range
+    size_t size() const { return static_cast<size_t>(cols_)*rows_; }
+    bool empty() const { return size() == 0; }
+
+    bool contains(int x, int y) const
+    { return x >= min_x_ && x <= maxX() && y >= min_y_ && y <= maxY(); }
+
+    /// Row-major index of tile [x,y]
+    size_t indexOf(int x, int y) const
+    { return static_cast<size_t>(y - min_y_)*cols_ + (x - min_x_); }
+
+    /// Tile at row-major index i
+    Tile tile(size_t i) const
+    {
+      Tile t;
+      t.x = min_x_ + static_cast<int>(i % cols_);
+      t.y = min_y_ + static_cast<int>(i / cols_);
+      t.z = z_;
+      t.index = i;
+      t.status = status(i);
+      return t;
+    }
+
+    TileStatus status(size_t i) const
+    { return static_cast<TileStatus>((status_[i/4] >> (2*(i%4))) & 0x3); }
+
+    /// Not thread-safe: neighbouring tiles share a byte
+    void setStatus(size_t i, TileStatus s)
+    {
+      uint8_t& byte = status_[i/4];
+      byte = (byte & ~(0x3 << (2*(i%4)))) | (static_cast<uint8_t>(s) << (2*(i%4)));
+    }
+
+    /// Number of tiles with the given status
+    size_t count(TileStatus s) const
+    {
+      size_t n = 0;
+      for (size_t i=0; i<size(); i++)
+        if (status(i) == s) n++;
+      return n;
+    }
+
+    /// Packed statuses, four tiles per byte (e.g., for checkpointing)
+    const std::vector<uint8_t>& statusBits() const { return status_; }
+    std::vector<uint8_t>& statusBits() { return status_; }
+
+    const_iterator begin() const { return const_iterator(this, 0, 0xF); }
+    const_iterator end() const { return const_iterator(this, size(), 0xF); }
+
+    /// Iterate only over the tiles with status s
+    Selection select(TileStatus s) const
+    { return Selection(this, 1u << static_cast<int>(s)); }
+
+  private:
+    int min_x_, min_y_;
+    int cols_, rows_;
+    int z_;
+    std::vector<uint8_t> status_;
+  };
+
+}
@@ -0,0 +1,131 @@
+/**
+ * TileReader: batched reads of cached tile images.
+ *
+ * Reading a warm cache one tile at a time costs an open/read/close round
+ * trip per tile, which adds up on network filesystems and cold page caches.
+ * On Linux (when built with liburing) whole batches of opens, reads and
+ * closes are submitted to io_uring at once; otherwise, or if the kernel
+ * does not support the needed operations, a small thread pool is used.
+ * A TileReader sets up its ring once and reuses it for every read().
+ *
+ * Every file is checked against its size, so that a short read is either
+ * completed or reported as a failed read, never passed on as a whole tile.
+ *
+ * File contents land in pooled buffers that are recycled once the consumer
+ * (e.g., the decoder) is done with them.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cancellation.h"
+
+namespace gzsatellite {
+
+  class BufferPool;
+
+  /// A byte buffer that goes back to its pool when destroyed
+  class PooledBuffer
+  {
+  public:
+    PooledBuffer() : pool_(nullptr), size_(0) {}
+    PooledBuffer(BufferPool* pool, std::vector<char>&& storage);
+    PooledBuffer(PooledBuffer&& other);
+    PooledBuffer& operator=(PooledBuffer&& other);
+    ~PooledBuffer();
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    char* data() { return storage_.data(); }
+    const char* data() const { return storage_.data(); }
+
+    /// Number of valid bytes
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    /// Bytes available without reallocating
+    size_t capacity() const { return storage_.size(); }
+
+    /// Set the number of valid bytes, growing the storage if needed
+    void resize(size_t size);
+
+  private:
+    BufferPool* pool_;
+    std::vector<char> storage_;
+    size_t size_;
+  };
+
+  class BufferPool
+  {
+  public:
+    /// Buffers of buffer_size bytes; at most max_free are kept for reuse
+    BufferPool(size_t buffer_size, size_t max_free);
+
+    PooledBuffer acquire();
+
+  private:
+    friend class PooledBuffer;
+    void release(std::vector<char>&& storage);
+
+    size_t buffer_size_;
+    size_t max_free_;
+    std::vector<std::vector<char>> free_;
+    std::mutex mutex_;
+  };
+
+  class TileReader
+  {
+  public:
+    /// Path of the i-th file to read
+    typedef std::function<std::string(size_t index)> PathFn;
+
+    /// Completion of the i-th read. The buffer is empty if the file is
+    /// missing or could not be read. May be called from several threads.
+    typedef std::function<void(size_t index, PooledBuffer&& data)> Callback;
+
+    TileReader(BufferPool& pool, unsigned int threads, unsigned int batch_size);
+    ~TileReader();
+
+    TileReader(const TileReader&) = delete;
+    TileReader& operator=(const TileReader&) = delete;
+
+    /// Blocking call to read `count` files, reporting each as it completes.
+    /// Once cancelled, no further reads are started. Not thread safe: a
+    /// TileReader serves one reading thread.
+    void read(size_t count, const PathFn& path_for, const Callback& done,
+              const CancelToken* cancel = nullptr);
+
+  private:
+    struct Ring;
+
+    BufferPool& pool_;
+    unsigned int threads_;
+    unsigned int batch_size_;
+
+    std::unique_ptr<Ring> ring_; ///< set up on the first read()
+    bool uring_unavailable_;     ///< no io_uring (or no support for our ops)
+
+    /// Submit reads in batches to io_uring. False if io_uring is unavailable.
+    bool readUring(size_t count, const PathFn& path_for, const Callback& done,
+                   const CancelToken* cancel);
+
+    /// Plain blocking reads, spread across a few threads
+    void readThreaded(size_t count, const PathFn& path_for, const Callback& done,
+                      const CancelToken* cancel);
+
+    /// Complete the first read of a file (res bytes, or an error) of size
+    /// bytes (negative: unknown). False unless the whole file was read.
+    static bool finishRead(int fd, PooledBuffer& buffer, long res, long long size);
+
+    /// Read whatever did not fit into the first read of a file
+    static bool readRemainder(int fd, PooledBuffer& buffer);
+  };
+
+}
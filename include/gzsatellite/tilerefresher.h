@@ -0,0 +1,61 @@
+/**
+ * TileRefresher: keeps the cached tiles of a TileLoader's range fresh.
+ *
+ * The fetch time of a tile is the modification time of its cache file,
+ * which is written once per download. Tiles older than the TTL are still
+ * used as they are; a background thread at the lowest CPU priority then
+ * downloads them again, one at a time, and calls back once it is done so
+ * that the mosaics made from them can be rebuilt. A tile that cannot be
+ * refreshed keeps its stale image.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <thread>
+
+#include "cancellation.h"
+#include "tileloader.h"
+
+namespace gzsatellite {
+
+  class TileRefresher
+  {
+  public:
+    /// Called on the background thread with the number of refreshed tiles,
+    /// and a token that stop() cancels
+    typedef std::function<void(size_t, const CancelToken&)> Callback;
+
+    /// Tiles are stale once they were fetched more than ttl seconds ago
+    TileRefresher(const TileLoader& loader, double ttl);
+
+    /// Stops the background thread
+    ~TileRefresher();
+
+    /// Refresh the stale tiles of the loader's range in the background.
+    /// done is only called if at least one tile was refreshed.
+    void start(const Callback& done);
+
+    /// Cancel the current download (or callback) and wait for the
+    /// background thread. The loader's abort() stops it, too.
+    void stop();
+
+    /// Number of stale tiles in the loader's range (stats every tile)
+    size_t countStale() const;
+
+  private:
+    const TileLoader& loader_;
+    double ttl_;
+
+    std::thread thread_;
+    CancelToken cancel_;
+
+    /// Path of the cached image of tile [x,y] and whether it is stale.
+    /// False if the tile is not cached at all.
+    bool cachedTile(int x, int y, boost::filesystem::path& path, bool& stale) const;
+
+    void run(Callback done);
+  };
+
+}
@@ -0,0 +1,107 @@
+/**
+ * TileWriteQueue: write-behind persistence of downloaded tiles.
+ *
+ * With many downloads in flight, writing every tile into the cache as it
+ * arrives (and making it durable) holds up the downloaders, most of all on
+ * network storage. Tiles are queued here instead and written by a
+ * background thread, in batches:
+ *
+ *    1. every tile of the batch is written to a temporary file, and (on
+ *       Linux) its writeback is started right away,
+ *    2. the files are synced (fdatasync) one after the other, which by
+ *       then mostly waits for writeback that is already done,
+ *    3. they are renamed into place, and the directories they are in are
+ *       synced once each.
+ *
+ * Only the files of the batch are synced, never the whole file system
+ * (which would flush the dirty data of other processes, too).
+ *
+ * A tile thus only ever appears under its name in the cache once its data
+ * is on disk, so a crash loses at most the tiles of the batches in flight
+ * and never leaves a truncated tile behind. Until it is written, a queued
+ * tile is served from memory by find().
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+namespace gzsatellite {
+
+  class TileWriteQueue
+  {
+  public:
+    struct Stats
+    {
+      unsigned long batches;  ///< batches written (and synced)
+      unsigned long tiles;    ///< tiles written
+      unsigned long failures; ///< tiles that could not be written
+    };
+
+    /// Called on the writer thread with the data of a tile once it is on
+    /// disk, under its name
+    typedef std::function<void(const std::string&)> Callback;
+
+    /// Batches of up to batch_size tiles, each written once it is full or
+    /// linger seconds after its first tile was queued
+    explicit TileWriteQueue(size_t batch_size = 64, double linger = 0.05);
+
+    /// Writes every tile that is still queued
+    ~TileWriteQueue();
+
+    /// Queue data to be written to path. Blocks while the queue is full.
+    void push(const boost::filesystem::path& path, const std::string& data,
+              const Callback& written = Callback());
+
+    /// Data of a tile that is queued, or being written
+    bool find(const boost::filesystem::path& path, std::string& data) const;
+
+    /// Block until every tile queued so far is written
+    void flush();
+
+    Stats stats() const;
+
+  private:
+    typedef std::shared_ptr<const std::string> Data;
+
+    struct Tile
+    {
+      boost::filesystem::path path;
+      Data data;
+      Callback written;
+    };
+
+    size_t batch_size_;
+    double linger_;
+
+    std::deque<Tile> queue_;
+    std::unordered_map<std::string, Data> pending_; ///< queued or being written, by path
+    size_t writing_;                                ///< tiles being written
+    bool stopping_;
+    mutable std::mutex mutex_;
+    std::condition_variable queued_;  ///< tiles to write, or stopping
+    std::condition_variable written_; ///< a batch is done
+    std::thread writer_;
+
+    std::atomic<unsigned long> num_batches_;
+    std::atomic<unsigned long> num_tiles_;
+    std::atomic<unsigned long> num_failures_;
+
+    void run();
+
+    /// Write, sync and publish a batch. Returns which tiles were written.
+    std::vector<bool> writeBatch(const std::vector<Tile>& batch);
+  };
+
+}
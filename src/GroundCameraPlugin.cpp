@@ -0,0 +1,252 @@
+#include "gzsatellite/GroundCameraPlugin.h"
+
+namespace gazebo {
+
+GroundCameraPlugin::GroundCameraPlugin()
+  : period_(1.0/30), max_distance_(500), missing_tiles_(0),
+    pending_(false), stop_(false) {}
+
+// ----------------------------------------------------------------------------
+
+GroundCameraPlugin::~GroundCameraPlugin()
+{
+  update_connection_.reset();
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+  if (render_thread_.joinable()) render_thread_.join();
+
+  if (nh_) nh_->shutdown();
+}
+
+// ----------------------------------------------------------------------------
+
+void GroundCameraPlugin::Load(physics::ModelPtr _model, sdf::ElementPtr _sdf)
+{
+  if (!ros::isInitialized()) {
+    gzerr << "ROS is not initialized, the ground camera is disabled." << std::endl;
+    return;
+  }
+
+  //
+  // Camera parameters
+  //
+
+  const std::string link_name = _sdf->HasElement("linkName")
+      ? _sdf->Get<std::string>("linkName") : "canonical";
+  link_ = _model->GetLink(link_name);
+  if (!link_) {
+    gzerr << "Ground camera: no link '" << link_name << "' in "
+          << _model->GetName() << std::endl;
+    return;
+  }
+
+  // looking straight down by default
+  camera_pose_ = _sdf->HasElement("cameraPose")
+      ? _sdf->Get<ignition::math::Pose3d>("cameraPose")
+      : ignition::math::Pose3d(0, 0, 0, 0, M_PI/2, 0);
+
+  if (_sdf->HasElement("updateRate"))
+    period_ = 1.0 / std::max(1e-3, _sdf->Get<double>("updateRate"));
+
+  const int width = _sdf->HasElement("width") ? _sdf->Get<int>("width") : 640;
+  const int height = _sdf->HasElement("height") ? _sdf->Get<int>("height") : 480;
+  const double hfov = _sdf->HasElement("horizontalFov") ? _sdf->Get<double>("horizontalFov") : 1.047;
+  intrinsics_ = gzsatellite::GroundCamera::Intrinsics::fromFov(width, height, hfov);
+
+  // explicit intrinsics override the field of view
+  if (_sdf->HasElement("fx")) intrinsics_.fx = _sdf->Get<double>("fx");
+  if (_sdf->HasElement("fy")) intrinsics_.fy = _sdf->Get<double>("fy");
+  if (_sdf->HasElement("cx")) intrinsics_.cx = _sdf->Get<double>("cx");
+  if (_sdf->HasElement("cy")) intrinsics_.cy = _sdf->Get<double>("cy");
+
+  if (_sdf->HasElement("maxDistance"))
+    max_distance_ = _sdf->Get<double>("maxDistance");
+
+  //
+  // ROS topics
+  //
+
+  const std::string ns = _sdf->HasElement("robotNamespace")
+      ? _sdf->Get<std::string>("robotNamespace") : "";
+  const std::string image_topic = _sdf->HasElement("imageTopicName")
+      ? _sdf->Get<std::string>("imageTopicName") : "ground_camera/image_raw";
+  const std::string info_topic = _sdf->HasElement("cameraInfoTopicName")
+      ? _sdf->Get<std::string>("cameraInfoTopicName") : "ground_camera/camera_info";
+  frame_id_ = _sdf->HasElement("frameName")
+      ? _sdf->Get<std::string>("frameName") : "ground_camera";
+
+  nh_.reset(new ros::NodeHandle(ns));
+  image_pub_ = nh_->advertise<sensor_msgs::Image>(image_topic, 1);
+  info_pub_ = nh_->advertise<sensor_msgs::CameraInfo>(info_topic, 1);
+
+  // The same region, and tile cache, as the world's. A world loaded later
+  // (e.g., after ~reload) may have moved, and the camera with it.
+  try {
+    params_ = gzsatellite::readGeoParams(ros::NodeHandle("/gzsatellite"));
+  } catch (const std::invalid_argument& e) {
+    gzerr << "Ground camera: " << e.what() << std::endl;
+    return;
+  }
+  ros::NodeHandle world_nh("/gzsatellite");
+  world_nh.setCallbackQueue(&world_queue_);
+  world_sub_ = world_nh.subscribe("world_zoom", 1, &GroundCameraPlugin::onWorldZoom, this);
+
+  render_thread_ = std::thread(&GroundCameraPlugin::renderLoop, this);
+  update_connection_ = event::Events::ConnectWorldUpdateBegin(
+      std::bind(&GroundCameraPlugin::onWorldUpdate, this, std::placeholders::_1));
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void GroundCameraPlugin::onWorldUpdate(const common::UpdateInfo& info)
+{
+  // (the simulation time goes back on reset)
+  const double dt = (info.simTime - last_update_).Double();
+  if (dt >= 0 && dt < period_) return;
+  last_update_ = info.simTime;
+
+  if (image_pub_.getNumSubscribers() == 0 && info_pub_.getNumSubscribers() == 0)
+    return;
+
+  // Camera pose in the world
+  const ignition::math::Pose3d link = link_->WorldPose();
+  const ignition::math::Vector3d pos = link.Pos() + link.Rot().RotateVector(camera_pose_.Pos());
+  const ignition::math::Quaterniond rot = link.Rot() * camera_pose_.Rot();
+
+  // optical axes: x right, y down, z forward (the camera's x axis)
+  const ignition::math::Vector3d x = rot.RotateVector(ignition::math::Vector3d(0, -1, 0));
+  const ignition::math::Vector3d y = rot.RotateVector(ignition::math::Vector3d(0, 0, -1));
+  const ignition::math::Vector3d z = rot.RotateVector(ignition::math::Vector3d(1, 0, 0));
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_) return;
+
+    position_ = cv::Vec3d(pos.X(), pos.Y(), pos.Z());
+    rotation_ = cv::Matx33d(x.X(), y.X(), z.X(),
+                            x.Y(), y.Y(), z.Y(),
+                            x.Z(), y.Z(), z.Z());
+    stamp_ = info.simTime;
+    pending_ = true;
+  }
+  cond_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+void GroundCameraPlugin::onWorldZoom(const std_msgs::UInt32::ConstPtr& msg)
+{
+  // the world was loaded from the parameters as they are now
+  try {
+    params_ = gzsatellite::readGeoParams(ros::NodeHandle("/gzsatellite"));
+  } catch (const std::invalid_argument& e) {
+    gzerr << "Ground camera: " << e.what() << std::endl;
+  }
+  setupCamera(msg->data);
+}
+
+// ----------------------------------------------------------------------------
+
+void GroundCameraPlugin::setupCamera(unsigned int zoom)
+{
+  // (the camera renders from the loader)
+  camera_.reset();
+  loader_.reset();
+
+  // (tiles are only read from the cache: nothing is downloaded here)
+  gzsatellite::GeoParams params = params_;
+  params.zoom = zoom;
+  try {
+    std::vector<std::string> services(1, params.tileserver);
+    services.insert(services.end(), params.fallbacks.begin(), params.fallbacks.end());
+    loader_.reset(new gzsatellite::TileLoader(gzsatellite::kRootDir + "/mapscache", services,
+                                              params.lat, params.lon, params.zoom,
+                                              params.width, params.height,
+                                              params.tile_size, params.cache_layout));
+    camera_.reset(new gzsatellite::GroundCamera(*loader_, params, intrinsics_));
+    camera_->setMaxDistance(max_distance_);
+  } catch (const std::exception& e) {
+    gzerr << "Ground camera: " << e.what() << std::endl;
+    camera_.reset();
+    loader_.reset();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void GroundCameraPlugin::renderLoop()
+{
+  // With a texture budget, the world may use a lower zoom level than the
+  // one asked for, and announces it; otherwise, that is the one
+  if (params_.texture_budget_mb <= 0) setupCamera(params_.zoom);
+
+  while (true) {
+    cv::Vec3d position;
+    cv::Matx33d rotation;
+    common::Time stamp;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [this]() { return pending_ || stop_; });
+      if (stop_) return;
+
+      position = position_;
+      rotation = rotation_;
+      stamp = stamp_;
+    }
+
+    world_queue_.callAvailable();
+    if (camera_) publish(position, rotation, stamp);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    pending_ = false;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void GroundCameraPlugin::publish(const cv::Vec3d& position, const cv::Matx33d& rotation,
+                                 const common::Time& stamp)
+{
+  const gzsatellite::GroundCamera::Intrinsics& k = camera_->intrinsics();
+
+  sensor_msgs::Image img;
+  img.header.stamp = ros::Time(stamp.sec, stamp.nsec);
+  img.header.frame_id = frame_id_;
+  img.width = k.width;
+  img.height = k.height;
+  img.encoding = "bgr8";
+  img.is_bigendian = 0;
+  img.step = 3*k.width;
+  img.data.resize(img.step*img.height);
+
+  // render right into the message
+  cv::Mat image(img.height, img.width, CV_8UC3, img.data.data(), img.step);
+  const int missing = camera_->render(position, rotation, image);
+  if (missing > 0 && missing != missing_tiles_)
+    gzwarn << "Ground camera: " << missing << " tiles in view are not cached." << std::endl;
+  missing_tiles_ = missing;
+
+  sensor_msgs::CameraInfo info;
+  info.header = img.header;
+  info.width = k.width;
+  info.height = k.height;
+  info.distortion_model = "plumb_bob";
+  info.D.assign(5, 0.0);
+  info.K = {{ k.fx, 0, k.cx,  0, k.fy, k.cy,  0, 0, 1 }};
+  info.R = {{ 1, 0, 0,  0, 1, 0,  0, 0, 1 }};
+  info.P = {{ k.fx, 0, k.cx, 0,  0, k.fy, k.cy, 0,  0, 0, 1, 0 }};
+
+  image_pub_.publish(img);
+  info_pub_.publish(info);
+}
+
+// ----------------------------------------------------------------------------
+
+GZ_REGISTER_MODEL_PLUGIN(GroundCameraPlugin)
+}
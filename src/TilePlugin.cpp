@@ -4,9 +4,25 @@ namespace fs = boost::filesystem;
 
 namespace gazebo {
 
-static const std::string root = "./gzsatellite/";
+TilePlugin::TilePlugin()
+  : quality_(60), lazy_texture_(false), texture_needed_(false), texture_pending_(false),
+    texture_restart_(false),
+    loaded_(false), background_nice_(10), loading_(false),
+    busy_sim_(0), busy_wall_(0), idle_sim_(0), idle_wall_(0), busy_(false),
+    generation_(0), swap_pending_(false) {}
 
-TilePlugin::TilePlugin() {}
+// ----------------------------------------------------------------------------
+
+TilePlugin::~TilePlugin()
+{
+  if (nh_) nh_->shutdown();
+  if (ros_thread_.joinable()) ros_thread_.join();
+
+  // don't keep the simulator from shutting down while tiles are loading
+  std::lock_guard<std::mutex> lock(load_mutex_);
+  stopLoading();
+  if (creator_) creator_->abort();
+}
 
 // ----------------------------------------------------------------------------
 
@@ -14,51 +30,330 @@ void TilePlugin::Load(physics::WorldPtr _parent, sdf::ElementPtr _sdf)
 {
   this->parent_ = _parent;
 
-  std::string service, name;
-  double lat, lon, zoom;
+  creator_ = createModelCreator();
+
+  // Whatever renders the world subscribes to its visuals; nobody listens
+  // to what we publish here
+  ros::NodeHandle nh("/gzsatellite");
+  nh.param<bool>("lazy_texture", lazy_texture_, false);
+  if (lazy_texture_) {
+    gz_node_.reset(new transport::Node());
+    gz_node_->Init(this->parent_->Name());
+    visual_pub_ = gz_node_->Advertise<msgs::Visual>("~/visual");
+  }
+
+  // Background work yields to the physics: the world is built on threads
+  // at a lower priority, and what has to run on the simulation thread is
+  // spread over ticks
+  double budget_us;
+  nh.param<int>("background_nice", background_nice_, 10);
+  nh.param<double>("main_thread_budget_us", budget_us, 2000);
+  ticks_.setBudget(std::max(0.0, budget_us));
+
+  // Old models are removed once their replacement is in the world
+  update_connection_ = event::Events::ConnectWorldUpdateBegin(
+      std::bind(&TilePlugin::onWorldUpdate, this));
+
+  // Parameter changes are picked up through ~reload, and crops of the
+  // cached imagery are served through ~get_map_crop, on our own queue.
+  // Loads are restarted there for lazy textures, too.
+  // The zoom level of the world's tiles (lower than asked for with a
+  // texture budget) goes out on ~world_zoom whenever a world is loaded.
+  nh_.reset(new ros::NodeHandle("/gzsatellite"));
+  nh_->setCallbackQueue(&queue_);
+  reload_srv_ = nh_->advertiseService("reload", &TilePlugin::reload, this);
+  world_pub_ = nh_->advertise<std_msgs::UInt32>("world_zoom", 1, true);
+  map_server_.reset(new gzsatellite::MapServer(*nh_));
+  ros_thread_ = std::thread([this]() {
+    while (nh_->ok()) {
+      queue_.callAvailable(ros::WallDuration(0.1));
+      if (texture_restart_.exchange(false)) restartTextured();
+    }
+  });
+
+  //
+  // Create a world model and add it to the Gazebo World, in the background
+  //
+
+  std::lock_guard<std::mutex> lock(load_mutex_);
+  startLoading();
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::Reset()
+{
+  std::lock_guard<std::mutex> lock(load_mutex_);
+
+  // a cold load is restarted; tiles it downloaded so far are cached
+  if (loaded_) return;
+
+  stopLoading();
+  startLoading();
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+std::unique_ptr<gzsatellite::ModelCreator> TilePlugin::createModelCreator()
+{
+  std::string name;
   double quality;
-  double width, height;
-  double shift_x, shift_y;
 
   ros::NodeHandle nh("/gzsatellite");
-  // Geographic paramters
-  nh.param<std::string>("tileserver", service, "http://mt1.google.com/vt/lyrs=s&x={x}&y={y}&z={z}");
-  nh.param<double>("latitude", lat, 40.267463);
-  nh.param<double>("longitude", lon, -111.635655);
-  nh.param<double>("zoom", zoom, 22);
-  // Geographic size parameters
-  nh.param<double>("width", width, 50);
-  nh.param<double>("height", height, 50);
-  nh.param<double>("shift_ew", shift_x, 0);
-  nh.param<double>("shift_ns", shift_y, 0);
+  // Geographic parameters
+  const gzsatellite::GeoParams params = gzsatellite::readGeoParams(nh);
   // Model parameters
   nh.param<std::string>("name", name, "Rock Canyon Park");
   nh.param<double>("jpg_quality", quality, 60);
+  // Pipeline parameters (0 decode threads: one per core)
+  int fetch_threads, decode_threads;
+  nh.param<int>("fetch_threads", fetch_threads, 8);
+  nh.param<int>("decode_threads", decode_threads, 0);
+  // Cache parameters (0 days: tiles never expire)
+  double tile_ttl_days;
+  nh.param<double>("tile_ttl_days", tile_ttl_days, 0);
+  int crop_cache_mb;
+  nh.param<int>("crop_cache_mb", crop_cache_mb, 128);
+  int decoded_cache_mb;
+  nh.param<int>("decoded_cache_mb", decoded_cache_mb, 0);
+  int write_batch;
+  nh.param<int>("write_batch", write_batch, 64);
 
   //
   // Create the model creator with parameters
   //
 
-  gzsatellite::GeoParams params;
-  params.tileserver   = service;
-  params.lat          = lat;
-  params.lon          = lon;
-  params.zoom         = zoom;
-  params.width        = width;
-  params.height       = height;
-  params.shift_x      = shift_x;
-  params.shift_y      = shift_y;
+  gzsatellite::MosaicPipeline::Options options;
+  options.fetch_threads  = std::max(1, fetch_threads);
+  options.decode_threads = std::max(0, decode_threads);
 
-  gzsatellite::ModelCreator m(params, root);
+  std::unique_ptr<gzsatellite::ModelCreator> m(new gzsatellite::ModelCreator(params, gzsatellite::kRootDir));
+  m->setPipelineOptions(options);
+  m->setTileTtl(std::max(0.0, tile_ttl_days) * 24*3600);
+  m->setCropCacheSize(size_t(std::max(0, crop_cache_mb)) << 20);
+  m->setDecodedStoreSize(size_t(std::max(0, decoded_cache_mb)) << 20);
+  m->setWriteBatch(std::max(0, write_batch));
 
-  //
-  // Create a world model and add it to the Gazebo World
-  //
+  params_ = params;
+  name_ = name;
+  quality_ = quality;
+  return m;
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::startLoading()
+{
+  load_cancel_ = gzsatellite::CancelToken();
+  loading_ = true;
+  load_thread_ = std::thread([this](gzsatellite::CancelToken cancel) {
+    loadWorld(cancel);
+    loading_ = false;
+  }, load_cancel_);
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::stopLoading()
+{
+  load_cancel_.cancel();
+  if (load_thread_.joinable()) load_thread_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+bool TilePlugin::reload(std_srvs::Trigger::Request&, std_srvs::Trigger::Response& res)
+{
+  std::lock_guard<std::mutex> lock(load_mutex_);
+
+  // whatever the current model still waits for is obsolete now
+  stopLoading();
+  creator_->abort();
+
+  // Cached tiles, and the tiles of the current world image that are still
+  // in the region, are reused for the new one
+  std::unique_ptr<gzsatellite::ModelCreator> next;
+  try {
+    next = createModelCreator();
+    next->reuse(*creator_);
+  } catch (const std::exception& e) {
+    // e.g., invalid coordinates: keep going with what we had
+    if (!loaded_) startLoading();
+    res.success = false;
+    res.message = e.what();
+    return true;
+  }
+
+  // crops are served on this thread, too, so the old loader is unused now;
+  // the new one serves them once its load starts
+  map_server_->setLoader(nullptr);
+  creator_ = std::move(next);
+
+  loaded_ = false;
+  startLoading();
+
+  res.success = true;
+  res.message = "Reloading world model '" + name_ + "'";
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::onWorldUpdate()
+{
+  measureRealTimeFactor();
+
+  if (texture_pending_)
+    checkRenderingClients();
+
+  if (swap_pending_) {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (this->parent_->ModelByName(model_name_)) {
+      // the new model is in place: the old ones can go
+      const std::string world = this->parent_->Name();
+      for (const auto& name : retired_models_)
+        ticks_.post([world, name]() { transport::requestNoReply(world, "entity_delete", name); });
+      retired_models_.clear();
+      swap_pending_ = false;
+    }
+  }
+
+  ticks_.run();
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::checkRenderingClients()
+{
+  // (once a second at most, this runs on the simulation thread)
+  const common::Time now = common::Time::GetWallTime();
+  if (now < next_client_check_) return;
+  next_client_check_ = now + common::Time(1.0);
+
+  if (!visual_pub_->HasConnections()) return;
+
+  // Stopping a load joins its thread, which is left to the ROS thread
+  gzmsg << "Rendering client connected, creating the texture of world model '" << name_ << "'." << std::endl;
+  texture_needed_ = true;
+  texture_pending_ = false;
+  texture_restart_ = true;
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::restartTextured()
+{
+  std::lock_guard<std::mutex> lock(load_mutex_);
+
+  // The untextured model, or a load that is under way (e.g., after
+  // ~reload), is replaced by a textured one; cached tiles are reused
+  stopLoading();
+  startLoading();
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::measureRealTimeFactor()
+{
+  const common::Time sim = this->parent_->SimTime();
+  const common::Time wall = common::Time::GetWallTime();
+  const double dsim = (sim - last_sim_).Double();
+  const double dwall = (wall - last_wall_).Double();
+  last_sim_ = sim;
+  last_wall_ = wall;
+
+  // (the first tick after a pause or a reset is no measure)
+  const bool busy = loading_ || ticks_.pending() > 0;
+  if (dwall > 0 && dwall < 1 && dsim >= 0) {
+    (busy ? busy_sim_ : idle_sim_) += dsim;
+    (busy ? busy_wall_ : idle_wall_) += dwall;
+  }
+
+  if (busy || !busy_) {
+    busy_ = busy;
+    return;
+  }
+
+  // the background work just finished
+  busy_ = false;
+  const auto stats = ticks_.stats();
+  std::ostringstream os;
+  os << std::setprecision(3) << "Real time factor while building world model '" << name_ << "': "
+     << (busy_wall_ > 0 ? busy_sim_/busy_wall_ : 0.0);
+  if (idle_wall_ > 1) os << " (" << idle_sim_/idle_wall_ << " otherwise)";
+  os << "; " << stats.tasks << " tasks on the simulation thread took up to "
+     << stats.max_us << " us a tick";
+  if (stats.deferred > 0) os << ", " << stats.deferred << " ticks left some for later";
+  gzmsg << os.str() << "." << std::endl;
+
+  busy_sim_ = busy_wall_ = 0;
+  ticks_.resetStats();
+}
+
+// ----------------------------------------------------------------------------
+
+void TilePlugin::loadWorld(gzsatellite::CancelToken cancel)
+{
+  // the pipeline's threads inherit this one's priority
+  gzsatellite::setBackgroundPriority(background_nice_);
+
+  gzsatellite::ModelCreator& m = *creator_;
+
+  // Headless, a world image nobody looks at isn't worth building; one that
+  // was built before is used, though
+  const bool textured = !lazy_texture_ || texture_needed_ || m.hasWorldImage();
+
+  // A model that is still in the world keeps its name until it is removed,
+  // so its replacement is inserted under another one
+  std::string model_name = name_;
+  {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    bool taken = (model_name == model_name_);
+    for (const auto& name : retired_models_)
+      taken = taken || (model_name == name);
+    if (taken) model_name = name_ + "_" + std::to_string(++generation_);
+  }
+
+  sdf::SDFPtr modelSDF;
+  try {
+    // Unless it is recorded, a tile is downloaded to detect the tile size,
+    // which crops and the zoom level (with a texture budget) depend on; a
+    // lazy model downloads nothing, and 256 px is assumed until it is textured
+    if (textured) m.detectTileSize(cancel);
+    map_server_->setLoader(&m.loader());
+
+    // e.g., for the ground camera, which renders from the same tiles
+    std_msgs::UInt32 zoom;
+    zoom.data = m.zoom();
+    world_pub_.publish(zoom);
+
+    modelSDF = m.createModel(model_name, quality_, cancel, textured);
+  } catch (const gzsatellite::Cancelled&) {
+    gzmsg << "Loading world model '" << name_ << "' cancelled." << std::endl;
+    return;
+  } catch (const std::exception& e) {
+    gzerr << "Could not create world model '" << name_ << "': " << e.what() << std::endl;
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    if (!model_name_.empty()) {
+      retired_models_.push_back(model_name_);
+      swap_pending_ = true;
+    }
+    model_name_ = model_name;
+  }
 
-  auto modelSDF = m.createModel(name, quality);
-  this->parent_->InsertModelSDF(*modelSDF);
+  // (on the simulation thread, in a tick with time to spare)
+  ticks_.post([this, modelSDF]() { this->parent_->InsertModelSDF(*modelSDF); });
+  loaded_ = true;
+  texture_pending_ = !textured;
 
-  gzmsg << "World model '" << name << "' (" << std::setprecision(10) << lat << "," << lon << ") created." << std::endl;
+  gzmsg << "World model '" << name_ << "' (" << std::setprecision(10) << params_.lat << "," << params_.lon << ") created"
+        << (textured ? "." : ", without a texture until it is rendered.") << std::endl;
 
   double originLat, originLon;
   m.getOriginLatLon(originLat, originLon);
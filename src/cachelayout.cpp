@@ -0,0 +1,108 @@
+#include "gzsatellite/cachelayout.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+CacheLayout parseCacheLayout(const std::string& name)
+{
+  if (name == "flat") return CacheLayout::Flat;
+  if (name == "zxy") return CacheLayout::Zxy;
+  if (name == "sharded") return CacheLayout::Sharded;
+  throw std::invalid_argument("Unknown cache layout '" + name + "'");
+}
+
+// ----------------------------------------------------------------------------
+
+std::string cacheLayoutName(CacheLayout layout)
+{
+  switch (layout) {
+    case CacheLayout::Flat: return "flat";
+    case CacheLayout::Zxy: return "zxy";
+    case CacheLayout::Sharded: return "sharded";
+  }
+  return "flat";
+}
+
+// ----------------------------------------------------------------------------
+
+fs::path cacheLayoutPath(CacheLayout layout, int x, int y, int z)
+{
+  if (layout == CacheLayout::Flat) {
+    std::ostringstream os;
+    os << "x" << x << "_y" << y << "_z" << z << ".jpg";
+    return os.str();
+  }
+
+  fs::path path = std::to_string(z);
+  if (layout == CacheLayout::Sharded) {
+    // neighbouring columns land in different buckets
+    const uint32_t h = static_cast<uint32_t>(x) * 2654435761u;
+    std::ostringstream os;
+    os << std::hex << std::setw(2) << std::setfill('0') << (h >> 24);
+    path /= os.str();
+  }
+  return path / std::to_string(x) / (std::to_string(y) + ".jpg");
+}
+
+// ----------------------------------------------------------------------------
+
+bool parseFlatTileName(const std::string& name, int& x, int& y, int& z)
+{
+  int n = 0;
+  if (std::sscanf(name.c_str(), "x%d_y%d_z%d%n", &x, &y, &z, &n) != 3) return false;
+
+  // (not a temporary file of a tile being written)
+  return name.compare(n, std::string::npos, ".jpg") == 0;
+}
+
+// ----------------------------------------------------------------------------
+
+CacheLayout openCacheLayout(const fs::path& dir, CacheLayout preferred)
+{
+  std::ifstream in((dir / "layout").string());
+  std::string name;
+  if (in >> name) {
+    try {
+      return parseCacheLayout(name);
+    } catch (const std::invalid_argument&) {
+    }
+  }
+
+  // Caches from before layouts were recorded are flat, and hold flat tiles.
+  // Anything else (the tile size record, a journal, temporary files) does
+  // not make a directory flat.
+  bool flat = false;
+  int x, y, z;
+  boost::system::error_code ec;
+  for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+    if (parseFlatTileName(it->path().filename().string(), x, y, z)) {
+      flat = true;
+      break;
+    }
+  }
+
+  const CacheLayout layout = flat ? CacheLayout::Flat : preferred;
+  writeCacheLayout(dir, layout);
+  return layout;
+}
+
+// ----------------------------------------------------------------------------
+
+bool writeCacheLayout(const fs::path& dir, CacheLayout layout)
+{
+  std::ofstream out((dir / "layout").string());
+  out << cacheLayoutName(layout) << std::endl;
+  return static_cast<bool>(out);
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,305 @@
+#include "gzsatellite/decodedtilestore.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <vector>
+
+#ifdef GZSATELLITE_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+// File header: "GZDT", rows, cols, channels, codec, raw size
+struct Header
+{
+  char magic[4];
+  uint16_t rows, cols;
+  uint8_t channels;
+  uint8_t codec; // 0: raw, 1: LZ4
+  uint16_t reserved;
+  uint32_t raw_size;
+};
+
+static const char kMagic[4] = { 'G', 'Z', 'D', 'T' };
+
+// ----------------------------------------------------------------------------
+
+DecodedTileStore::DecodedTileStore(const std::string& dir, int tile_size, size_t capacity,
+                                   size_t max_queued)
+  : dir_(dir), tile_size_(tile_size), capacity_(capacity),
+    max_queued_(std::max<size_t>(1, max_queued)), loaded_(false), size_(0),
+    writing_(false), writing_key_(0), writing_erased_(false), stopping_(false)
+{
+  fs::create_directories(dir_);
+  writer_ = std::thread(&DecodedTileStore::writeBack, this);
+}
+
+// ----------------------------------------------------------------------------
+
+DecodedTileStore::~DecodedTileStore()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_all();
+  writer_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+bool DecodedTileStore::contains(TileKey key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!loaded_) load();
+
+  const auto it = index_.find(key);
+  if (it == index_.end()) return false;
+
+  entries_.splice(entries_.begin(), entries_, it->second);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+fs::path DecodedTileStore::path(TileKey key) const
+{
+  int x, y, z;
+  unpackTileKey(key, x, y, z);
+  return dir_ / std::to_string(z) / std::to_string(x) / (std::to_string(y) + ".raw");
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileStore::put(TileKey key, const cv::Mat& image)
+{
+  if (image.empty() || capacity_ == 0) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || queue_.size() >= max_queued_) return;
+    queue_.emplace_back(key, image);
+  }
+  queued_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileStore::erase(TileKey key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  queue_.erase(std::remove_if(queue_.begin(), queue_.end(),
+                              [key](const std::pair<TileKey, cv::Mat>& tile)
+                              { return tile.first == key; }),
+               queue_.end());
+  if (writing_ && writing_key_ == key) writing_erased_ = true;
+
+  // before the index is loaded, there may still be a file
+  const auto it = index_.find(key);
+  if (it != index_.end()) {
+    remove(it->second);
+  } else if (!loaded_) {
+    boost::system::error_code ec;
+    fs::remove(path(key), ec);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+cv::Mat DecodedTileStore::unpack(const char* data, size_t size)
+{
+  Header h;
+  if (size < sizeof(h)) return cv::Mat();
+  std::memcpy(&h, data, sizeof(h));
+  if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0
+      || (h.channels != 3 && h.channels != 4)
+      || h.raw_size != size_t(h.rows)*h.cols*h.channels)
+    return cv::Mat();
+
+  cv::Mat image(h.rows, h.cols, h.channels == 4 ? CV_8UC4 : CV_8UC3);
+  const char* payload = data + sizeof(h);
+  const size_t payload_size = size - sizeof(h);
+
+  if (h.codec == 0) {
+    if (payload_size != h.raw_size) return cv::Mat();
+    std::memcpy(image.data, payload, h.raw_size);
+    return image;
+  }
+
+#ifdef GZSATELLITE_HAVE_LZ4
+  if (h.codec == 1) {
+    const int n = LZ4_decompress_safe(payload, reinterpret_cast<char*>(image.data),
+                                      static_cast<int>(payload_size), static_cast<int>(h.raw_size));
+    if (n == static_cast<int>(h.raw_size)) return image;
+  }
+#endif
+
+  return cv::Mat();
+}
+
+// ----------------------------------------------------------------------------
+
+bool DecodedTileStore::compressed()
+{
+#ifdef GZSATELLITE_HAVE_LZ4
+  return true;
+#else
+  return false;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void DecodedTileStore::load()
+{
+  loaded_ = true;
+
+  // <z>/<x>/<y>.raw, oldest first
+  struct File { std::time_t time; TileKey key; size_t size; };
+  std::vector<File> files;
+
+  boost::system::error_code ec;
+  for (fs::recursive_directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec))
+  {
+    const fs::path& p = it->path();
+    if (p.extension() != ".raw" || !fs::is_regular_file(p, ec)) continue;
+
+    try {
+      const int y = std::stoi(p.stem().string());
+      const int x = std::stoi(p.parent_path().filename().string());
+      const int z = std::stoi(p.parent_path().parent_path().filename().string());
+      File f;
+      f.time = fs::last_write_time(p);
+      f.key = packTileKey(x, y, z);
+      f.size = fs::file_size(p);
+      files.push_back(f);
+    } catch (const std::exception&) {
+      // not one of ours
+    }
+  }
+
+  std::sort(files.begin(), files.end(),
+            [](const File& a, const File& b) { return a.time < b.time; });
+  for (const auto& f : files) add(f.key, f.size);
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileStore::add(TileKey key, size_t bytes)
+{
+  const auto it = index_.find(key);
+  if (it != index_.end()) {
+    size_ -= it->second->second;
+    entries_.erase(it->second);
+  }
+
+  entries_.emplace_front(key, bytes);
+  index_[key] = entries_.begin();
+  size_ += bytes;
+
+  // the least recently used tiles go first
+  while (size_ > capacity_ && !entries_.empty())
+    remove(std::prev(entries_.end()));
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileStore::remove(Entries::iterator it)
+{
+  boost::system::error_code ec;
+  fs::remove(path(it->first), ec);
+
+  size_ -= it->second;
+  index_.erase(it->first);
+  entries_.erase(it);
+}
+
+// ----------------------------------------------------------------------------
+
+std::string DecodedTileStore::pack(const cv::Mat& image)
+{
+  const cv::Mat pixels = image.isContinuous() ? image : image.clone();
+
+  Header h;
+  std::memcpy(h.magic, kMagic, sizeof(kMagic));
+  h.rows = static_cast<uint16_t>(pixels.rows);
+  h.cols = static_cast<uint16_t>(pixels.cols);
+  h.channels = static_cast<uint8_t>(pixels.channels());
+  h.codec = 0;
+  h.reserved = 0;
+  h.raw_size = static_cast<uint32_t>(pixels.total()*pixels.elemSize());
+
+  const char* raw = reinterpret_cast<const char*>(pixels.data);
+  std::string data(reinterpret_cast<const char*>(&h), sizeof(h));
+
+#ifdef GZSATELLITE_HAVE_LZ4
+  std::vector<char> buf(LZ4_compressBound(static_cast<int>(h.raw_size)));
+  const int n = LZ4_compress_default(raw, buf.data(), static_cast<int>(h.raw_size),
+                                     static_cast<int>(buf.size()));
+  if (n > 0) {
+    data[offsetof(Header, codec)] = 1;
+    data.append(buf.data(), n);
+    return data;
+  }
+#endif
+
+  data.append(raw, h.raw_size);
+  return data;
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileStore::writeBack()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true)
+  {
+    queued_.wait(lock, [this]{ return stopping_ || !queue_.empty(); });
+    if (stopping_) break;
+
+    std::pair<TileKey, cv::Mat> tile = std::move(queue_.front());
+    queue_.pop_front();
+    if (!loaded_) load();
+    writing_ = true;
+    writing_key_ = tile.first;
+    writing_erased_ = false;
+    lock.unlock();
+
+    // pack and write next to the final name, outside of the lock
+    const std::string data = pack(tile.second);
+    const fs::path p = path(tile.first);
+    fs::path tmp_path = p;
+    tmp_path += fs::unique_path(".%%%%%%%%.tmp");
+
+    boost::system::error_code ec;
+    fs::create_directories(p.parent_path(), ec);
+    std::ofstream out(tmp_path.string(), std::ios::out | std::ios::binary);
+    out.write(data.data(), data.size());
+    out.close();
+    if (out) fs::rename(tmp_path, p, ec);
+    if (!out || ec) fs::remove(tmp_path, ec);
+
+    lock.lock();
+    writing_ = false;
+    if (!out || ec) continue;
+
+    // the image changed while its old pixels were written
+    if (writing_erased_) fs::remove(p, ec);
+    else add(tile.first, data.size());
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+}
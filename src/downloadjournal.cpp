@@ -0,0 +1,139 @@
+#include "gzsatellite/downloadjournal.h"
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+// A log record: the tile's index (8 bytes, little endian) and its status
+static const size_t kRecordSize = 9;
+
+// ----------------------------------------------------------------------------
+
+DownloadJournal::DownloadJournal(const std::string& path, const std::string& job,
+                                 TileRange& range, size_t checkpoint_interval)
+  : path_(path), range_(range), checkpoint_interval_(std::max<size_t>(1, checkpoint_interval)),
+    records_(0), resumed_(false), removed_(false)
+{
+  std::ostringstream os;
+  os << "gzsatellite-journal 1 " << job << " " << range_.zoom() << " "
+     << range_.minX() << " " << range_.maxX() << " "
+     << range_.minY() << " " << range_.maxY();
+  header_ = os.str();
+
+  boost::system::error_code ec;
+  fs::create_directories(fs::path(path_).parent_path(), ec);
+
+  resumed_ = restore();
+
+  // a journal of another job or range is started over
+  checkpoint();
+}
+
+// ----------------------------------------------------------------------------
+
+DownloadJournal::~DownloadJournal()
+{
+  if (!removed_) checkpoint();
+}
+
+// ----------------------------------------------------------------------------
+
+void DownloadJournal::record(size_t i, TileStatus status)
+{
+  range_.setStatus(i, status);
+
+  char record[kRecordSize];
+  for (size_t b=0; b<8; b++)
+    record[b] = static_cast<char>((static_cast<uint64_t>(i) >> (8*b)) & 0xFF);
+  record[8] = static_cast<char>(status);
+  log_.write(record, kRecordSize);
+
+  if (++records_ >= checkpoint_interval_) checkpoint();
+}
+
+// ----------------------------------------------------------------------------
+
+void DownloadJournal::checkpoint()
+{
+  if (removed_) return;
+  log_.close();
+
+  // Replace the checkpoint atomically, then start a new log. A crash in
+  // between replays the old log over the new checkpoint, which it is
+  // already part of.
+  const std::string tmp_path = path_ + ".tmp";
+  std::ofstream out(tmp_path, std::ios::out | std::ios::binary | std::ios::trunc);
+  out << header_ << "\n";
+  const std::vector<uint8_t>& bits = range_.statusBits();
+  out.write(reinterpret_cast<const char*>(bits.data()), bits.size());
+  out.close();
+
+  boost::system::error_code ec;
+  if (out) fs::rename(tmp_path, path_, ec);
+  if (!out || ec) {
+    std::cerr << "Could not write the download journal " << path_ << std::endl;
+    fs::remove(tmp_path, ec);
+    log_.open(logPath(), std::ios::out | std::ios::binary | std::ios::app);
+    return;
+  }
+
+  log_.open(logPath(), std::ios::out | std::ios::binary | std::ios::trunc);
+  records_ = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+void DownloadJournal::remove()
+{
+  log_.close();
+  removed_ = true;
+
+  boost::system::error_code ec;
+  fs::remove(path_, ec);
+  fs::remove(logPath(), ec);
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+bool DownloadJournal::restore()
+{
+  std::ifstream in(path_, std::ios::in | std::ios::binary);
+  std::string header;
+  if (!std::getline(in, header) || header != header_) return false;
+
+  std::vector<uint8_t> bits(range_.statusBits().size());
+  in.read(reinterpret_cast<char*>(bits.data()), bits.size());
+  if (static_cast<size_t>(in.gcount()) != bits.size()) return false;
+  range_.statusBits() = bits;
+
+  // a torn record at the end of the log is ignored
+  std::ifstream log(logPath(), std::ios::in | std::ios::binary);
+  char record[kRecordSize];
+  while (log.read(record, kRecordSize)) {
+    uint64_t i = 0;
+    for (size_t b=0; b<8; b++)
+      i |= static_cast<uint64_t>(static_cast<unsigned char>(record[b])) << (8*b);
+    const unsigned int status = static_cast<unsigned char>(record[8]);
+    if (i < range_.size() && status <= static_cast<unsigned int>(TileStatus::Failed))
+      range_.setStatus(i, static_cast<TileStatus>(status));
+  }
+
+  // whether a tile in flight was stored is only known from the cache
+  for (size_t i=0; i<range_.size(); i++)
+    if (range_.status(i) == TileStatus::InFlight)
+      range_.setStatus(i, TileStatus::Pending);
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,175 @@
+#include "gzsatellite/geotiffsource.h"
+
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+
+#include <opencv2/opencv.hpp>
+
+#ifdef GZSATELLITE_HAVE_GDAL
+#include <gdal.h>
+#include <gdal_utils.h>
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#endif
+
+namespace gzsatellite {
+
+#ifdef GZSATELLITE_HAVE_GDAL
+
+// half the extent of Web Mercator (EPSG:3857), in meters
+static constexpr double kMercatorExtent = 20037508.342789244;
+
+static std::once_flag gdal_registered;
+
+// ----------------------------------------------------------------------------
+
+GeoTiffSource::GeoTiffSource(const std::string& path)
+  : path_(path)
+{
+  std::call_once(gdal_registered, []() { GDALAllRegister(); });
+
+  // fail early, with the reason
+  GDALDatasetH dataset = acquire();
+  if (dataset == nullptr)
+    throw std::runtime_error("Could not open " + path_ + ": " + CPLGetLastErrorMsg());
+  release(dataset);
+}
+
+// ----------------------------------------------------------------------------
+
+GeoTiffSource::~GeoTiffSource()
+{
+  for (void* dataset : idle_) GDALClose(dataset);
+}
+
+// ----------------------------------------------------------------------------
+
+bool GeoTiffSource::readTile(int x, int y, int z, int tile_size, std::string& data,
+                             bool* error)
+{
+  if (error != nullptr) *error = true;
+
+  // Bounds of the tile in Web Mercator
+  const double extent = 2*kMercatorExtent / std::pow(2.0, z);
+  const double min_x = -kMercatorExtent + x*extent;
+  const double max_y = kMercatorExtent - y*extent;
+
+  GDALDatasetH src = acquire();
+  if (src == nullptr) return false;
+
+  std::vector<std::string> args = {
+    "-of", "MEM", "-t_srs", "EPSG:3857", "-r", "bilinear", "-dstalpha",
+    "-te", std::to_string(min_x), std::to_string(max_y - extent),
+           std::to_string(min_x + extent), std::to_string(max_y),
+    "-ts", std::to_string(tile_size), std::to_string(tile_size)
+  };
+  char** argv = nullptr;
+  for (const auto& arg : args) argv = CSLAddString(argv, arg.c_str());
+  GDALWarpAppOptions* options = GDALWarpAppOptionsNew(argv, nullptr);
+  CSLDestroy(argv);
+
+  // gdalwarp reads only the window the tile covers, from the overview
+  // that matches its resolution best
+  GDALDatasetH tile = GDALWarp("", nullptr, 1, &src, options, nullptr);
+  release(src);
+  GDALWarpAppOptionsFree(options);
+
+  if (tile == nullptr) {
+    std::cerr << "Could not read tile [" << x << "," << y << "," << z << "] of "
+              << path_ << ": " << CPLGetLastErrorMsg() << std::endl;
+    return false;
+  }
+
+  // Interleave the color (or gray) bands and the alpha band as BGRA
+  const int bands = GDALGetRasterCount(tile);
+  int map[4] = { 3, 2, 1, bands };
+  if (bands < 4) map[0] = map[1] = map[2] = 1;
+
+  cv::Mat bgra(tile_size, tile_size, CV_8UC4);
+  const CPLErr err = GDALDatasetRasterIO(tile, GF_Read, 0, 0, tile_size, tile_size,
+                                         bgra.data, tile_size, tile_size, GDT_Byte,
+                                         4, map, 4, bgra.step, 1);
+  GDALClose(tile);
+  if (err != CE_None) return false;
+
+  // no pixel of the image in this tile, which is no error
+  cv::Mat alpha;
+  cv::extractChannel(bgra, alpha, 3);
+  if (cv::countNonZero(alpha) == 0) {
+    if (error != nullptr) *error = false;
+    return false;
+  }
+
+  cv::Mat bgr;
+  cv::cvtColor(bgra, bgr, cv::COLOR_BGRA2BGR);
+  std::vector<unsigned char> buf;
+  if (!cv::imencode(".jpg", bgr, buf, { cv::IMWRITE_JPEG_QUALITY, 90 })) return false;
+
+  data.assign(buf.begin(), buf.end());
+  if (error != nullptr) *error = false;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void* GeoTiffSource::acquire()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!idle_.empty()) {
+      void* dataset = idle_.back();
+      idle_.pop_back();
+      return dataset;
+    }
+  }
+
+  return GDALOpenEx(path_.c_str(), GDAL_OF_RASTER | GDAL_OF_READONLY,
+                    nullptr, nullptr, nullptr);
+}
+
+// ----------------------------------------------------------------------------
+
+void GeoTiffSource::release(void* dataset)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_.push_back(dataset);
+}
+
+#else
+
+// ----------------------------------------------------------------------------
+
+GeoTiffSource::GeoTiffSource(const std::string& path)
+  : path_(path)
+{
+  throw std::runtime_error("Cannot read " + path + ": gzsatellite was built without GDAL");
+}
+
+// ----------------------------------------------------------------------------
+
+GeoTiffSource::~GeoTiffSource() {}
+
+// ----------------------------------------------------------------------------
+
+bool GeoTiffSource::readTile(int, int, int, int, std::string&, bool* error)
+{
+  if (error != nullptr) *error = true;
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+
+void* GeoTiffSource::acquire() { return nullptr; }
+
+// ----------------------------------------------------------------------------
+
+void GeoTiffSource::release(void*) {}
+
+#endif
+
+// ----------------------------------------------------------------------------
+
+}
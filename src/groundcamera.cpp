@@ -0,0 +1,215 @@
+#include "gzsatellite/groundcamera.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace gzsatellite {
+
+// Largest ground to crop, in pixels of the zoom level (crops of far away
+// ground decode the tiles at down to 1/8 of their size)
+static constexpr double kMaxCropPixels = 16384;
+
+// Largest crop to warp, in pixels per side
+static constexpr double kMaxWarpPixels = 2048;
+
+// Shrink [lo,hi] to at most size, as close to c as possible
+static void limitRange(double& lo, double& hi, double c, double size)
+{
+  if (hi - lo <= size) return;
+  lo = std::min(std::max(c - size/2, lo), hi - size);
+  hi = lo + size;
+}
+
+// ----------------------------------------------------------------------------
+
+GroundCamera::Intrinsics GroundCamera::Intrinsics::fromFov(int width, int height, double hfov)
+{
+  Intrinsics k;
+  k.width = width;
+  k.height = height;
+  k.fx = k.fy = 0.5*width / std::tan(0.5*hfov);
+  k.cx = 0.5*(width - 1);
+  k.cy = 0.5*(height - 1);
+  return k;
+}
+
+// ----------------------------------------------------------------------------
+
+GroundCamera::GroundCamera(const TileLoader& loader, const GeoParams& params,
+                           const Intrinsics& intrinsics)
+  : loader_(loader), k_(intrinsics), max_distance_(500),
+    sky_(235, 206, 135), zoom_(params.zoom)
+{
+  // the world model is centered on the region's lat/lon
+  origin_x_ = params.shift_x*params.width;
+  origin_y_ = params.shift_y*params.height;
+
+  double x, y;
+  TileLoader::latLonToTileCoords(params.lat, params.lon, zoom_, x, y);
+  center_px_ = x*loader_.imageSize();
+  center_py_ = y*loader_.imageSize();
+  resolution_ = loader_.resolution();
+}
+
+// ----------------------------------------------------------------------------
+
+int GroundCamera::render(const cv::Vec3d& position, const cv::Matx33d& rotation,
+                         cv::Mat& image) const
+{
+  image.create(k_.height, k_.width, CV_8UC3);
+
+  double min_x, min_y, max_x, max_y;
+  if (!footprint(position, rotation, min_x, min_y, max_x, max_y)) {
+    image.setTo(sky_);
+    return 0;
+  }
+
+  // The footprint in pixels of the zoom level (y points south), limited
+  // to the part around the camera that a crop can hold
+  const double T = loader_.imageSize();
+  double px0 = center_px_ + (min_x - origin_x_) / resolution_;
+  double px1 = center_px_ + (max_x - origin_x_) / resolution_;
+  double py0 = center_py_ - (max_y - origin_y_) / resolution_;
+  double py1 = center_py_ - (min_y - origin_y_) / resolution_;
+  limitRange(px0, px1, center_px_ + (position[0] - origin_x_) / resolution_, kMaxCropPixels);
+  limitRange(py0, py1, center_py_ - (position[1] - origin_y_) / resolution_, kMaxCropPixels);
+
+  const double world = double(1 << zoom_) * T;
+  px0 = std::max(px0, 0.0);  px1 = std::min(px1, world);
+  py0 = std::max(py0, 0.0);  py1 = std::min(py1, world);
+
+  TileLoader::Crop crop;
+  try {
+    if (px1 - px0 < 1 || py1 - py0 < 1)
+      throw std::invalid_argument("Ground out of the world");
+
+    double north, west, south, east;
+    TileLoader::tileCoordsToLatLon(px0/T, py0/T, zoom_, north, west);
+    TileLoader::tileCoordsToLatLon(px1/T, py1/T, zoom_, south, east);
+
+    // far away ground is seen at a coarser resolution anyway
+    const double extent = std::max(px1 - px0, py1 - py0);
+    const double res = extent > kMaxWarpPixels ? resolution_*extent/kMaxWarpPixels : 0;
+    crop = loader_.planCrop(north, west, south, east, res);
+  } catch (const std::invalid_argument&) {
+    image.setTo(sky_);
+    return 0;
+  }
+
+  cv::Mat ground;
+  const int missing = loader_.crop(crop, ground);
+
+  // Crop pixels (at their centers) to the ground plane
+  const double sx = double(crop.width) / crop.out_width;
+  const double sy = double(crop.height) / crop.out_height;
+  const cv::Matx33d A(sx*resolution_, 0, origin_x_ + (crop.x + 0.5*sx - center_px_)*resolution_,
+                      0, -sy*resolution_, origin_y_ - (crop.y + 0.5*sy - center_py_)*resolution_,
+                      0, 0, 1);
+
+  // ... and the ground plane (z = 0) to image pixels
+  const cv::Matx33d Rt = rotation.t();
+  const cv::Vec3d t = -(Rt * position);
+  const cv::Matx33d E(Rt(0,0), Rt(0,1), t[0],
+                      Rt(1,0), Rt(1,1), t[1],
+                      Rt(2,0), Rt(2,1), t[2]);
+
+  // OpenCV's warp is vectorized, and split across threads by rows
+  const cv::Matx33d H = cameraMatrix() * E * A;
+  cv::warpPerspective(ground, image, cv::Mat(H), image.size(), cv::INTER_LINEAR,
+                      cv::BORDER_CONSTANT, sky_);
+
+  // the homography also maps the ground behind the camera into the image
+  paintSky(rotation, image);
+
+  return missing;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+cv::Matx33d GroundCamera::cameraMatrix() const
+{
+  return cv::Matx33d(k_.fx, 0, k_.cx,
+                     0, k_.fy, k_.cy,
+                     0, 0, 1);
+}
+
+// ----------------------------------------------------------------------------
+
+bool GroundCamera::footprint(const cv::Vec3d& position, const cv::Matx33d& rotation,
+                             double& min_x, double& min_y, double& max_x, double& max_y) const
+{
+  const double h = position[2];
+  if (h <= 0) return false;
+
+  const cv::Matx33d M = rotation * cameraMatrix().inv();
+
+  // Ray directions are linear in the pixel coordinates: unless a corner
+  // looks down, no pixel does
+  const double W = k_.width - 1, H = k_.height - 1;
+  bool down = false;
+  for (double u : {0.0, W})
+    for (double v : {0.0, H})
+      down = down || (M * cv::Vec3d(u, v, 1))[2] < 0;
+  if (!down) return false;
+
+  min_x = min_y = std::numeric_limits<double>::max();
+  max_x = max_y = std::numeric_limits<double>::lowest();
+
+  // Where rays along the image border meet the ground, or max_distance in
+  // their direction if they don't
+  auto extend = [&](double u, double v) {
+    const cv::Vec3d d = M * cv::Vec3d(u, v, 1);
+    const double horiz = std::hypot(d[0], d[1]);
+    double x = position[0], y = position[1];
+    if (horiz > 0) {
+      const double dist = d[2] < 0 ? std::min(max_distance_, h*horiz / -d[2]) : max_distance_;
+      x += d[0]/horiz*dist;
+      y += d[1]/horiz*dist;
+    }
+    min_x = std::min(min_x, x);  max_x = std::max(max_x, x);
+    min_y = std::min(min_y, y);  max_y = std::max(max_y, y);
+  };
+
+  const int n = 8;
+  for (int i=0; i<=n; i++) {
+    const double s = double(i) / n;
+    extend(s*W, 0);
+    extend(s*W, H);
+    extend(0, s*H);
+    extend(W, s*H);
+  }
+
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void GroundCamera::paintSky(const cv::Matx33d& rotation, cv::Mat& image) const
+{
+  // the z component of the ray through (u,v) is a*u + b*v + c
+  const cv::Matx33d M = rotation * cameraMatrix().inv();
+  const double a = M(2,0), b = M(2,1), c = M(2,2);
+
+  for (int v=0; v<image.rows; v++) {
+    const double base = b*v + c;
+    int first = 0, last = 0; // sky columns [first,last)
+    if (a == 0) {
+      if (base >= 0) last = image.cols;
+    } else if (a > 0) {
+      first = std::max(0.0, std::min<double>(image.cols, std::ceil(-base / a)));
+      last = image.cols;
+    } else {
+      last = std::max(0.0, std::min<double>(image.cols, std::floor(-base / a) + 1));
+    }
+
+    if (first < last)
+      image(cv::Rect(first, v, last - first, 1)).setTo(sky_);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,333 @@
+#include "gzsatellite/httpclient.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+
+#include <curl/curl.h>
+
+namespace gzsatellite {
+
+namespace {
+
+  typedef std::chrono::steady_clock Clock;
+
+  double secondsSince(const Clock::time_point& start)
+  {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+  }
+
+  size_t writeBody(char* ptr, size_t size, size_t nmemb, void* userdata)
+  {
+    static_cast<std::string*>(userdata)->append(ptr, size*nmemb);
+    return size*nmemb;
+  }
+
+  // curl handles are not thread-safe, so every thread gets its own. Keeping
+  // them around lets libcurl reuse connections between requests.
+  struct Handles
+  {
+    Handles()
+    {
+      static std::once_flag init;
+      std::call_once(init, []{ curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+      multi = curl_multi_init();
+      easy[0] = curl_easy_init();
+      easy[1] = curl_easy_init();
+    }
+
+    ~Handles()
+    {
+      curl_easy_cleanup(easy[0]);
+      curl_easy_cleanup(easy[1]);
+      curl_multi_cleanup(multi);
+    }
+
+    CURLM* multi;
+    CURL* easy[2]; // the first transfer and its hedge
+  };
+
+  Handles& threadHandles()
+  {
+    thread_local Handles handles;
+    return handles;
+  }
+
+  struct Transfer
+  {
+    CURL* easy;
+    std::string body;
+    bool active;
+    bool done;
+    CURLcode result;
+    long status;
+    curl_slist* headers;
+  };
+
+  // a GET, or a PUT of put_body
+  void start(Handles& h, Transfer& t, const std::string& url, double timeout,
+             const HttpClient::Request& request, const std::string* put_body = nullptr)
+  {
+    curl_easy_reset(t.easy);
+    curl_easy_setopt(t.easy, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(t.easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(t.easy, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(t.easy, CURLOPT_USERAGENT, "gzsatellite");
+    curl_easy_setopt(t.easy, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout*1000));
+    curl_easy_setopt(t.easy, CURLOPT_WRITEFUNCTION, writeBody);
+    curl_easy_setopt(t.easy, CURLOPT_WRITEDATA, &t.body);
+    if (put_body != nullptr) {
+      curl_easy_setopt(t.easy, CURLOPT_CUSTOMREQUEST, "PUT");
+      curl_easy_setopt(t.easy, CURLOPT_POSTFIELDS, put_body->data());
+      curl_easy_setopt(t.easy, CURLOPT_POSTFIELDSIZE_LARGE,
+                       static_cast<curl_off_t>(put_body->size()));
+    }
+
+    // (libcurl sends credentials to the host of url only, not on redirects)
+    t.headers = nullptr;
+    for (const auto& header : request.headers)
+      t.headers = curl_slist_append(t.headers, header.c_str());
+    if (t.headers != nullptr) curl_easy_setopt(t.easy, CURLOPT_HTTPHEADER, t.headers);
+    if (!request.credentials.empty())
+      curl_easy_setopt(t.easy, CURLOPT_USERPWD, request.credentials.c_str());
+#if LIBCURL_VERSION_NUM >= 0x074b00
+    if (!request.aws_sigv4.empty())
+      curl_easy_setopt(t.easy, CURLOPT_AWS_SIGV4, request.aws_sigv4.c_str());
+#endif
+
+    t.body.clear();
+    t.active = true;
+    t.done = false;
+    t.result = CURLE_OK;
+    t.status = 0;
+    curl_multi_add_handle(h.multi, t.easy);
+  }
+
+  void stop(Handles& h, Transfer& t)
+  {
+    if (!t.active) return;
+    curl_multi_remove_handle(h.multi, t.easy);
+    curl_slist_free_all(t.headers);
+    t.headers = nullptr;
+    t.active = false;
+  }
+
+}
+
+// ----------------------------------------------------------------------------
+
+HttpClient::Response HttpClient::get(const Request& request)
+{
+  Handles& h = threadHandles();
+
+  Transfer transfers[2];
+  transfers[0].easy = h.easy[0];
+  transfers[1].easy = h.easy[1];
+  transfers[0].active = transfers[1].active = false;
+  transfers[0].done = transfers[1].done = false;
+
+  Response response;
+  response.status = 0;
+  response.elapsed = 0;
+  response.primary = 0;
+  response.hedged = false;
+  response.hedge_won = false;
+  response.cancelled = false;
+
+  const Clock::time_point started = Clock::now();
+  start(h, transfers[0], request.url, request.timeout, request);
+
+  int winner = -1;
+  while (true)
+  {
+    int running;
+    curl_multi_perform(h.multi, &running);
+
+    // collect finished transfers
+    CURLMsg* msg;
+    int queued;
+    while ((msg = curl_multi_info_read(h.multi, &queued)) != nullptr) {
+      if (msg->msg != CURLMSG_DONE) continue;
+
+      const int i = (msg->easy_handle == transfers[0].easy) ? 0 : 1;
+      Transfer& t = transfers[i];
+      t.result = msg->data.result;
+      curl_easy_getinfo(t.easy, CURLINFO_RESPONSE_CODE, &t.status);
+      t.done = true;
+      stop(h, t);
+
+      if (i == 0) response.primary = secondsSince(started);
+      if (t.result == CURLE_OK && t.status == 200 && winner < 0) winner = i;
+    }
+
+    // a failure only counts once there is nothing left to wait for
+    if (winner >= 0 || (!transfers[0].active && !transfers[1].active)) break;
+
+    if (request.cancel != nullptr && request.cancel->cancelled()) {
+      response.cancelled = true;
+      break;
+    }
+
+    const double elapsed = secondsSince(started);
+    if (elapsed > request.timeout) break;
+
+    // hedge a slow first transfer
+    if (!response.hedged && request.hedge_after >= 0 && elapsed >= request.hedge_after
+        && transfers[0].active) {
+      start(h, transfers[1], request.hedge_url.empty() ? request.url : request.hedge_url,
+            request.timeout - elapsed, request);
+      response.hedged = true;
+    }
+
+    // wake up for network activity, the hedge deadline or a cancellation check
+    double wait = 0.05;
+    if (!response.hedged && request.hedge_after >= 0)
+      wait = std::min(wait, std::max(0.0, request.hedge_after - elapsed));
+    curl_multi_wait(h.multi, nullptr, 0, static_cast<int>(std::ceil(wait*1000)), nullptr);
+  }
+
+  response.elapsed = secondsSince(started);
+
+  // cancel whatever is still in flight
+  if (transfers[0].active) response.primary = response.elapsed;
+  stop(h, transfers[0]);
+  stop(h, transfers[1]);
+
+  // report the winner, or else the most informative failure
+  int chosen = winner;
+  if (chosen < 0) chosen = (transfers[1].done && !transfers[0].done) ? 1 : 0;
+  Transfer& t = transfers[chosen];
+
+  response.hedge_won = (winner == 1);
+  response.status = t.done ? t.status : 0;
+  response.body.swap(t.body);
+
+  if (response.cancelled)
+    response.error = "cancelled";
+  else if (!t.done)
+    response.error = "timed out";
+  else if (t.result != CURLE_OK)
+    response.error = curl_easy_strerror(t.result);
+
+  return response;
+}
+
+// ----------------------------------------------------------------------------
+
+HttpClient::Response HttpClient::put(const Request& request, const std::string& body)
+{
+  // the GET transfer handle of this thread is free in between requests
+  Handles& h = threadHandles();
+  Transfer t;
+  t.easy = h.easy[0];
+  start(h, t, request.url, request.timeout, request, &body);
+
+  Response response;
+  response.status = 0;
+  response.hedged = false;
+  response.hedge_won = false;
+  response.cancelled = false;
+
+  const Clock::time_point started = Clock::now();
+  while (t.active)
+  {
+    int running;
+    curl_multi_perform(h.multi, &running);
+
+    CURLMsg* msg;
+    int queued;
+    while ((msg = curl_multi_info_read(h.multi, &queued)) != nullptr) {
+      if (msg->msg != CURLMSG_DONE) continue;
+      t.result = msg->data.result;
+      curl_easy_getinfo(t.easy, CURLINFO_RESPONSE_CODE, &t.status);
+      t.done = true;
+      stop(h, t);
+    }
+    if (!t.active) break;
+
+    if (request.cancel != nullptr && request.cancel->cancelled()) {
+      response.cancelled = true;
+      break;
+    }
+    if (secondsSince(started) > request.timeout) break;
+
+    curl_multi_wait(h.multi, nullptr, 0, 50, nullptr);
+  }
+  stop(h, t);
+
+  response.elapsed = response.primary = secondsSince(started);
+  response.status = t.done ? t.status : 0;
+  response.body.swap(t.body);
+
+  if (response.cancelled)
+    response.error = "cancelled";
+  else if (!t.done)
+    response.error = "timed out";
+  else if (t.result != CURLE_OK)
+    response.error = curl_easy_strerror(t.result);
+
+  return response;
+}
+
+// ----------------------------------------------------------------------------
+
+bool HttpClient::supportsSigV4()
+{
+#if LIBCURL_VERSION_NUM >= 0x074b00
+  return true;
+#else
+  return false;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+LatencyTracker::LatencyTracker(size_t window)
+  : window_(std::max<size_t>(1, window)), next_(0)
+{}
+
+// ----------------------------------------------------------------------------
+
+void LatencyTracker::add(double seconds)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (samples_.size() < window_) {
+    samples_.push_back(seconds);
+  } else {
+    samples_[next_] = seconds;
+    next_ = (next_ + 1) % window_;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+double LatencyTracker::percentile(double p) const
+{
+  std::vector<double> sorted;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sorted = samples_;
+  }
+  if (sorted.empty()) return -1;
+
+  // nearest rank
+  size_t k = static_cast<size_t>(std::ceil(p/100 * sorted.size()));
+  k = std::min(sorted.size(), std::max<size_t>(k, 1)) - 1;
+
+  std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+  return sorted[k];
+}
+
+// ----------------------------------------------------------------------------
+
+size_t LatencyTracker::samples() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return samples_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+}
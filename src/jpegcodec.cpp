@@ -0,0 +1,418 @@
+#include "gzsatellite/jpegcodec.h"
+
+#include <algorithm>
+#include <csetjmp>
+#include <stdexcept>
+#include <vector>
+
+#include <jpeglib.h>
+
+namespace gzsatellite {
+
+namespace {
+
+  // libjpeg reports fatal errors through a callback that must not return
+  struct ErrorManager
+  {
+    jpeg_error_mgr pub;
+    std::jmp_buf jmp;
+    char message[JMSG_LENGTH_MAX];
+  };
+
+  void errorExit(j_common_ptr cinfo)
+  {
+    ErrorManager* err = reinterpret_cast<ErrorManager*>(cinfo->err);
+    (*cinfo->err->format_message)(cinfo, err->message);
+    std::longjmp(err->jmp, 1);
+  }
+
+}
+
+// ----------------------------------------------------------------------------
+
+struct JpegStripWriter::Impl
+{
+  jpeg_compress_struct cinfo;
+  ErrorManager err;
+  std::vector<unsigned char> row; // conversion buffer without JCS_EXT_BGR
+};
+
+// ----------------------------------------------------------------------------
+
+JpegStripWriter::JpegStripWriter(const std::string& path, int width, int height,
+                                 int quality)
+  : impl_(new Impl), file_(nullptr), width_(width), height_(height),
+    rows_written_(0)
+{
+  file_ = std::fopen(path.c_str(), "wb");
+  if (file_ == nullptr)
+    throw std::runtime_error("Could not open " + path + " for writing");
+
+  jpeg_compress_struct& cinfo = impl_->cinfo;
+  cinfo.err = jpeg_std_error(&impl_->err.pub);
+  impl_->err.pub.error_exit = errorExit;
+
+  if (setjmp(impl_->err.jmp)) {
+    jpeg_destroy_compress(&cinfo);
+    std::fclose(file_);
+    file_ = nullptr;
+    throw std::runtime_error(std::string("JPEG encoder: ") + impl_->err.message);
+  }
+
+  jpeg_create_compress(&cinfo);
+  jpeg_stdio_dest(&cinfo, file_);
+
+  cinfo.image_width = width;
+  cinfo.image_height = height;
+  cinfo.input_components = 3;
+#ifdef JCS_EXTENSIONS
+  cinfo.in_color_space = JCS_EXT_BGR;
+#else
+  cinfo.in_color_space = JCS_RGB;
+  impl_->row.resize(3*width);
+#endif
+
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  jpeg_start_compress(&cinfo, TRUE);
+}
+
+// ----------------------------------------------------------------------------
+
+JpegStripWriter::~JpegStripWriter()
+{
+  if (file_ != nullptr) {
+    jpeg_destroy_compress(&impl_->cinfo);
+    std::fclose(file_);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void JpegStripWriter::write(const cv::Mat& strip)
+{
+  if (file_ == nullptr)
+    throw std::logic_error("JPEG strip written after finish()");
+  if (strip.type() != CV_8UC3 || strip.cols != width_
+      || rows_written_ + strip.rows > height_)
+    throw std::invalid_argument("JPEG strip does not fit the image");
+
+  jpeg_compress_struct& cinfo = impl_->cinfo;
+
+  if (setjmp(impl_->err.jmp)) {
+    jpeg_destroy_compress(&cinfo);
+    std::fclose(file_);
+    file_ = nullptr;
+    throw std::runtime_error(std::string("JPEG encoder: ") + impl_->err.message);
+  }
+
+  for (int r=0; r<strip.rows; r++)
+  {
+    const unsigned char* src = strip.ptr<unsigned char>(r);
+#ifdef JCS_EXTENSIONS
+    JSAMPROW row = const_cast<JSAMPROW>(src);
+#else
+    for (int c=0; c<width_; c++) {
+      impl_->row[3*c+0] = src[3*c+2];
+      impl_->row[3*c+1] = src[3*c+1];
+      impl_->row[3*c+2] = src[3*c+0];
+    }
+    JSAMPROW row = impl_->row.data();
+#endif
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  rows_written_ += strip.rows;
+}
+
+// ----------------------------------------------------------------------------
+
+void JpegStripWriter::finish()
+{
+  if (file_ == nullptr)
+    throw std::logic_error("JPEG stream already finished");
+  if (rows_written_ != height_)
+    throw std::logic_error("JPEG stream finished before all rows were written");
+
+  jpeg_compress_struct& cinfo = impl_->cinfo;
+
+  if (setjmp(impl_->err.jmp)) {
+    jpeg_destroy_compress(&cinfo);
+    std::fclose(file_);
+    file_ = nullptr;
+    throw std::runtime_error(std::string("JPEG encoder: ") + impl_->err.message);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+
+  const bool ok = std::fclose(file_) == 0;
+  file_ = nullptr;
+  if (!ok)
+    throw std::runtime_error("Could not flush JPEG stream");
+}
+
+// ----------------------------------------------------------------------------
+
+struct JpegStripReader::Impl
+{
+  jpeg_decompress_struct cinfo;
+  ErrorManager err;
+  std::vector<unsigned char> row; // conversion buffer without JCS_EXT_BGR
+};
+
+// ----------------------------------------------------------------------------
+
+JpegStripReader::JpegStripReader(const std::string& path)
+  : impl_(new Impl), file_(nullptr), width_(0), height_(0), rows_read_(0)
+{
+  file_ = std::fopen(path.c_str(), "rb");
+  if (file_ == nullptr)
+    throw std::runtime_error("Could not open " + path + " for reading");
+
+  jpeg_decompress_struct& cinfo = impl_->cinfo;
+  cinfo.err = jpeg_std_error(&impl_->err.pub);
+  impl_->err.pub.error_exit = errorExit;
+
+  if (setjmp(impl_->err.jmp)) {
+    close();
+    throw std::runtime_error(std::string("JPEG decoder: ") + impl_->err.message);
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, file_);
+  jpeg_read_header(&cinfo, TRUE);
+
+#ifdef JCS_EXTENSIONS
+  cinfo.out_color_space = JCS_EXT_BGR;
+#else
+  cinfo.out_color_space = JCS_RGB;
+#endif
+
+  jpeg_start_decompress(&cinfo);
+  width_ = cinfo.output_width;
+  height_ = cinfo.output_height;
+  impl_->row.resize(3*width_);
+}
+
+// ----------------------------------------------------------------------------
+
+JpegStripReader::~JpegStripReader()
+{
+  close();
+}
+
+// ----------------------------------------------------------------------------
+
+void JpegStripReader::skip(int rows)
+{
+  if (file_ == nullptr)
+    throw std::logic_error("JPEG strip read after an error");
+  rows = std::min(rows, height_ - rows_read_);
+  if (rows <= 0) return;
+
+  jpeg_decompress_struct& cinfo = impl_->cinfo;
+
+  if (setjmp(impl_->err.jmp)) {
+    close();
+    throw std::runtime_error(std::string("JPEG decoder: ") + impl_->err.message);
+  }
+
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+  // skips the color conversion and upsampling, and whole MCU rows if it can
+  rows_read_ += jpeg_skip_scanlines(&cinfo, rows);
+#else
+  JSAMPROW row = impl_->row.data();
+  for (int r=0; r<rows; r++)
+    rows_read_ += jpeg_read_scanlines(&cinfo, &row, 1);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+cv::Mat JpegStripReader::read(int rows)
+{
+  if (file_ == nullptr)
+    throw std::logic_error("JPEG strip read after an error");
+  rows = std::min(rows, height_ - rows_read_);
+
+  cv::Mat strip(std::max(rows, 0), width_, CV_8UC3);
+  jpeg_decompress_struct& cinfo = impl_->cinfo;
+
+  if (setjmp(impl_->err.jmp)) {
+    close();
+    throw std::runtime_error(std::string("JPEG decoder: ") + impl_->err.message);
+  }
+
+  for (int r=0; r<rows; r++)
+  {
+    unsigned char* dst = strip.ptr<unsigned char>(r);
+#ifdef JCS_EXTENSIONS
+    JSAMPROW row = dst;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+#else
+    JSAMPROW row = impl_->row.data();
+    jpeg_read_scanlines(&cinfo, &row, 1);
+    for (int c=0; c<width_; c++) {
+      dst[3*c+0] = row[3*c+2];
+      dst[3*c+1] = row[3*c+1];
+      dst[3*c+2] = row[3*c+0];
+    }
+#endif
+  }
+
+  rows_read_ += rows;
+  return strip;
+}
+
+// ----------------------------------------------------------------------------
+
+void JpegStripReader::close()
+{
+  if (file_ == nullptr) return;
+
+  // jpeg_destroy also aborts a decompression that is still in progress
+  jpeg_destroy_decompress(&impl_->cinfo);
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+bool decodeJpegRegion(const std::string& data, const cv::Rect& roi, cv::Mat& dst)
+{
+  jpeg_decompress_struct cinfo;
+  ErrorManager err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = errorExit;
+  std::vector<unsigned char> row;
+
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, reinterpret_cast<unsigned char*>(const_cast<char*>(data.data())),
+               data.size());
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+#ifdef JCS_EXTENSIONS
+  cinfo.out_color_space = JCS_EXT_BGR;
+#else
+  cinfo.out_color_space = JCS_RGB;
+#endif
+
+  jpeg_start_decompress(&cinfo);
+  if (roi.x < 0 || roi.y < 0 || roi.width <= 0 || roi.height <= 0
+      || roi.x + roi.width > int(cinfo.output_width)
+      || roi.y + roi.height > int(cinfo.output_height)) {
+    jpeg_destroy_decompress(&cinfo);
+    return false;
+  }
+
+  // decoded columns start at the iMCU boundary at or left of roi.x
+  JDIMENSION xoffset = roi.x, width = roi.width;
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER) && LIBJPEG_TURBO_VERSION_NUMBER >= 1005000
+  jpeg_crop_scanline(&cinfo, &xoffset, &width);
+  jpeg_skip_scanlines(&cinfo, roi.y);
+  row.resize(3*cinfo.output_width);
+#else
+  xoffset = 0;
+  row.resize(3*cinfo.output_width);
+  for (int r=0; r<roi.y; r++) {
+    JSAMPROW p = row.data();
+    jpeg_read_scanlines(&cinfo, &p, 1);
+  }
+#endif
+
+  const int shift = roi.x - xoffset;
+  for (int r=0; r<roi.height; r++)
+  {
+    JSAMPROW p = row.data();
+    jpeg_read_scanlines(&cinfo, &p, 1);
+
+    const unsigned char* src = row.data() + 3*shift;
+    unsigned char* out = dst.ptr<unsigned char>(r);
+#ifdef JCS_EXTENSIONS
+    std::copy(src, src + 3*roi.width, out);
+#else
+    for (int c=0; c<roi.width; c++) {
+      out[3*c+0] = src[3*c+2];
+      out[3*c+1] = src[3*c+1];
+      out[3*c+2] = src[3*c+0];
+    }
+#endif
+  }
+
+  // the rows below roi are never decoded
+  jpeg_abort_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+cv::Mat decodeJpegScaled(const char* data, size_t size, int denom)
+{
+  jpeg_decompress_struct cinfo;
+  ErrorManager err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = errorExit;
+  std::vector<unsigned char> row;
+  cv::Mat image;
+
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    return cv::Mat();
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, reinterpret_cast<unsigned char*>(const_cast<char*>(data)), size);
+  if (jpeg_read_header(&cinfo, TRUE) != JPEG_HEADER_OK) {
+    jpeg_destroy_decompress(&cinfo);
+    return cv::Mat();
+  }
+
+#ifdef JCS_EXTENSIONS
+  cinfo.out_color_space = JCS_EXT_BGR;
+#else
+  cinfo.out_color_space = JCS_RGB;
+#endif
+
+  // the IDCT outputs fewer pixels per block, instead of all of them
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = denom;
+
+  jpeg_start_decompress(&cinfo);
+  image.create(cinfo.output_height, cinfo.output_width, CV_8UC3);
+  row.resize(3*cinfo.output_width);
+
+  while (cinfo.output_scanline < cinfo.output_height)
+  {
+    unsigned char* dst = image.ptr<unsigned char>(cinfo.output_scanline);
+#ifdef JCS_EXTENSIONS
+    JSAMPROW p = dst;
+    jpeg_read_scanlines(&cinfo, &p, 1);
+#else
+    JSAMPROW p = row.data();
+    jpeg_read_scanlines(&cinfo, &p, 1);
+    for (int c=0; c<image.cols; c++) {
+      dst[3*c+0] = row[3*c+2];
+      dst[3*c+1] = row[3*c+1];
+      dst[3*c+2] = row[3*c+0];
+    }
+#endif
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return image;
+}
+
+// ----------------------------------------------------------------------------
+
+}
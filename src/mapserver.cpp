@@ -0,0 +1,110 @@
+#include "gzsatellite/mapserver.h"
+
+#include <boost/interprocess/mapped_region.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+
+namespace bip = boost::interprocess;
+
+namespace gzsatellite {
+
+MapServer::MapServer(ros::NodeHandle& nh)
+  : loader_(nullptr)
+{
+  srv_ = nh.advertiseService("get_map_crop", &MapServer::getMapCrop, this);
+}
+
+// ----------------------------------------------------------------------------
+
+void MapServer::setLoader(const TileLoader* loader)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  loader_ = loader;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+bool MapServer::getMapCrop(GetMapCrop::Request& req, GetMapCrop::Response& res)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  res.success = false;
+
+  if (loader_ == nullptr) {
+    res.message = "No imagery loaded";
+    return true;
+  }
+
+  TileLoader::Crop crop;
+  try {
+    crop = loader_->planCrop(req.north, req.west, req.south, req.east, req.resolution);
+  } catch (const std::invalid_argument& e) {
+    res.message = e.what();
+    return true;
+  }
+
+  res.width  = crop.out_width;
+  res.height = crop.out_height;
+  res.step   = crop.out_width * 3;
+  res.crop_north = crop.north;
+  res.crop_west  = crop.west;
+  res.crop_south = crop.south;
+  res.crop_east  = crop.east;
+  res.crop_resolution = crop.resolution;
+
+  // the memory tier's share of this crop
+  const DecodedTileCache& memory = loader_->decodedCache();
+  const unsigned long hits = memory.hits(), misses = memory.misses();
+
+  try {
+    if (!req.shm_name.empty()) {
+      res.missing_tiles = cropToSharedMemory(crop, req.shm_name);
+    } else {
+      // assemble right into the message
+      sensor_msgs::Image& img = res.image;
+      img.header.stamp = ros::Time::now();
+      img.width  = res.width;
+      img.height = res.height;
+      img.step   = res.step;
+      img.encoding = "bgr8";
+      img.is_bigendian = 0;
+      img.data.resize(img.step * img.height);
+
+      cv::Mat image(img.height, img.width, CV_8UC3, img.data.data(), img.step);
+      res.missing_tiles = loader_->crop(crop, image);
+    }
+  } catch (const std::exception& e) {
+    // e.g., bip::interprocess_exception
+    res.message = e.what();
+    return true;
+  }
+
+  // (tiles missing from the cache were missed in memory, too)
+  res.memory_hits = memory.hits();
+  res.memory_misses = memory.misses();
+  res.memory_tiles = res.memory_hits - hits;
+  res.disk_tiles = res.memory_misses - misses - res.missing_tiles;
+  res.success = true;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+int MapServer::cropToSharedMemory(const TileLoader::Crop& crop, const std::string& name)
+{
+  const size_t step = crop.out_width * 3;
+  const size_t size = step * crop.out_height;
+
+  bip::shared_memory_object shm(bip::open_or_create, name.c_str(), bip::read_write);
+  bip::offset_t current = 0;
+  if (!shm.get_size(current) || size_t(current) != size)
+    shm.truncate(size);
+
+  bip::mapped_region region(shm, bip::read_write, 0, size);
+  cv::Mat image(crop.out_height, crop.out_width, CV_8UC3, region.get_address(), step);
+  return loader_->crop(crop, image);
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,149 @@
+/**
+ * Move the tiles of flat cache directories into a nested layout (see
+ * cachelayout.h), in parallel:
+ *
+ *    rosrun gzsatellite migrate_cache <mapscache> [zxy|sharded] [threads]
+ *
+ * Every tileserver directory of <mapscache> (or <mapscache> itself, if it
+ * is one) that is still flat is migrated. Tiles are renamed, not copied,
+ * so a migration is cheap and can be run again to finish one that was
+ * interrupted. Don't run it while Gazebo uses the cache.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "gzsatellite/cachelayout.h"
+
+namespace fs = boost::filesystem;
+using namespace gzsatellite;
+
+struct FlatTile
+{
+  fs::path path;
+  int x, y, z;
+};
+
+// ----------------------------------------------------------------------------
+
+static bool isFlat(const fs::path& dir)
+{
+  std::ifstream in((dir / "layout").string());
+  std::string name;
+  return !(in >> name) || name == cacheLayoutName(CacheLayout::Flat);
+}
+
+// ----------------------------------------------------------------------------
+
+static bool isCache(const fs::path& dir)
+{
+  if (fs::exists(dir / "tilesize") || fs::exists(dir / "layout")) return true;
+
+  int x, y, z;
+  for (fs::directory_iterator it(dir), end; it != end; ++it)
+    if (parseFlatTileName(it->path().filename().string(), x, y, z)) return true;
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+
+static void migrate(const fs::path& dir, CacheLayout layout, unsigned int threads)
+{
+  std::vector<FlatTile> tiles;
+  for (fs::directory_iterator it(dir), end; it != end; ++it) {
+    FlatTile tile;
+    if (parseFlatTileName(it->path().filename().string(), tile.x, tile.y, tile.z)) {
+      tile.path = it->path();
+      tiles.push_back(tile);
+    }
+  }
+
+  // Renames are independent: each thread takes the next tile
+  std::atomic<size_t> next(0);
+  std::atomic<size_t> failed(0);
+  auto work = [&]() {
+    for (size_t i = next++; i < tiles.size(); i = next++) {
+      const FlatTile& tile = tiles[i];
+      const fs::path to = dir / cacheLayoutPath(layout, tile.x, tile.y, tile.z);
+
+      boost::system::error_code ec;
+      fs::create_directories(to.parent_path(), ec);
+      fs::rename(tile.path, to, ec);
+      if (ec) {
+        std::cerr << "Could not move " << tile.path << ": " << ec.message() << std::endl;
+        failed++;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (unsigned int i=0; i<threads; i++) workers.emplace_back(work);
+  for (auto& t : workers) t.join();
+
+  // a cache that is partly left flat stays flat, to be migrated again
+  if (failed == 0) writeCacheLayout(dir, layout);
+
+  std::cout << dir.filename().string() << ": moved " << tiles.size() - failed
+            << " tiles to the " << cacheLayoutName(layout) << " layout";
+  if (failed > 0) std::cout << ", " << failed << " failed";
+  std::cout << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+int main(int argc, char** argv)
+{
+  if (argc < 2 || argc > 4) {
+    std::cerr << "Usage: " << argv[0] << " <mapscache> [zxy|sharded] [threads]" << std::endl;
+    return 1;
+  }
+
+  const fs::path root(argv[1]);
+  CacheLayout layout = CacheLayout::Zxy;
+  unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+  try {
+    if (argc > 2) layout = parseCacheLayout(argv[2]);
+    if (argc > 3) threads = std::max(1, std::stoi(argv[3]));
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  if (layout == CacheLayout::Flat) {
+    std::cerr << "Caches can only be migrated to a nested layout" << std::endl;
+    return 1;
+  }
+
+  if (!fs::is_directory(root)) {
+    std::cerr << root << " is not a directory" << std::endl;
+    return 1;
+  }
+
+  try {
+    // the root is either a tileserver's cache or holds several of them
+    std::vector<fs::path> dirs;
+    if (isCache(root)) {
+      dirs.push_back(root);
+    } else {
+      for (fs::directory_iterator it(root), end; it != end; ++it)
+        if (fs::is_directory(it->path())) dirs.push_back(it->path());
+    }
+
+    for (const auto& dir : dirs) {
+      if (isFlat(dir)) migrate(dir, layout, threads);
+      else std::cout << dir.filename().string() << ": not flat, skipped" << std::endl;
+    }
+  } catch (const fs::filesystem_error& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  return 0;
+}
@@ -5,16 +5,34 @@ namespace fs = boost::filesystem;
 namespace gzsatellite {
 
 ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
-  geo_params_(params)
+  geo_params_(params), cache_root_(root+"/mapscache"), requested_zoom_(params.zoom), jpg_quality_(0),
+  mosaic_from_tiles_(false), seed_quality_(0), tile_ttl_(0), decoded_store_bytes_(0)
 {
 
   //
   // Create a new tile loader object
   //
 
-  loader_.reset(new TileLoader(root+"/mapscache", params.tileserver,
-                                params.lat, params.lon, params.zoom,
-                                params.width, params.height));
+  // JPEG tiles can be decoded at 1/2, 1/4 and 1/8 of their size
+  int& downscale = geo_params_.texture_downscale;
+  if (downscale != 1 && downscale != 2 && downscale != 4 && downscale != 8) {
+    gzwarn << "texture_downscale must be 1, 2, 4 or 8, not " << downscale << std::endl;
+    downscale = 1;
+  }
+
+  // a shared tier that is unavailable only makes for more downloads
+  if (!geo_params_.cache_shared.empty()) {
+    try {
+      shared_ = std::make_shared<SharedTileStore>(geo_params_.cache_shared,
+                                                  geo_params_.cache_shared_auth);
+    } catch (const std::exception& e) {
+      gzwarn << e.what() << ", not using it" << std::endl;
+    }
+  }
+
+  createLoader();
+  if (geo_params_.texture_budget_mb > 0)
+    fitTextureBudget();
 
   //
   // Setup proper directory structure
@@ -30,12 +48,8 @@ ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
   textures_dir_ = materials_dir_/"textures";
   fs::create_directories(textures_dir_);
 
-  //
-  // Use the unique tileloader hash as the world image name
-  //
-
-  world_img_path_ = textures_dir_/(loader_->hash()+".jpg");
-  world_scr_path_ = scripts_dir_/(loader_->hash()+".material");
+  setupImagePaths();
+  index_.reset(new MosaicIndex((textures_dir_/"mosaics.index").string()));
 
 
   /*
@@ -55,24 +69,33 @@ ModelCreator::ModelCreator(const GeoParams& params, const std::string& root) :
 
 // ----------------------------------------------------------------------------
 
-sdf::SDFPtr ModelCreator::createModel(const std::string& name, unsigned int quality)
+sdf::SDFPtr ModelCreator::createModel(const std::string& name, unsigned int quality,
+                                      const CancelToken& cancel, bool textured)
 {
   // set model properties
   model_name_ = name;
   jpg_quality_ = quality;
 
-  if (!fs::exists(world_img_path_))
-    createWorldImage();
+  if (textured)
+    detectTileSize(cancel);
+
+  if (textured && !fs::exists(world_img_path_))
+    createWorldImage(cancel);
 
   // Now that the world image is created, we don't need to download any tiles,
   // but we do need the geographical information associated with each.
-  if (tiles_.size() == 0)
+  if (loader_->tiles().empty())
     loader_->loadTiles(false);
 
   // If necessary, create the OGRE script associated with this world
-  if (!fs::exists(world_scr_path_))
+  if (textured && !fs::exists(world_scr_path_))
     createWorldScript();
 
+  // Stale tiles are good enough to start with, replace them afterwards
+  cancel.throwIfCancelled();
+  if (textured && tile_ttl_ > 0 && !refresher_)
+    refreshStaleTiles();
+
   //
   // SDF Creation
   //
@@ -93,7 +116,7 @@ sdf::SDFPtr ModelCreator::createModel(const std::string& name, unsigned int qual
   double ypos = geo_params_.shift_y*geo_params_.height;
 
   sdf::ElementPtr collisionElem = createCollision(xpos, ypos);
-  sdf::ElementPtr visualElem    = createVisual(xpos, ypos);
+  sdf::ElementPtr visualElem    = createVisual(xpos, ypos, textured);
 
   base_link->InsertElement(collisionElem);
   base_link->InsertElement(visualElem);
@@ -103,6 +126,123 @@ sdf::SDFPtr ModelCreator::createModel(const std::string& name, unsigned int qual
 
 // ----------------------------------------------------------------------------
 
+void ModelCreator::abort()
+{
+  loader_->abort();
+  for (auto& overlay : overlays_) overlay->abort();
+  {
+    std::lock_guard<std::mutex> lock(build_mutex_);
+    build_cancel_.cancel();
+  }
+  if (refresher_) refresher_->stop();
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::detectTileSize(const CancelToken& cancel)
+{
+  for (auto& overlay : overlays_) overlay->detectTileSize(&cancel);
+  if (loader_->tileSizeKnown()) return;
+
+  const int assumed = loader_->imageSize();
+  loader_->detectTileSize(&cancel);
+  if (loader_->imageSize() == assumed) return;
+
+  // the texture, the decoded tiles and the world image depend on it
+  if (geo_params_.texture_budget_mb > 0) fitTextureBudget();
+  if (decoded_store_bytes_ > 0) setDecodedStoreSize(decoded_store_bytes_);
+  setupImagePaths();
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::setDecodedStoreSize(size_t bytes)
+{
+  decoded_store_bytes_ = bytes;
+
+  // tiles are stored at the size they have in the world image
+  const int tile_size = loader_->imageSize() / geo_params_.texture_downscale;
+  const fs::path decoded = fs::path(cache_root_)/"decoded";
+
+  std::vector<TileLoader*> layers(1, loader_.get());
+  for (auto& overlay : overlays_) layers.push_back(overlay.get());
+
+  for (TileLoader* layer : layers) {
+    std::shared_ptr<DecodedTileStore> store;
+    if (bytes > 0) {
+      const fs::path dir = decoded/layer->serviceHash()/std::to_string(tile_size);
+      store = std::make_shared<DecodedTileStore>(dir.string(), tile_size, bytes);
+    }
+    layer->setDecodedStore(store);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::setWriteBatch(size_t tiles)
+{
+  write_queue_.reset();
+  if (tiles > 0) write_queue_ = std::make_shared<TileWriteQueue>(tiles);
+
+  loader_->setWriteQueue(write_queue_);
+  for (auto& overlay : overlays_) overlay->setWriteQueue(write_queue_);
+}
+
+// ----------------------------------------------------------------------------
+
+size_t ModelCreator::prefetch(const CancelToken& cancel)
+{
+  // one journal per layer, next to the tiles
+  const fs::path journals = fs::path(cache_root_)/"journals";
+
+  std::vector<TileLoader*> layers(1, loader_.get());
+  for (auto& overlay : overlays_) layers.push_back(overlay.get());
+
+  // (journals are named after the tile size, too)
+  detectTileSize(cancel);
+
+  size_t failed = 0;
+  for (TileLoader* layer : layers) {
+    cancel.throwIfCancelled();
+    layer->setJournal((journals/(layer->hash() + ".journal")).string());
+    failed += layer->loadTiles(true).count(TileStatus::Failed);
+  }
+  return failed;
+}
+
+// ----------------------------------------------------------------------------
+
+void ModelCreator::reuse(const ModelCreator& previous)
+{
+  // The statuses of an image built elsewhere are unknown, and pixels of
+  // other tileservers or tile sizes don't fit. Pixels of a seeded image
+  // would be encoded a third time, and the decoded tile store has them
+  // without any loss at all.
+  if (previous.mosaic_tiles_.empty() || !previous.mosaic_from_tiles_
+      || loader_->decodedStore() != nullptr
+      || previous.world_img_path_ == world_img_path_
+      || previous.loader_->serviceHash() != loader_->serviceHash()
+      || previous.loader_->imageSize() != loader_->imageSize()
+      || previous.geo_params_.texture_downscale != geo_params_.texture_downscale
+      || previous.overlays_hash_ != overlays_hash_)
+    return;
+
+  seed_path_ = previous.world_img_path_;
+  seed_tiles_ = previous.mosaic_tiles_;
+  seed_quality_ = previous.jpg_quality_;
+}
+
+// ----------------------------------------------------------------------------
+
+int ModelCreator::crop(double north, double west, double south, double east,
+                       double resolution, cv::Mat& image) const
+{
+  const TileLoader::Crop c = loader_->planCrop(north, west, south, east, resolution);
+  return loader_->crop(c, image);
+}
+
+// ----------------------------------------------------------------------------
+
 void ModelCreator::getOriginLatLon(double& lat, double& lon)
 {
   // Convert percentage shift from center to meters from center
@@ -121,84 +261,263 @@ void ModelCreator::getOriginLatLon(double& lat, double& lon)
   loader_->tileCoordsToLatLon(x, y, geo_params_.zoom, lat, lon);
 }
 
+// ----------------------------------------------------------------------------
+
+size_t ModelCreator::textureBytes() const
+{
+  return textureBytesAt(zoom());
+}
+
 // ----------------------------------------------------------------------------
 // Private Methods
 // ----------------------------------------------------------------------------
 
-void ModelCreator::downloadTiles()
+size_t ModelCreator::textureBytesAt(unsigned int zoom) const
 {
-  // how many tiles are not cached and need to be downloaded?
-  unsigned int num = loader_->numTilesToDownload();
+  int x, y;
+  loader_->numTilesAt(zoom, &x, &y);
+  const double side = double(loader_->imageSize()) / geo_params_.texture_downscale;
 
-  if (num > 0)
-  {
-    gzmsg << "Downloading " << num << " tiles"
-             " around (" << geo_params_.lat << ", " << geo_params_.lon << ")."
-             " This may take a minute." << std::endl;
-  }
+  // OGRE expands the JPEG to 4 bytes per pixel, and the mipmaps add a third
+  return 4 * (x*side) * (y*side) * 4/3;
+}
 
-  // Download any necessary tiles
-  tiles_ = loader_->loadTiles(true);
+// ----------------------------------------------------------------------------
 
-  if (num > 0)
-    gzmsg << "Finished loading tiles" << std::endl;
+std::string ModelCreator::imageSource() const
+{
+  std::ostringstream os;
+  os << loader_->serviceHash() << "_" << loader_->imageSize()
+     << "_" << geo_params_.texture_downscale << "_q" << jpg_quality_;
+  if (!overlays_hash_.empty()) os << "_" << overlays_hash_;
+  return os.str();
 }
 
 // ----------------------------------------------------------------------------
 
-void ModelCreator::createWorldImage()
+void ModelCreator::setupImagePaths()
 {
-  // Download (or use cached) tiles
-  downloadTiles();
+  // Use the unique tileloader hash as the world image name
+  std::string image_name = loader_->hash();
+  if (geo_params_.texture_downscale > 1)
+    image_name += "_" + std::to_string(geo_params_.texture_downscale);
+
+  // worlds with overlays (in a given order) have images of their own
+  if (!overlays_.empty()) {
+    std::ostringstream os;
+    for (const auto& overlay : overlays_) os << overlay->serviceHash() << ";";
+    std::hash<std::string> hash_fn;
+    overlays_hash_ = std::to_string(hash_fn(os.str() + std::to_string(geo_params_.overlay_opacity)));
+    image_name += "_" + overlays_hash_;
+  }
 
-  gzmsg << "Stitching together " << loader_->numTiles() << " tiles...";
+  world_img_path_ = textures_dir_/(image_name+".jpg");
+  world_scr_path_ = scripts_dir_/(image_name+".material");
+}
 
-  // Stitch the indivisual tiles into one image
-  auto img = stitchTiles();
+// ----------------------------------------------------------------------------
 
-  // Save the image to file
-  std::vector<int> compression_params;
-  compression_params.push_back(cv::IMWRITE_JPEG_QUALITY);
-  compression_params.push_back(jpg_quality_);
+void ModelCreator::createLoader()
+{
+  std::vector<std::string> services(1, geo_params_.tileserver);
+  services.insert(services.end(), geo_params_.fallbacks.begin(), geo_params_.fallbacks.end());
+
+  loader_.reset(new TileLoader(cache_root_, services,
+                                geo_params_.lat, geo_params_.lon, geo_params_.zoom,
+                                geo_params_.width, geo_params_.height, geo_params_.tile_size,
+                                geo_params_.cache_layout));
+  loader_->setMaxRequestSize(geo_params_.wms_max_size);
+  loader_->setHedging(geo_params_.hedge_percentile, geo_params_.mirrors);
+  loader_->setSharedStore(shared_);
+  loader_->setWriteQueue(write_queue_);
+
+  // every overlay caches its tiles under its own tileserver's hash
+  overlays_.clear();
+  for (const auto& overlay : geo_params_.overlays) {
+    overlays_.emplace_back(new TileLoader(cache_root_, overlay,
+                                          geo_params_.lat, geo_params_.lon, geo_params_.zoom,
+                                          geo_params_.width, geo_params_.height,
+                                          0, geo_params_.cache_layout));
+    overlays_.back()->setSharedStore(shared_);
+    overlays_.back()->setWriteQueue(write_queue_);
+  }
+}
 
-  cv::imwrite(world_img_path_.string(), img, compression_params);
+// ----------------------------------------------------------------------------
 
-  gzmsg << "done." << std::endl;
+void ModelCreator::fitTextureBudget()
+{
+  // Each zoom level lower halves the texture's width and height. The
+  // texture is only ever the decoded JPEG: OGRE gets no compressed format.
+  const double budget = geo_params_.texture_budget_mb * (1 << 20);
+  unsigned int z = requested_zoom_;
+  while (textureBytesAt(z) > budget && z >= 1) z--;
+
+  // (the loaders keep their tile size, and their settings)
+  if (z != zoom()) {
+    geo_params_.zoom = z;
+    loader_->setZoom(z);
+    for (auto& overlay : overlays_) overlay->setZoom(z);
+  }
+
+  const double mb = double(textureBytes()) / (1 << 20);
+  if (zoom() < requested_zoom_) {
+    gzwarn << "Lowered the zoom level from " << requested_zoom_ << " to " << zoom()
+           << " (" << loader_->resolution() << " m/px) for the world texture to fit "
+           << geo_params_.texture_budget_mb << " MB: about " << mb << " MB." << std::endl;
+  } else {
+    gzmsg << "World texture at zoom level " << zoom() << ": about " << mb
+          << " MB of " << geo_params_.texture_budget_mb << " MB." << std::endl;
+  }
+
+  if (textureBytes() > budget)
+    gzwarn << "The world texture does not fit texture_budget_mb at any zoom level" << std::endl;
 }
 
 // ----------------------------------------------------------------------------
 
-cv::Mat ModelCreator::stitchTiles()
+void ModelCreator::createWorldImage(const CancelToken& cancel)
 {
-  // find out how many tiles are in the x and y directions
-  int cols, rows;
-  int numTiles = loader_->numTiles(&cols, &rows);
+  // Checking the cache up front would cost a stat per tile, so tiles that
+  // are missing are only known (and reported) once the pipeline is done.
+  gzmsg << "Stitching together " << loader_->numTiles() << " tiles"
+           " around (" << geo_params_.lat << ", " << geo_params_.lon << ")."
+           " Uncached tiles are downloaded, this may take a minute." << std::endl;
+
+  // A world image that covers this one already only needs to be cropped
+  MosaicIndex::Entry covering;
+  if (index_->findCovering(imageSource(), loader_->range(), covering)) {
+    gzmsg << "Cropping the world image from " << covering.image << std::endl;
+    seed_path_ = covering.image;
+    seed_tiles_ = covering.tiles;
+    seed_quality_ = jpg_quality_;
+  }
 
-  // Create an empty image with the proper dimensions
-  int width = cols*loader_->imageSize();
-  int height = rows*loader_->imageSize();
-  cv::Mat result = cv::Mat::zeros(height, width, CV_8UC3);
+  // Seeded tiles are encoded once more, which is only worth it at the same
+  // quality. The result is a generation worse than an image built from
+  // tiles, so it is kept under a name of its own for this session, and the
+  // next cold start builds the world image from tiles again.
+  if (!seed_path_.empty() && seed_quality_ != jpg_quality_)
+    seed_path_.clear();
+
+  const fs::path cold_img_path = world_img_path_;
+  const fs::path cold_scr_path = world_scr_path_;
+  if (!seed_path_.empty()) {
+    const std::string name = world_img_path_.stem().string() + "_seeded";
+    world_img_path_ = textures_dir_/(name+".jpg");
+    world_scr_path_ = scripts_dir_/(name+".material");
+  }
 
-  // Loop through each sorted tile and place appropriately in image
-  for (int i=0; i<numTiles; i++)
+  // Read cached or download tiles, stitch and encode them, all overlapped
+  MosaicPipeline::Options options = pipeline_options_;
+  options.downscale = geo_params_.texture_downscale;
+  CancelToken build;
   {
-    cv::Mat tile = cv::imread(tiles_[i].imagePath().string(), cv::IMREAD_COLOR);
-
-    // calculate image position
-    const int tileCol = i%cols;
-    const int tileRow = i/cols;
-    const int startCol = tileCol*loader_->imageSize();
-    const int startRow = tileRow*loader_->imageSize();
+    std::lock_guard<std::mutex> lock(build_mutex_);
+    build_cancel_ = cancel.child();
+    build = build_cancel_;
+  }
+  MosaicPipeline pipeline(*loader_, options, build);
+  for (const auto& overlay : overlays_)
+    pipeline.addOverlay(*overlay, geo_params_.overlay_opacity);
+  if (!seed_path_.empty())
+    pipeline.setSeed(seed_path_.string(), seed_tiles_);
+  auto stats = pipeline.run(world_img_path_.string(), jpg_quality_);
+  mosaic_tiles_ = pipeline.tiles();
+  mosaic_from_tiles_ = (stats.reused == 0);
+
+  // the image is complete, and so are the tiles it was made of
+  if (write_queue_) write_queue_->flush();
+
+  // (the seed had none of the tiles after all)
+  if (world_img_path_ != cold_img_path && mosaic_from_tiles_) {
+    boost::system::error_code ec;
+    fs::rename(world_img_path_, cold_img_path, ec);
+    if (!ec) {
+      world_img_path_ = cold_img_path;
+      world_scr_path_ = cold_scr_path;
+    }
+  }
+  // Only images built from tiles are cropped from: each crop is encoded
+  // once more, and crops of crops would lose more with every generation
+  if (stats.failed == 0 && mosaic_from_tiles_)
+    index_->add(world_img_path_.string(), imageSource(), mosaic_tiles_);
+
+  gzmsg << "Finished world image: " << stats.reused << " reused, " << stats.cached
+        << " cached (" << stats.decoded << " already decoded)" << (shared_ ? ", " + std::to_string(stats.shared) + " from the shared cache" : "")
+        << " and " << stats.downloaded << " downloaded tiles." << std::endl;
+
+  if (shared_) {
+    const auto tier = shared_->stats();
+    gzmsg << "Shared tile cache " << shared_->location() << ": " << tier.hits << " hits, "
+          << tier.misses << " misses, " << tier.writes << " tiles written back"
+          << (tier.write_failures + tier.dropped > 0
+              ? " (" + std::to_string(tier.write_failures + tier.dropped) + " not)" : "")
+          << "." << std::endl;
+  }
 
-    // Create a region of interest into the result image
-    cv::Mat masked(result, cv::Rect(startCol, startRow,
-                              loader_->imageSize(), loader_->imageSize()));
+  if (write_queue_) {
+    const auto writes = write_queue_->stats();
+    gzmsg << "Tile cache writes: " << writes.tiles << " tiles in " << writes.batches << " batches"
+          << (writes.failures > 0 ? ", " + std::to_string(writes.failures) + " failed" : "")
+          << "." << std::endl;
+  }
 
-    // Copy this tile into the result
-    tile.copyTo(masked);
+  if (stats.failed > 0)
+    gzwarn << stats.failed << " tiles could not be loaded and are left blank" << std::endl;
+
+  const auto& providers = loader_->providers();
+  for (const auto& provider : providers) {
+    auto hedging = provider->hedgeStats();
+    if (hedging.hedged > 0) {
+      gzmsg << "Hedged " << hedging.hedged << " of " << hedging.requests << " requests ("
+            << hedging.hedge_wins << " hedges answered first) to "
+            << provider->service() << ". p99 response time " << hedging.p99
+            << " s, at least " << hedging.p99_unhedged - hedging.p99
+            << " s saved." << std::endl;
+    }
+
+    auto health = provider->health();
+    if (providers.size() > 1 && health.requests > 0) {
+      gzmsg << "Tileserver " << provider->service() << ": " << health.requests
+            << " requests, " << health.failures << " failed, "
+            << health.latency << " s average latency"
+            << (health.circuit != TileProvider::Circuit::Closed ? " (unhealthy)" : "")
+            << std::endl;
+    }
   }
+}
+
+// ----------------------------------------------------------------------------
 
-  return result;
+void ModelCreator::refreshStaleTiles()
+{
+  refresher_.reset(new TileRefresher(*loader_, tile_ttl_));
+
+  refresher_->start([this](size_t refreshed, const CancelToken& cancel) {
+    gzmsg << "Refreshed " << refreshed << " stale tiles, rebuilding world image "
+          << world_img_path_.filename() << std::endl;
+
+    // a background job: small, low priority (inherited) pipeline
+    MosaicPipeline::Options options;
+    options.read_threads = 1;
+    options.fetch_threads = 1;
+    options.persist_threads = 1;
+    options.decode_threads = 1;
+    options.downscale = geo_params_.texture_downscale;
+
+    // the new image replaces the old one atomically, and is used the next
+    // time this world is loaded
+    try {
+      MosaicPipeline pipeline(*loader_, options, cancel);
+      for (const auto& overlay : overlays_)
+        pipeline.addOverlay(*overlay, geo_params_.overlay_opacity);
+      pipeline.run(world_img_path_.string(), jpg_quality_);
+    } catch (const Cancelled&) {
+    } catch (const std::exception& e) {
+      gzwarn << "Could not rebuild the world image: " << e.what() << std::endl;
+    }
+  });
 }
 
 // ----------------------------------------------------------------------------
@@ -292,7 +611,7 @@ sdf::ElementPtr ModelCreator::createCollision(double xpos, double ypos)
 
 // ----------------------------------------------------------------------------
 
-sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos)
+sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos, bool textured)
 {
 
   //
@@ -337,11 +656,17 @@ sdf::ElementPtr ModelCreator::createVisual(double xpos, double ypos)
   //
 
   gazebo::msgs::Material_Script *script = new gazebo::msgs::Material_Script();
-  std::string *uri1 = script->add_uri();
-  *uri1 = "file://" + fs::absolute(scripts_dir_).string();
-  std::string *uri2 = script->add_uri();
-  *uri2 = "file://" + fs::absolute(textures_dir_).string();
-  script->set_name(world_img_path_.stem().string());
+  if (textured) {
+    std::string *uri1 = script->add_uri();
+    *uri1 = "file://" + fs::absolute(scripts_dir_).string();
+    std::string *uri2 = script->add_uri();
+    *uri2 = "file://" + fs::absolute(textures_dir_).string();
+    script->set_name(world_img_path_.stem().string());
+  } else {
+    // Gazebo's own materials
+    *script->add_uri() = "file://media/materials/scripts/gazebo.material";
+    script->set_name("Gazebo/Grey");
+  }
 
   gazebo::msgs::Material *material = new gazebo::msgs::Material();
   material->set_allocated_script(script);
@@ -0,0 +1,146 @@
+#include "gzsatellite/mosaicindex.h"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <boost/filesystem.hpp>
+#include <boost/geometry.hpp>
+#include <boost/geometry/index/rtree.hpp>
+
+#include "gzsatellite/tileloader.h"
+
+namespace fs = boost::filesystem;
+namespace bgi = boost::geometry::index;
+
+namespace gzsatellite {
+
+typedef boost::geometry::model::point<double, 2, boost::geometry::cs::cartesian> Point;
+typedef boost::geometry::model::box<Point> Box;
+typedef std::pair<Box, size_t> Value; // bounds, index into entries_
+
+struct MosaicIndex::Tree
+{
+  bgi::rtree<Value, bgi::quadratic<16>> rtree;
+};
+
+// Longitude/latitude bounds of a tile range
+static Box bounds(const TileRange& tiles)
+{
+  double north, west, south, east;
+  TileLoader::tileCoordsToLatLon(tiles.minX(), tiles.minY(), tiles.zoom(), north, west);
+  TileLoader::tileCoordsToLatLon(tiles.maxX() + 1, tiles.maxY() + 1, tiles.zoom(), south, east);
+  return Box(Point(west, south), Point(east, north));
+}
+
+// ----------------------------------------------------------------------------
+
+MosaicIndex::MosaicIndex(const std::string& path)
+  : path_(path), tree_(new Tree)
+{
+  // <source> <zoom> <min x> <max x> <min y> <max y> <image path>
+  std::ifstream in(path_);
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream is(line);
+    std::string source, image;
+    int z, min_x, max_x, min_y, max_y;
+    if (!(is >> source >> z >> min_x >> max_x >> min_y >> max_y)) continue;
+    is >> std::ws;
+    if (!std::getline(is, image) || !fs::exists(image)) continue;
+
+    try {
+      Entry entry;
+      entry.image = image;
+      entry.source = source;
+      entry.tiles = TileRange(min_x, max_x, min_y, max_y, z);
+      insert(entry);
+    } catch (const std::invalid_argument&) {
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+MosaicIndex::~MosaicIndex() {}
+
+// ----------------------------------------------------------------------------
+
+void MosaicIndex::add(const std::string& image, const std::string& source,
+                      const TileRange& tiles)
+{
+  Entry entry;
+  entry.image = image;
+  entry.source = source;
+  entry.tiles = TileRange(tiles.minX(), tiles.maxX(), tiles.minY(), tiles.maxY(), tiles.zoom());
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& e : entries_)
+    if (e.image == image && e.source == source) return;
+  insert(entry);
+
+  std::ofstream out(path_, std::ios::app);
+  out << source << " " << tiles.zoom() << " " << tiles.minX() << " " << tiles.maxX()
+      << " " << tiles.minY() << " " << tiles.maxY() << " " << image << std::endl;
+  if (!out)
+    std::cerr << "Could not add " << image << " to the index " << path_ << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+bool MosaicIndex::findCovering(const std::string& source, const TileRange& tiles,
+                               Entry& found) const
+{
+  if (tiles.empty()) return false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::vector<Value> candidates;
+  tree_->rtree.query(bgi::intersects(bounds(tiles)), std::back_inserter(candidates));
+
+  // the bounds only narrow it down: the tiles decide
+  const Entry* best = nullptr;
+  for (const auto& value : candidates)
+  {
+    const Entry& entry = entries_[value.second];
+    if (entry.source != source || entry.tiles.zoom() != tiles.zoom()
+        || !entry.tiles.contains(tiles.minX(), tiles.minY())
+        || !entry.tiles.contains(tiles.maxX(), tiles.maxY())
+        || !fs::exists(entry.image))
+      continue;
+
+    if (best == nullptr || entry.tiles.size() < best->tiles.size())
+      best = &entry;
+  }
+
+  if (best == nullptr) return false;
+  found = *best;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+size_t MosaicIndex::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void MosaicIndex::insert(const Entry& entry)
+{
+  // every tile of an indexed image is available
+  Entry e = entry;
+  for (size_t i=0; i<e.tiles.size(); i++)
+    e.tiles.setStatus(i, TileStatus::Available);
+
+  entries_.push_back(e);
+  tree_->rtree.insert(Value(bounds(e.tiles), entries_.size() - 1));
+}
+
+// ----------------------------------------------------------------------------
+
+}
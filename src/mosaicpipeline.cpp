@@ -0,0 +1,716 @@
+#include "gzsatellite/mosaicpipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <numeric>
+#include <stdexcept>
+#include <thread>
+
+#include <boost/filesystem.hpp>
+
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+MosaicPipeline::Options::Options()
+  : read_threads(4), read_batch(256), fetch_threads(8), persist_threads(2),
+    decode_threads(0), queue_depth(64), downscale(1)
+{}
+
+// ----------------------------------------------------------------------------
+
+MosaicPipeline::MosaicPipeline(const TileLoader& loader, const Options& options)
+  : MosaicPipeline(loader, options, loader.cancelToken())
+{}
+
+// ----------------------------------------------------------------------------
+
+MosaicPipeline::MosaicPipeline(const TileLoader& loader, const Options& options,
+                               const CancelToken& cancel)
+  : loader_(loader), options_(options), cancel_(cancel.child()),
+    // tiles are typically well below 64 KiB; larger ones grow their buffer
+    buffers_(64*1024, options.read_batch + options.queue_depth),
+    fetch_queue_(options.queue_depth), persist_queue_(options.queue_depth),
+    decode_queue_(options.queue_depth), place_queue_(options.queue_depth),
+    encode_queue_(options.queue_depth),
+    num_reused_(0), num_cached_(0), num_decoded_(0), num_shared_(0), num_downloaded_(0), num_failed_(0)
+{
+  // default to one decoder per core
+  if (options_.decode_threads == 0)
+    options_.decode_threads = std::max(1u, std::thread::hardware_concurrency());
+  if (options_.fetch_threads == 0) options_.fetch_threads = 1;
+  if (options_.persist_threads == 0) options_.persist_threads = 1;
+
+  range_ = loader_.range();
+
+  // JPEG decoders scale by 1/2, 1/4 and 1/8 (of whole 8 px blocks)
+  if (options_.downscale != 2 && options_.downscale != 4 && options_.downscale != 8)
+    options_.downscale = 1;
+  tile_size_ = loader_.imageSize() / options_.downscale;
+
+  // every tile of a block is resolved exactly once: read or taken from it
+  tiles_per_block_ = loader_.tilesPerRequest();
+  if (tiles_per_block_ > 1) {
+    const int n = tiles_per_block_;
+    block_cols_ = (range_.cols() + n - 1) / n;
+    blocks_.resize(block_cols_ * ((range_.rows() + n - 1) / n));
+    for (size_t i=0; i<range_.size(); i++)
+      blocks_[blockOf(i)].unresolved++;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::setSeed(const std::string& path, const TileRange& tiles)
+{
+  seed_path_ = path;
+  seed_ = tiles;
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::addOverlay(const TileLoader& layer, double opacity)
+{
+  Overlay overlay;
+  overlay.loader = &layer;
+  overlay.opacity = std::min(std::max(opacity, 0.0), 1.0);
+  overlays_.push_back(overlay);
+}
+
+// ----------------------------------------------------------------------------
+
+MosaicPipeline::Stats MosaicPipeline::run(const std::string& path, int quality)
+{
+  // Encode next to the final name so that an interrupted run never leaves
+  // a truncated world image behind that looks like a finished one.
+  const std::string tmp_path = path + ".tmp";
+  std::string encode_error;
+
+  std::thread reader(&MosaicPipeline::runStage, this, [this]{ readStage(); });
+  std::vector<std::thread> fetchers, persisters, decoders;
+  for (unsigned int i=0; i<options_.fetch_threads; i++)
+    fetchers.emplace_back(&MosaicPipeline::runStage, this, [this]{ fetchStage(); });
+  for (unsigned int i=0; i<options_.persist_threads; i++)
+    persisters.emplace_back(&MosaicPipeline::runStage, this, [this]{ persistStage(); });
+  for (unsigned int i=0; i<options_.decode_threads; i++)
+    decoders.emplace_back(&MosaicPipeline::runStage, this, [this]{ decodeStage(); });
+  std::thread placer(&MosaicPipeline::runStage, this, [this]{ placeStage(); });
+  std::thread encoder(&MosaicPipeline::runStage, this,
+                      [this, &tmp_path, quality, &encode_error]{
+                        encodeStage(tmp_path, quality, encode_error);
+                      });
+
+  // Stages may be blocked on a queue, so a cancellation also closes them
+  std::atomic<bool> finished(false);
+  std::thread watchdog([this, &finished]() {
+    while (!finished && !cancel_.cancelled())
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    if (!finished) closeQueues();
+  });
+
+  // Shut the pipeline down front to back: once every producer of a queue
+  // has finished, closing it lets the consumers drain it and exit.
+  // The decode queue is fed by the reader, the fetchers (fallback caches)
+  // and the persisters.
+  reader.join();
+  fetch_queue_.close();
+  for (auto& t : fetchers) t.join();
+  persist_queue_.close();
+  for (auto& t : persisters) t.join();
+  decode_queue_.close();
+  for (auto& t : decoders) t.join();
+  place_queue_.close();
+  placer.join();
+  encode_queue_.close();
+  encoder.join();
+
+  finished = true;
+  watchdog.join();
+
+  if (error_ || cancel_.cancelled() || !encode_error.empty()) {
+    boost::system::error_code ec;
+    fs::remove(tmp_path, ec);
+    if (error_) std::rethrow_exception(error_);
+    cancel_.throwIfCancelled();
+    throw std::runtime_error(encode_error);
+  }
+
+  fs::rename(tmp_path, path);
+
+  Stats stats;
+  stats.reused = num_reused_;
+  stats.cached = num_cached_ + num_decoded_;
+  stats.decoded = num_decoded_;
+  stats.shared = num_shared_;
+  stats.downloaded = num_downloaded_;
+  stats.failed = num_failed_;
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::runStage(const std::function<void()>& stage)
+{
+  try {
+    stage();
+  } catch (...) {
+    // the first failure stops the whole pipeline, and run() rethrows it
+    {
+      std::lock_guard<std::mutex> lock(error_mutex_);
+      if (!error_) error_ = std::current_exception();
+    }
+    cancel_.cancel();
+    closeQueues();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::closeQueues()
+{
+  fetch_queue_.close();
+  persist_queue_.close();
+  decode_queue_.close();
+  place_queue_.close();
+  encode_queue_.close();
+}
+
+// ----------------------------------------------------------------------------
+
+std::unique_ptr<JpegStripReader> MosaicPipeline::openSeed() const
+{
+  std::unique_ptr<JpegStripReader> seed;
+  if (seed_path_.empty() || seed_.zoom() != range_.zoom()) return seed;
+
+  const bool overlaps = seed_.minX() <= range_.maxX() && range_.minX() <= seed_.maxX()
+                     && seed_.minY() <= range_.maxY() && range_.minY() <= seed_.maxY();
+  if (!overlaps) return seed;
+
+  try {
+    seed.reset(new JpegStripReader(seed_path_));
+  } catch (const std::exception& e) {
+    std::cerr << "Not reusing " << seed_path_ << ": " << e.what() << std::endl;
+    return seed;
+  }
+
+  // e.g., a mosaic of another tile size
+  if (seed->width() != seed_.cols()*tile_size_ || seed->height() != seed_.rows()*tile_size_)
+    seed.reset();
+  return seed;
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::readStage()
+{
+  TileReader reader(buffers_, options_.read_threads, options_.read_batch);
+
+  // tiles are read in row-major order so that strips complete in order,
+  // each tile right along with its overlays
+  std::vector<Job> jobs;
+  auto add_layers = [this, &jobs](size_t i) {
+    for (int l=0; l<=int(overlays_.size()); l++) {
+      DecodedTileStore* store = decodedStore(l);
+      Job job;
+      job.index = i;
+      job.layer = l;
+      job.decoded = store != nullptr && store->contains(range_.tile(i).key());
+      jobs.push_back(job);
+    }
+  };
+
+  auto path_for = [this, &jobs](size_t k) {
+    const TileRange::Tile tile = range_.tile(jobs[k].index);
+    if (jobs[k].decoded) return decodedStore(jobs[k].layer)->path(tile.key()).string();
+    return layer(jobs[k].layer).tilePath(tile.x, tile.y).string();
+  };
+
+  // tiles that left the decoded tile store in the meantime
+  std::vector<Job> retry;
+  std::mutex retry_mutex;
+
+  auto done = [this, &jobs, &retry, &retry_mutex](size_t k, PooledBuffer&& data) {
+    Job job = jobs[k];
+    if (data.empty() && job.decoded) {
+      job.decoded = false;
+      std::lock_guard<std::mutex> lock(retry_mutex);
+      retry.push_back(job);
+      return;
+    }
+
+    if (data.empty()) {
+      // not cached (or unreadable): download it
+      fetch_queue_.push(job);
+      return;
+    }
+
+    FetchedTile tile;
+    tile.index = job.index;
+    tile.layer = job.layer;
+    tile.reused = false;
+    tile.downloaded = false;
+    tile.shared = false;
+    tile.unpack = job.decoded;
+    tile.provider = 0;
+    tile.buffer = std::move(data);
+    if (job.decoded) num_decoded_++;
+    else num_cached_++;
+
+    if (job.layer == 0 && tiles_per_block_ > 1) resolveInBlock(job.index);
+
+    // cached tiles were validated when they were stored
+    decode_queue_.push(std::move(tile));
+  };
+
+  auto read_jobs = [&]() {
+    reader.read(jobs.size(), path_for, done, &cancel_);
+    if (retry.empty()) return;
+    jobs.swap(retry);
+    retry.clear();
+    reader.read(jobs.size(), path_for, done, &cancel_);
+  };
+
+  std::unique_ptr<JpegStripReader> seed = openSeed();
+  if (!seed) {
+    jobs.reserve(range_.size()*(overlays_.size() + 1));
+    for (size_t i=0; i<range_.size(); i++) add_layers(i);
+    read_jobs();
+    return;
+  }
+
+  // Take a row of tiles from the seed where it has them, and read the rest
+  // of the row from the cache. Going row by row keeps only a strip of the
+  // seed in memory, and lets the strips of the mosaic complete in order.
+  for (int y = range_.minY(); y <= range_.maxY() && !cancel_.cancelled(); y++)
+  {
+    cv::Mat strip;
+    if (seed && y >= seed_.minY() && y <= seed_.maxY()) {
+      try {
+        seed->skip((y - seed_.minY())*tile_size_ - seed->rowsRead());
+        strip = seed->read(tile_size_);
+      } catch (const std::exception& e) {
+        std::cerr << "Not reusing " << seed_path_ << ": " << e.what() << std::endl;
+        seed.reset();
+      }
+    }
+
+    jobs.clear();
+    for (int x = range_.minX(); x <= range_.maxX(); x++)
+    {
+      const size_t i = range_.indexOf(x, y);
+      if (strip.empty() || !seed_.contains(x, y)
+          || seed_.status(seed_.indexOf(x, y)) != TileStatus::Available) {
+        add_layers(i);
+        continue;
+      }
+
+      FetchedTile tile;
+      tile.index = i;
+      tile.layer = 0;
+      tile.reused = true;
+      tile.downloaded = false;
+      tile.shared = false;
+      tile.unpack = false;
+      tile.provider = 0;
+      tile.image = strip(cv::Rect((x - seed_.minX())*tile_size_, 0, tile_size_, tile_size_));
+      num_reused_++;
+
+      if (tiles_per_block_ > 1) resolveInBlock(i);
+      decode_queue_.push(std::move(tile));
+    }
+
+    read_jobs();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::fetchStage()
+{
+  Job job;
+  while (fetch_queue_.pop(job))
+  {
+    if (cancel_.cancelled()) continue;
+
+    const size_t i = job.index;
+    const TileRange::Tile t = range_.tile(i);
+    const TileLoader& loader = layer(job.layer);
+
+    // overlays are fetched tile by tile
+    const bool blocks = job.layer == 0 && tiles_per_block_ > 1;
+
+    FetchedTile tile;
+    tile.index = i;
+    tile.layer = job.layer;
+    tile.reused = false;
+    tile.shared = false;
+    tile.unpack = false;
+    tile.provider = 0;
+
+    // still queued to be written, or a fallback provider may have served
+    // this tile before
+    fs::path path;
+    if (!loader.findQueuedTile(t.x, t.y, tile.data) && loader.findFallbackTile(t.x, t.y, path)) {
+      std::ifstream in(path.string(), std::ios::in | std::ios::binary);
+      tile.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+
+    if (!tile.data.empty()) {
+      tile.downloaded = false;
+      num_cached_++;
+      if (blocks) resolveInBlock(i);
+      decode_queue_.push(std::move(tile));
+      continue;
+    }
+
+    // another host may have downloaded it into the shared tier
+    if (loader.findSharedTile(t.x, t.y, tile.data, &tile.provider, &cancel_)) {
+      tile.downloaded = true;
+      tile.shared = true;
+      if (blocks) resolveInBlock(i);
+      persist_queue_.push(std::move(tile));
+      continue;
+    }
+
+    tile.downloaded = blocks && takeFromBlock(i, tile.image, tile.provider);
+
+    // single tiles, from the chain, if there is no block to take them from
+    if (!tile.downloaded && (!blocks || loader.providers().size() > 1))
+      tile.downloaded = loader.fetchTile(t.x, t.y, tile.data, &tile.provider, &cancel_);
+
+    // failed tiles travel through the pipeline too, so their strip completes
+    persist_queue_.push(std::move(tile));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+DecodedTileStore* MosaicPipeline::decodedStore(int l) const
+{
+  DecodedTileStore* store = layer(l).decodedStore();
+  return store != nullptr && store->tileSize() == tile_size_ ? store : nullptr;
+}
+
+// ----------------------------------------------------------------------------
+
+size_t MosaicPipeline::blockOf(size_t i) const
+{
+  const int col = i % range_.cols();
+  const int row = i / range_.cols();
+  return (row / tiles_per_block_) * block_cols_ + col / tiles_per_block_;
+}
+
+// ----------------------------------------------------------------------------
+
+bool MosaicPipeline::takeFromBlock(size_t i, cv::Mat& image, int& provider)
+{
+  Block& block = blocks_[blockOf(i)];
+  std::unique_lock<std::mutex> lock(blocks_mutex_);
+
+  if (block.state == Block::Idle) {
+    block.state = Block::Fetching;
+    lock.unlock();
+
+    // the block is aligned to the start of the range
+    const TileRange::Tile t = range_.tile(i);
+    const int n = tiles_per_block_;
+    const int min_x = range_.minX() + ((t.x - range_.minX()) / n) * n;
+    const int min_y = range_.minY() + ((t.y - range_.minY()) / n) * n;
+    const TileRange bounds(min_x, std::min(min_x + n - 1, range_.maxX()),
+                           min_y, std::min(min_y + n - 1, range_.maxY()),
+                           range_.zoom());
+
+    std::vector<cv::Mat> tiles;
+    int from = 0;
+    try {
+      if (!loader_.fetchBlock(bounds, tiles, &from, &cancel_)) tiles.clear();
+    } catch (...) {
+      // (don't leave the fetchers waiting for this block stuck)
+      tiles.clear();
+      lock.lock();
+      block.state = Block::Done;
+      block_fetched_.notify_all();
+      throw;
+    }
+
+    lock.lock();
+    block.tiles.swap(tiles);
+    block.provider = from;
+    block.state = Block::Done;
+    block_fetched_.notify_all();
+  }
+
+  // another fetcher may be downloading this block already
+  block_fetched_.wait(lock, [&block]{ return block.state == Block::Done; });
+
+  bool ok = false;
+  if (!block.tiles.empty()) {
+    // position of the tile within its block (the last ones may be narrower)
+    const int n = tiles_per_block_;
+    const int c = i % range_.cols();
+    const int col = c % n;
+    const int row = (i / range_.cols()) % n;
+    const int block_width = std::min(n, range_.cols() - (c - col));
+    image = block.tiles[row*block_width + col];
+    provider = block.provider;
+    ok = true;
+  }
+
+  if (--block.unresolved == 0) block.tiles.clear();
+  return ok;
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::resolveInBlock(size_t i)
+{
+  Block& block = blocks_[blockOf(i)];
+  std::lock_guard<std::mutex> lock(blocks_mutex_);
+  if (--block.unresolved == 0) block.tiles.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::persistStage()
+{
+  FetchedTile tile;
+  while (persist_queue_.pop(tile))
+  {
+    if (tile.downloaded) {
+      const TileRange::Tile t = range_.tile(tile.index);
+      const TileLoader& loader = layer(tile.layer);
+
+      if (!tile.image.empty()) {
+        loader.storeTile(t.x, t.y, tile.image, tile.provider);
+        num_downloaded_++;
+      } else if (isImage(tile.data)) {
+        loader.storeTile(t.x, t.y, tile.data, tile.provider, !tile.shared);
+        if (tile.shared) num_shared_++;
+        else num_downloaded_++;
+      } else {
+        // e.g., an HTML error page served with status 200
+        std::cerr << "Tile server returned a non-image for tile ["
+                  << t.x << "," << t.y << "]" << std::endl;
+        tile.data.clear();
+      }
+    }
+
+    decode_queue_.push(std::move(tile));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::decodeStage()
+{
+  FetchedTile tile;
+  while (decode_queue_.pop(tile))
+  {
+    if (cancel_.cancelled()) continue;
+
+    DecodedTile decoded;
+    decoded.index = tile.index;
+    decoded.layer = tile.layer;
+    decoded.reused = tile.reused;
+    decoded.image = tile.image;
+    const bool overlay = tile.layer > 0;
+
+    char* data = tile.buffer.empty() ? &tile.data[0] : tile.buffer.data();
+    size_t size = tile.buffer.empty() ? tile.data.size() : tile.buffer.size();
+
+    // decoded before: only to be copied (or decompressed)
+    if (tile.unpack) {
+      decoded.image = DecodedTileStore::unpack(data, size);
+      if (decoded.image.empty()) {
+        // a damaged file: decode the image after all, from wherever the
+        // fetcher would have found it
+        const TileRange::Tile t = range_.tile(tile.index);
+        const TileLoader& loader = layer(tile.layer);
+        fs::path path = loader.tilePath(t.x, t.y);
+        tile.data.clear();
+        if (!loader.findQueuedTile(t.x, t.y, tile.data)
+            && (fs::exists(path) || loader.findFallbackTile(t.x, t.y, path))) {
+          std::ifstream in(path.string(), std::ios::in | std::ios::binary);
+          tile.data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+        tile.buffer = PooledBuffer();
+        tile.unpack = false;
+        data = &tile.data[0];
+        size = tile.data.size();
+      }
+    }
+
+    // smaller mosaics: decode JPEG tiles at that size right away
+    if (decoded.image.empty() && options_.downscale > 1 && isJpeg(data, size))
+      decoded.image = decodeJpegScaled(data, size, options_.downscale);
+
+    if (decoded.image.empty() && size > 0) {
+      try {
+        const cv::Mat buf(1, size, CV_8UC1, data);
+        decoded.image = cv::imdecode(buf, overlay ? cv::IMREAD_UNCHANGED : cv::IMREAD_COLOR);
+      } catch (const cv::Exception&) {
+        decoded.image.release();
+      }
+    }
+
+    // overlays are blended by their alpha, and opaque without one
+    if (overlay && !decoded.image.empty() && decoded.image.channels() != 4) {
+      cv::Mat bgra;
+      cv::cvtColor(decoded.image, bgra, decoded.image.channels() == 1
+                   ? cv::COLOR_GRAY2BGRA : cv::COLOR_BGR2BGRA);
+      decoded.image = bgra;
+    }
+
+    if (!decoded.image.empty() && (decoded.image.cols != tile_size_
+                                   || decoded.image.rows != tile_size_)) {
+      cv::Mat resized;
+      cv::resize(decoded.image, resized, cv::Size(tile_size_, tile_size_),
+                 0, 0, cv::INTER_AREA);
+      decoded.image = resized;
+    }
+
+    // decoded for the first time: keep it for the next mosaic
+    DecodedTileStore* store = decodedStore(tile.layer);
+    if (store != nullptr && !tile.reused && !tile.unpack && !decoded.image.empty())
+      store->put(range_.tile(tile.index).key(), decoded.image);
+
+    place_queue_.push(std::move(decoded));
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::placeStage()
+{
+  // strips are allocated lazily and handed to the encoder once complete
+  const int rows = range_.rows();
+  const int cols = range_.cols();
+
+  std::vector<cv::Mat> strips(rows);
+  std::vector<int> remaining(rows, cols);
+  int next_strip = 0;
+
+  // layers of the tiles that are still waiting for some of theirs
+  const int layers = overlays_.size() + 1;
+  std::vector<std::vector<cv::Mat>> parts(layers > 1 ? range_.size() : 0);
+  std::vector<int> arrived(parts.size(), 0);
+
+  DecodedTile tile;
+  while (place_queue_.pop(tile))
+  {
+    const int col = tile.index % cols;
+    const int row = tile.index / cols;
+
+    std::vector<cv::Mat> part;
+    if (layers > 1 && !tile.reused) {
+      parts[tile.index].resize(layers);
+      parts[tile.index][tile.layer] = tile.image;
+      if (++arrived[tile.index] < layers) continue;
+
+      part.swap(parts[tile.index]);
+      tile.image = part[0];
+    }
+
+    cv::Mat& strip = strips[row];
+    if (strip.empty())
+      strip = cv::Mat::zeros(tile_size_, cols*tile_size_, CV_8UC3);
+
+    if (tile.image.empty()) {
+      range_.setStatus(tile.index, TileStatus::Failed);
+      num_failed_++;
+    } else {
+      cv::Mat masked(strip, cv::Rect(col*tile_size_, 0, tile_size_, tile_size_));
+      tile.image.copyTo(masked);
+
+      // overlays that are missing (e.g., failed) are left out
+      for (size_t l=1; l<part.size(); l++)
+        if (!part[l].empty()) composite(masked, part[l], overlays_[l-1].opacity);
+
+      range_.setStatus(tile.index, TileStatus::Available);
+    }
+
+    remaining[row]--;
+
+    // the encoder needs strips top to bottom
+    while (next_strip < rows && remaining[next_strip] == 0) {
+      Strip s;
+      s.row = next_strip;
+      s.image = strips[next_strip];
+      strips[next_strip].release();
+      encode_queue_.push(std::move(s));
+      next_strip++;
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::encodeStage(const std::string& path, int quality,
+                                 std::string& error)
+{
+  std::unique_ptr<JpegStripWriter> writer;
+  try {
+    writer.reset(new JpegStripWriter(path, range_.cols()*tile_size_,
+                                     range_.rows()*tile_size_, quality));
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+
+  Strip strip;
+  while (encode_queue_.pop(strip))
+  {
+    // keep draining after an error so that upstream stages never block
+    if (!error.empty() || cancel_.cancelled()) continue;
+
+    try {
+      writer->write(strip.image);
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+  }
+
+  // a cancelled image is left unfinished, and removed
+  if (error.empty() && !cancel_.cancelled()) {
+    try {
+      writer->finish();
+    } catch (const std::exception& e) {
+      error = e.what();
+    }
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void MosaicPipeline::composite(cv::Mat& tile, const cv::Mat& overlay, double opacity)
+{
+  // per pixel weights of the overlay and of the tile below it
+  cv::Mat alpha, above, below, color;
+  cv::extractChannel(overlay, alpha, 3);
+  alpha.convertTo(above, CV_32F, opacity/255);
+  cv::subtract(cv::Scalar::all(1), above, below);
+  cv::cvtColor(overlay, color, cv::COLOR_BGRA2BGR);
+
+  // a vectorized (and parallel) weighted sum, written in place
+  cv::blendLinear(color, tile, above, below, tile);
+}
+
+// ----------------------------------------------------------------------------
+
+bool MosaicPipeline::isImage(const std::string& data)
+{
+  static const std::string jpeg = "\xFF\xD8\xFF";
+  static const std::string png = "\x89PNG";
+
+  return data.compare(0, jpeg.size(), jpeg) == 0
+      || data.compare(0, png.size(), png) == 0;
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,68 @@
+/**
+ * Download all tiles of the region described by the /gzsatellite
+ * parameters into the tile cache, without starting Gazebo:
+ *
+ *    rosrun gzsatellite prefetch
+ *
+ * Progress is kept in a journal (see DownloadJournal), so a prefetch that
+ * is interrupted, e.g., with Ctrl-C, resumes where it stopped when it is
+ * run again, and only retries the tiles that failed. Exits with 1 if any
+ * tile could not be downloaded.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <thread>
+
+#include <ros/ros.h>
+
+#include "gzsatellite/modelcreator.h"
+#include "gzsatellite/rosparams.h"
+
+using namespace gzsatellite;
+
+int main(int argc, char** argv)
+{
+  ros::init(argc, argv, "gzsatellite_prefetch");
+  ros::NodeHandle nh("/gzsatellite");
+
+  std::unique_ptr<ModelCreator> m;
+  try {
+    m.reset(new ModelCreator(readGeoParams(nh), kRootDir));
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+
+  // Ctrl-C shuts ROS down: stop the downloads, the journal keeps the rest
+  CancelToken cancel;
+  std::atomic<bool> done(false);
+  std::thread watchdog([&]() {
+    while (!done && ros::ok())
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    if (!done) {
+      cancel.cancel();
+      m->abort();
+    }
+  });
+
+  int status = 0;
+  try {
+    const size_t failed = m->prefetch(cancel);
+    if (failed > 0) {
+      std::cerr << failed << " tiles could not be downloaded, run again to retry them" << std::endl;
+      status = 1;
+    }
+  } catch (const Cancelled&) {
+    std::cerr << "Prefetch interrupted, run again to resume it" << std::endl;
+    status = 1;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    status = 1;
+  }
+
+  done = true;
+  watchdog.join();
+  return status;
+}
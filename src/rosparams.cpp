@@ -0,0 +1,47 @@
+#include "gzsatellite/rosparams.h"
+
+namespace gzsatellite {
+
+GeoParams readGeoParams(const ros::NodeHandle& nh)
+{
+  GeoParams params;
+
+  // Geographic paramters
+  nh.param<std::string>("tileserver", params.tileserver, "http://mt1.google.com/vt/lyrs=s&x={x}&y={y}&z={z}");
+  nh.param<std::vector<std::string>>("tileserver_fallbacks", params.fallbacks, std::vector<std::string>());
+  nh.param<std::vector<std::string>>("tileserver_mirrors", params.mirrors, std::vector<std::string>());
+  nh.param<std::vector<std::string>>("tileserver_overlays", params.overlays, std::vector<std::string>());
+  nh.param<double>("overlay_opacity", params.overlay_opacity, 1);
+  nh.param<double>("hedge_percentile", params.hedge_percentile, 0); // 0: no hedging
+  nh.param<double>("latitude", params.lat, 40.267463);
+  nh.param<double>("longitude", params.lon, -111.635655);
+  nh.param<double>("zoom", params.zoom, 22);
+  if (params.zoom < 0 || params.zoom > kMaxZoom)
+    throw std::invalid_argument("Zoom level " + std::to_string(params.zoom)
+                                + " out of range [0, " + std::to_string(kMaxZoom) + "]");
+  nh.param<int>("tile_size", params.tile_size, 0); // 0: detect from the tileserver
+  nh.param<int>("wms_max_size", params.wms_max_size, 2048);
+  nh.param<int>("texture_downscale", params.texture_downscale, 1);
+  nh.param<double>("texture_budget_mb", params.texture_budget_mb, 0); // 0: no limit
+
+  // Tile cache
+  std::string layout;
+  nh.param<std::string>("cache_layout", layout, "zxy");
+  try {
+    params.cache_layout = parseCacheLayout(layout);
+  } catch (const std::invalid_argument& e) {
+    gzwarn << e.what() << ", using zxy" << std::endl;
+    params.cache_layout = CacheLayout::Zxy;
+  }
+  nh.param<std::string>("cache_shared", params.cache_shared, "");
+  nh.param<std::string>("cache_shared_auth", params.cache_shared_auth, "");
+  // Geographic size parameters
+  nh.param<double>("width", params.width, 50);
+  nh.param<double>("height", params.height, 50);
+  nh.param<double>("shift_ew", params.shift_x, 0);
+  nh.param<double>("shift_ns", params.shift_y, 0);
+
+  return params;
+}
+
+}
@@ -0,0 +1,217 @@
+#include "gzsatellite/sharedtilestore.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+#include "gzsatellite/cachelayout.h"
+#include "gzsatellite/httpclient.h"
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+// how long the destructor waits for write-backs still queued
+static constexpr double kDrainTimeout = 5; // s
+
+// ----------------------------------------------------------------------------
+
+SharedTileStore::SharedTileStore(const std::string& location, const std::string& auth,
+                                 size_t max_queued)
+  : location_(location), max_queued_(std::max<size_t>(1, max_queued)), stopping_(false),
+    num_hits_(0), num_misses_(0), num_writes_(0), num_write_failures_(0), num_dropped_(0)
+{
+  http_ = location_.compare(0, 7, "http://") == 0 || location_.compare(0, 8, "https://") == 0;
+  while (location_.size() > 1 && location_.back() == '/') location_.pop_back();
+
+  if (!http_ && !fs::is_directory(location_))
+    throw std::invalid_argument("Shared tile store " + location_ + " is not a directory");
+
+  // keys are taken from the environment rather than from parameters, which
+  // anyone with access to the ROS master can read
+  if (http_ && auth.compare(0, 4, "aws:") == 0) {
+    const char* key = std::getenv("AWS_ACCESS_KEY_ID");
+    const char* secret = std::getenv("AWS_SECRET_ACCESS_KEY");
+    const char* token = std::getenv("AWS_SESSION_TOKEN");
+    if (!HttpClient::supportsSigV4())
+      throw std::invalid_argument("Signing requests to " + location_ + " needs libcurl 7.75 or newer");
+    if (key == nullptr || secret == nullptr)
+      throw std::invalid_argument("AWS_ACCESS_KEY_ID and AWS_SECRET_ACCESS_KEY are not set for " + location_);
+
+    aws_sigv4_ = "aws:amz:" + auth.substr(4) + ":s3";
+    credentials_ = std::string(key) + ":" + secret;
+    if (token != nullptr) headers_.push_back(std::string("x-amz-security-token: ") + token);
+  } else if (http_ && !auth.empty()) {
+    headers_.push_back("Authorization: " + auth);
+  }
+
+  writer_ = std::thread(&SharedTileStore::writeBack, this);
+}
+
+// ----------------------------------------------------------------------------
+
+SharedTileStore::~SharedTileStore()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_all();
+  writer_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+bool SharedTileStore::get(const std::string& service_hash, int x, int y, int z,
+                          std::string& data, const CancelToken* cancel)
+{
+  if (!read(key(service_hash, x, y, z), data, cancel)) {
+    num_misses_++;
+    return false;
+  }
+
+  num_hits_++;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void SharedTileStore::put(const std::string& service_hash, int x, int y, int z,
+                          const std::string& data)
+{
+  std::string k = key(service_hash, x, y, z);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // a slow store must not hold up downloads: drop what doesn't fit
+    if (queue_.size() >= max_queued_) {
+      num_dropped_++;
+      return;
+    }
+    queue_.emplace_back(std::move(k), data);
+  }
+  queued_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+SharedTileStore::Stats SharedTileStore::stats() const
+{
+  Stats stats;
+  stats.hits = num_hits_;
+  stats.misses = num_misses_;
+  stats.writes = num_writes_;
+  stats.write_failures = num_write_failures_;
+  stats.dropped = num_dropped_;
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+std::string SharedTileStore::key(const std::string& service_hash, int x, int y, int z)
+{
+  return service_hash + "/" + cacheLayoutPath(CacheLayout::Zxy, x, y, z).generic_string();
+}
+
+// ----------------------------------------------------------------------------
+
+bool SharedTileStore::read(const std::string& key, std::string& data,
+                           const CancelToken* cancel)
+{
+  if (http_) {
+    HttpClient::Request request;
+    request.url = location_ + "/" + key;
+    request.timeout = 10;
+    request.cancel = cancel;
+    request.headers = headers_;
+    request.credentials = credentials_;
+    request.aws_sigv4 = aws_sigv4_;
+    HttpClient::Response r = HttpClient::get(request);
+    if (r.status != 200 || r.body.empty()) return false;
+    data.swap(r.body);
+    return true;
+  }
+
+  std::ifstream in((fs::path(location_) / key).string(), std::ios::in | std::ios::binary);
+  if (!in) return false;
+  data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  return !data.empty();
+}
+
+// ----------------------------------------------------------------------------
+
+bool SharedTileStore::write(const std::string& key, const std::string& data)
+{
+  if (http_) {
+    HttpClient::Request request;
+    request.url = location_ + "/" + key;
+    request.timeout = 30;
+    request.headers = headers_;
+    request.credentials = credentials_;
+    request.aws_sigv4 = aws_sigv4_;
+    HttpClient::Response r = HttpClient::put(request, data);
+    return r.status >= 200 && r.status < 300;
+  }
+
+  // other hosts read the store while it is written: rename into place
+  const fs::path path = fs::path(location_) / key;
+  fs::path tmp_path = path;
+  tmp_path += fs::unique_path(".%%%%%%%%.tmp");
+
+  boost::system::error_code ec;
+  fs::create_directories(path.parent_path(), ec);
+
+  std::ofstream out(tmp_path.string(), std::ios::out | std::ios::binary);
+  out.write(data.data(), data.size());
+  out.close();
+  if (out) fs::rename(tmp_path, path, ec);
+  if (!out || ec) {
+    fs::remove(tmp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void SharedTileStore::writeBack()
+{
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point deadline = Clock::time_point::max();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true)
+  {
+    queued_.wait(lock, [this]{ return stopping_ || !queue_.empty(); });
+    if (stopping_ && deadline == Clock::time_point::max())
+      deadline = Clock::now() + std::chrono::duration_cast<Clock::duration>(
+          std::chrono::duration<double>(kDrainTimeout));
+    if (queue_.empty() || Clock::now() > deadline) break;
+
+    std::pair<std::string, std::string> tile = std::move(queue_.front());
+    queue_.pop_front();
+    lock.unlock();
+
+    if (write(tile.first, tile.second)) {
+      num_writes_++;
+    } else {
+      num_write_failures_++;
+      std::cerr << "Could not write tile " << tile.first << " back to " << location_ << std::endl;
+    }
+
+    lock.lock();
+  }
+
+  num_dropped_ += queue_.size();
+  queue_.clear();
+}
+
+// ----------------------------------------------------------------------------
+
+}
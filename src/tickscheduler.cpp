@@ -0,0 +1,111 @@
+#include "gzsatellite/tickscheduler.h"
+
+#include <algorithm>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace gzsatellite {
+
+#ifdef __linux__
+// from linux/ioprio.h, which glibc does not wrap
+static constexpr int kIoprioWhoProcess = 1;
+static constexpr int kIoprioClassShift = 13;
+static constexpr int kIoprioClassBe = 2;
+static constexpr int kIoprioClassIdle = 3;
+#endif
+
+// ----------------------------------------------------------------------------
+
+void setBackgroundPriority(int nice, bool idle_io)
+{
+#ifdef __linux__
+  // on Linux, both are per thread
+  const pid_t tid = syscall(SYS_gettid);
+  if (getpriority(PRIO_PROCESS, tid) < nice)
+    setpriority(PRIO_PROCESS, tid, std::min(nice, 19));
+
+#ifdef SYS_ioprio_set
+  const int ioprio = idle_io ? kIoprioClassIdle << kIoprioClassShift
+                             : (kIoprioClassBe << kIoprioClassShift) | 7;
+  syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, ioprio);
+#endif
+#endif
+}
+
+// ----------------------------------------------------------------------------
+
+TickScheduler::TickScheduler(double budget_us)
+  : budget_us_(budget_us)
+{
+  resetStats();
+}
+
+// ----------------------------------------------------------------------------
+
+void TickScheduler::post(const Task& task)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  tasks_.push_back(task);
+}
+
+// ----------------------------------------------------------------------------
+
+void TickScheduler::run()
+{
+  const Clock::time_point start = Clock::now();
+  double elapsed_us = 0;
+  unsigned long ran = 0;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!tasks_.empty() && (ran == 0 || elapsed_us < budget_us_))
+  {
+    Task task = std::move(tasks_.front());
+    tasks_.pop_front();
+
+    // tasks may post more
+    lock.unlock();
+    task();
+    ran++;
+    elapsed_us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+    lock.lock();
+  }
+
+  if (ran == 0) return;
+  stats_.tasks += ran;
+  stats_.ticks++;
+  if (!tasks_.empty()) stats_.deferred++;
+  stats_.max_us = std::max(stats_.max_us, elapsed_us);
+}
+
+// ----------------------------------------------------------------------------
+
+size_t TickScheduler::pending() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return tasks_.size();
+}
+
+// ----------------------------------------------------------------------------
+
+TickScheduler::Stats TickScheduler::stats() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+// ----------------------------------------------------------------------------
+
+void TickScheduler::resetStats()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.tasks = 0;
+  stats_.ticks = 0;
+  stats_.deferred = 0;
+  stats_.max_us = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+}
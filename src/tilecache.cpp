@@ -0,0 +1,114 @@
+#include "gzsatellite/tilecache.h"
+
+#include <iterator>
+
+namespace gzsatellite {
+
+static size_t imageBytes(const cv::Mat& image)
+{
+  return image.total() * image.elemSize();
+}
+
+// ----------------------------------------------------------------------------
+
+DecodedTileCache::DecodedTileCache(size_t capacity)
+  : capacity_(capacity), size_(0), hits_(0), misses_(0)
+{}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileCache::setCapacity(size_t capacity)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  capacity_ = capacity;
+  evict();
+}
+
+// ----------------------------------------------------------------------------
+
+bool DecodedTileCache::get(TileKey key, cv::Mat& image)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(key);
+  if (it == index_.end()) {
+    misses_++;
+    return false;
+  }
+
+  hits_++;
+  entries_.splice(entries_.begin(), entries_, it->second);
+  image = it->second->second;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileCache::put(TileKey key, const cv::Mat& image)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (imageBytes(image) > capacity_) return;
+
+  const auto it = index_.find(key);
+  if (it != index_.end()) remove(it->second);
+
+  entries_.emplace_front(key, image);
+  index_[key] = entries_.begin();
+  size_ += imageBytes(image);
+  evict();
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileCache::erase(TileKey key)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = index_.find(key);
+  if (it != index_.end()) remove(it->second);
+}
+
+// ----------------------------------------------------------------------------
+
+size_t DecodedTileCache::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+// ----------------------------------------------------------------------------
+
+unsigned long DecodedTileCache::hits() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return hits_;
+}
+
+// ----------------------------------------------------------------------------
+
+unsigned long DecodedTileCache::misses() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return misses_;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void DecodedTileCache::remove(Entries::iterator it)
+{
+  size_ -= imageBytes(it->second);
+  index_.erase(it->first);
+  entries_.erase(it);
+}
+
+// ----------------------------------------------------------------------------
+
+void DecodedTileCache::evict()
+{
+  while (size_ > capacity_ && !entries_.empty())
+    remove(std::prev(entries_.end()));
+}
+
+// ----------------------------------------------------------------------------
+
+}
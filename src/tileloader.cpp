@@ -20,52 +20,138 @@
  */
 
 #include "gzsatellite/tileloader.h"
+#include "gzsatellite/downloadjournal.h"
+#include "gzsatellite/jpegcodec.h"
+
+#include <algorithm>
+#include <iterator>
 
 namespace gzsatellite {
 
 namespace fs = boost::filesystem;
 
-static size_t replaceRegex(const boost::regex &ex, std::string &str,
-                           const std::string &replace)
-{
-  std::string::const_iterator start = str.begin(), end = str.end();
-  boost::match_results<std::string::const_iterator> what;
-  boost::match_flag_type flags = boost::match_default;
-  size_t count = 0;
-  while (boost::regex_search(start, end, what, ex, flags)) {
-    str.replace(what.position(), what.length(), replace);
-    start = what[0].second;
-    count++;
+// tiles stored into a write queue between checks that they were written
+static constexpr size_t kConfirmQueued = 1024;
+
+// ----------------------------------------------------------------------------
+
+// Read width and height from a PNG or (baseline/progressive) JPEG header
+static bool imageDimensions(const std::string& data, int& width, int& height)
+{
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data.data());
+  const size_t n = data.size();
+
+  // PNG: the IHDR chunk always comes first
+  if (n >= 24 && data.compare(0, 4, "\x89PNG") == 0) {
+    width  = (p[16] << 24) | (p[17] << 16) | (p[18] << 8) | p[19];
+    height = (p[20] << 24) | (p[21] << 16) | (p[22] << 8) | p[23];
+    return true;
+  }
+
+  // JPEG: walk the marker segments up to the start of frame
+  if (n < 4 || p[0] != 0xFF || p[1] != 0xD8) return false;
+
+  size_t i = 2;
+  while (i + 9 < n) {
+    if (p[i] != 0xFF) return false;
+    const unsigned char marker = p[i+1];
+    const size_t length = (p[i+2] << 8) | p[i+3];
+
+    // SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+    if (marker >= 0xC0 && marker <= 0xCF
+        && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      height = (p[i+5] << 8) | p[i+6];
+      width  = (p[i+7] << 8) | p[i+8];
+      return true;
+    }
+
+    i += 2 + length;
   }
-  return count;
+
+  return false;
 }
 
 // ----------------------------------------------------------------------------
 
 TileLoader::TileLoader(const std::string& cacheRoot, const std::string& service,
                        double latitude, double longitude,
-                       unsigned int zoom, double width, double height)
+                       unsigned int zoom, double width, double height,
+                       int tileSize, CacheLayout cacheLayout)
+    : TileLoader(cacheRoot, std::vector<std::string>(1, service),
+                 latitude, longitude, zoom, width, height, tileSize, cacheLayout)
+{}
+
+// ----------------------------------------------------------------------------
+
+TileLoader::TileLoader(const std::string& cacheRoot,
+                       const std::vector<std::string>& services,
+                       double latitude, double longitude,
+                       unsigned int zoom, double width, double height,
+                       int tileSize, CacheLayout cacheLayout)
     : latitude_(latitude), longitude_(longitude), zoom_(zoom),
-      width_(width), height_(height), object_uri_(service)
+      width_(width), height_(height), tile_size_(baseTileSize()), tile_size_pending_(false),
+      max_request_size_(2048), decoded_(128 << 20)
 {
+  if (services.empty())
+    throw std::invalid_argument("No tileserver given");
+
 
   //
   // Setup directory structure for downloaded images
   //
 
-  // Hash the service URL so that tiles from different services are indepdendent
-  std::hash<std::string> hash_fn;
-  service_hash_ = std::to_string(hash_fn(object_uri_));
-
-  // Create the directory structure for the tile images
-  cache_path_ = fs::absolute(fs::path(cacheRoot + "/" + service_hash_));
-  fs::create_directories(cache_path_);
+  // Every provider caches its tiles in its own directory
+  for (const auto& service : services)
+    providers_.emplace_back(new TileProvider(cacheRoot, service, cacheLayout));
+
+  // A single service keeps the hash (and world images) it always had
+  service_hash_ = providers_[0]->serviceHash();
+  if (providers_.size() > 1) {
+    std::ostringstream os;
+    for (const auto& provider : providers_) os << provider->serviceHash() << ";";
+    std::hash<std::string> hash_fn;
+    service_hash_ = std::to_string(hash_fn(os.str()));
+  }
 
 
   //
   // Calculate center tile coordinates
   //
 
+  computeCenterTile();
+
+  // std::cout << "[DBG] center tile x: " << center_tile_x_ << std::endl;
+  // std::cout << "[DBG] center tile y: " << center_tile_y_ << std::endl;
+
+  // std::cout << "[DBG] origin offset x: " << origin_offset_x_ << std::endl;
+  // std::cout << "[DBG] origin offset y: " << origin_offset_y_ << std::endl;
+
+  //
+  // Determine how many tiles around the center tile are needed
+  //
+
+  setupTileSize(tileSize);
+  computeTileCounts();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::setZoom(unsigned int zoom)
+{
+  if (zoom > kMaxZoom)
+    throw std::invalid_argument("Zoom level " + std::to_string(zoom) + " too high");
+
+  abort();
+  zoom_ = zoom;
+  computeCenterTile();
+  computeTileCounts();
+  tiles_ = TileRange();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::computeCenterTile()
+{
   double x, y;
   latLonToTileCoords(latitude_, longitude_, zoom_, x, y);
   center_tile_x_ = std::floor(x);
@@ -74,33 +160,42 @@ TileLoader::TileLoader(const std::string& cacheRoot, const std::string& service,
   // fractional component
   origin_offset_x_ = x - center_tile_x_;
   origin_offset_y_ = y - center_tile_y_;
+}
 
-  // std::cout << "[DBG] center tile x: " << center_tile_x_ << std::endl;
-  // std::cout << "[DBG] center tile y: " << center_tile_y_ << std::endl;
+// ----------------------------------------------------------------------------
 
-  // std::cout << "[DBG] origin offset x: " << origin_offset_x_ << std::endl;
-  // std::cout << "[DBG] origin offset y: " << origin_offset_y_ << std::endl;
+void TileLoader::computeTileCounts()
+{
+  tileCounts(zoom_, x_tiles_below_, x_tiles_above_, y_tiles_below_, y_tiles_above_);
+}
 
-  //
-  // Determine how many tiles around the center tile are needed
-  //
+// ----------------------------------------------------------------------------
+
+void TileLoader::tileCounts(unsigned int zoom, int& x_below, int& x_above,
+                            int& y_below, int& y_above) const
+{
+  double x, y;
+  latLonToTileCoords(latitude_, longitude_, zoom, x, y);
+  const double offset_x = x - std::floor(x);
+  const double offset_y = y - std::floor(y);
 
   // Based on width/height, how many x block and y blocks?
-  const double width_px = width / resolution();
-  const double height_px = height / resolution();
+  const double resolution = zoomToResolution(latitude_, zoom) * baseTileSize() / tile_size_;
+  const double width_px = width_ / resolution;
+  const double height_px = height_ / resolution;
 
   const double width_pct = width_px / imageSize();
   const double height_pct = height_px / imageSize();
 
-  const double x_high_pct = origin_offset_x_ + width_pct/2;
-  const double x_low_pct = origin_offset_x_ - width_pct/2;
-  const double y_high_pct = origin_offset_y_ + height_pct/2;
-  const double y_low_pct = origin_offset_y_ - height_pct/2;
+  const double x_high_pct = offset_x + width_pct/2;
+  const double x_low_pct = offset_x - width_pct/2;
+  const double y_high_pct = offset_y + height_pct/2;
+  const double y_low_pct = offset_y - height_pct/2;
 
-  x_tiles_above_ =          std::floor(x_high_pct);
-  x_tiles_below_ = std::abs(std::floor(x_low_pct));
-  y_tiles_above_ =          std::floor(y_high_pct);
-  y_tiles_below_ = std::abs(std::floor(y_low_pct));
+  x_above =          std::floor(x_high_pct);
+  x_below = std::abs(std::floor(x_low_pct));
+  y_above =          std::floor(y_high_pct);
+  y_below = std::abs(std::floor(y_low_pct));
 
   // std::cout << std::endl;
   // std::cout << "Resolution (m/px): " << resolution() << std::endl;
@@ -115,49 +210,417 @@ TileLoader::TileLoader(const std::string& cacheRoot, const std::string& service,
 
 // ----------------------------------------------------------------------------
 
-const std::vector<TileLoader::MapTile>& TileLoader::loadTiles(bool download)
+const TileRange& TileLoader::loadTiles(bool download)
 {
   // discard previous set of tiles and all pending requests
   abort();
+  const CancelToken cancel = cancelToken();
 
   // determine what range of tiles we can load
-  int min_x, max_x, min_y, max_y;
-  tileRange(min_x, max_x, min_y, max_y);
+  if (download) detectTileSize(&cancel);
+  tiles_ = range();
+  if (!download) return tiles_;
+
+  // Tiles a previous run was done with are taken from its journal
+  std::unique_ptr<DownloadJournal> journal;
+  if (!journal_path_.empty()) {
+    journal.reset(new DownloadJournal(journal_path_, hash(), tiles_));
+    if (journal->resumed())
+      std::cerr << "Resuming the download of " << tiles_.size() - tiles_.count(TileStatus::Available)
+                << " of " << tiles_.size() << " tiles from " << journal_path_ << std::endl;
+  }
+
+  auto setStatus = [this, &journal](size_t i, TileStatus status) {
+    if (journal) journal->record(i, status);
+    else tiles_.setStatus(i, status);
+  };
+
+  // With a write queue, a stored tile is only Available once its batch is
+  // on disk; tiles are confirmed (or failed) many batches at a time
+  std::vector<std::pair<size_t, int>> queued; // tile, provider
+  auto confirmQueued = [this, &queued, &setStatus]() {
+    if (queued.empty()) return;
+    write_queue_->flush();
+    for (const auto& q : queued) {
+      const TileRange::Tile tile = tiles_.tile(q.first);
+      setStatus(q.first, fs::exists(cachedPathForTile(tile.x, tile.y, tile.z, q.second))
+                         ? TileStatus::Available : TileStatus::Failed);
+    }
+    queued.clear();
+  };
+  auto setStored = [this, &queued, &setStatus, &confirmQueued](size_t i, int provider) {
+    if (!write_queue_) {
+      setStatus(i, TileStatus::Available);
+      return;
+    }
+    queued.emplace_back(i, provider);
+    if (queued.size() >= kConfirmQueued) confirmQueued();
+  };
+
+  // Check which tiles are already in the cache (of any provider), or in
+  // the shared tier behind it. Failed tiles were not, and are retried
+  // right away.
+  for (size_t i=0; i<tiles_.size(); i++) {
+    if (tiles_.status(i) != TileStatus::Pending) continue;
+    cancel.throwIfCancelled();
+
+    const TileRange::Tile tile = tiles_.tile(i);
+    fs::path path;
+    std::string data;
+    int provider = 0;
+    if (fs::exists(cachedPathForTile(tile.x, tile.y, tile.z))
+        || findFallbackTile(tile.x, tile.y, path))
+      setStatus(i, TileStatus::Available);
+    else if (findQueuedTile(tile.x, tile.y, data, &provider)
+             || (findSharedTile(tile.x, tile.y, data, &provider, &cancel)
+                 && storeTile(tile.x, tile.y, data, provider, false)))
+      setStored(i, provider);
+  }
+  confirmQueued();
+
+  // initiate blocking requests, a block of tiles at a time
+  const int n = tilesPerRequest();
+  for (int by = tiles_.minY(); by <= tiles_.maxY(); by += n) {
+    for (int bx = tiles_.minX(); bx <= tiles_.maxX(); bx += n) {
+      const TileRange block(bx, std::min(bx + n - 1, tiles_.maxX()),
+                            by, std::min(by + n - 1, tiles_.maxY()), zoom_);
+
+      cancel.throwIfCancelled();
+
+      bool missing = false;
+      for (const auto& tile : block)
+        if (tiles_.status(tiles_.indexOf(tile.x, tile.y)) != TileStatus::Available)
+          missing = true;
+      if (!missing) continue;
+
+      for (const auto& tile : block) {
+        const size_t i = tiles_.indexOf(tile.x, tile.y);
+        if (tiles_.status(i) != TileStatus::Available) setStatus(i, TileStatus::InFlight);
+      }
+
+      std::vector<cv::Mat> images;
+      int provider = 0;
+      const bool ok = n > 1 && fetchBlock(block, images, &provider, &cancel);
+
+      for (const auto& tile : block) {
+        const size_t i = tiles_.indexOf(tile.x, tile.y);
+        if (tiles_.status(i) == TileStatus::Available) continue;
+
+        // without the block, fall back to single tiles (of any provider)
+        std::string data;
+        bool stored;
+        if (ok)
+          stored = storeTile(tile.x, tile.y, images[tile.index], provider);
+        else
+          stored = fetchTile(tile.x, tile.y, data, &provider, &cancel)
+                && storeTile(tile.x, tile.y, data, provider);
+
+        // (a tile aborted halfway is left in flight, to be looked at again)
+        cancel.throwIfCancelled();
+        if (stored) setStored(i, provider);
+        else setStatus(i, TileStatus::Failed);
+      }
+    }
+  }
+
+  cancel.throwIfCancelled();
+  confirmQueued();
+  if (journal && tiles_.count(TileStatus::Failed) == 0) journal->remove();
+  return tiles_;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileLoader::fetchTile(int x, int y, std::string& data, int* provider,
+                           const CancelToken* cancel) const
+{
+  CancelToken current;
+  if (cancel == nullptr) {
+    current = cancelToken();
+    cancel = &current;
+  }
+
+  for (int i : providerOrder()) {
+    // skip providers whose circuit is open
+    if (cancel->cancelled()) return false;
+    if (!providers_[i]->acquire()) continue;
+
+    if (providers_[i]->fetchTile(x, y, zoom_, tile_size_, data, cancel)) {
+      if (provider != nullptr) *provider = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileLoader::fetchBlock(const TileRange& block, std::vector<cv::Mat>& tiles,
+                            int* provider, const CancelToken* cancel) const
+{
+  CancelToken current;
+  if (cancel == nullptr) {
+    current = cancelToken();
+    cancel = &current;
+  }
+
+  std::string data;
+  int from = -1;
+  for (int i : providerOrder()) {
+    if (cancel->cancelled()) return false;
+    if (!providers_[i]->isWms() || !providers_[i]->acquire()) continue;
+    if (providers_[i]->fetchBlock(block, tile_size_, data, cancel)) {
+      from = i;
+      break;
+    }
+  }
+  if (from < 0) return false;
+
+  // WMS servers report errors as XML documents, with status 200
+  const cv::Mat buf(1, data.size(), CV_8UC1, &data[0]);
+  cv::Mat image;
+  try {
+    image = cv::imdecode(buf, cv::IMREAD_COLOR);
+  } catch (const cv::Exception&) {}
+
+  if (image.cols != block.cols()*tile_size_ || image.rows != block.rows()*tile_size_) {
+    std::cerr << "Unexpected WMS response for tiles [" << block.minX() << ","
+              << block.minY() << "]-[" << block.maxX() << "," << block.maxY() << "]"
+              << std::endl;
+    return false;
+  }
+
+  // slice the block into tiles; the slices share the block's pixels
+  tiles.clear();
+  for (const auto& tile : block) {
+    const int col = tile.x - block.minX();
+    const int row = tile.y - block.minY();
+    tiles.push_back(image(cv::Rect(col*tile_size_, row*tile_size_, tile_size_, tile_size_)));
+  }
+
+  if (provider != nullptr) *provider = from;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileLoader::storeTile(int x, int y, const std::string& data, int provider,
+                           bool write_back) const
+{
+  const fs::path full_path = cachedPathForTile(x, y, zoom_, provider);
+
+  // the decoded image may be outdated now
+  decoded_.erase(packTileKey(x, y, zoom_));
+  if (decoded_store_) decoded_store_->erase(packTileKey(x, y, zoom_));
+
+  // Written in a batch later, and until then findQueuedTile() has it. It
+  // is written back to the shared tier once it is on disk here.
+  if (write_queue_) {
+    TileWriteQueue::Callback written;
+    if (shared_ && write_back) {
+      const std::shared_ptr<SharedTileStore> shared = shared_;
+      const std::string service_hash = providers_[provider]->serviceHash();
+      const int z = zoom_;
+      written = [shared, service_hash, x, y, z](const std::string& data) {
+        shared->put(service_hash, x, y, z, data);
+      };
+    }
+    write_queue_->push(full_path, data, written);
+    return true;
+  }
+
+  boost::system::error_code ec;
+  if (providers_[provider]->cacheLayout() != CacheLayout::Flat)
+    fs::create_directories(full_path.parent_path(), ec);
+
+  // Write next to the final name and rename, so that a tile that exists in
+  // the cache is always complete (even if several writers race on it).
+  fs::path tmp_path = full_path;
+  tmp_path += fs::unique_path(".%%%%%%%%.tmp");
+
+  std::fstream imgout(tmp_path.string(), std::ios::out | std::ios::binary);
+  imgout.write(data.c_str(), data.size());
+  imgout.close();
+
+  if (imgout) fs::rename(tmp_path, full_path, ec);
+
+  if (shared_ && write_back && imgout && !ec)
+    shared_->put(providers_[provider]->serviceHash(), x, y, zoom_, data);
+
+  if (!imgout || ec) {
+    std::cerr << "Failed caching tile " << full_path << std::endl;
+    fs::remove(tmp_path, ec);
+    return false;
+  }
 
-  // initiate blocking requests
-  for (int y = min_y; y <= max_y; y++) {
-    for (int x = min_x; x <= max_x; x++) {
-      // Generate filename
-      const fs::path full_path = cachedPathForTile(x, y, zoom_);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileLoader::storeTile(int x, int y, const cv::Mat& image, int provider) const
+{
+  std::vector<unsigned char> buf;
+  const std::vector<int> params = { cv::IMWRITE_JPEG_QUALITY, 95 };
+  if (!cv::imencode(".jpg", image, buf, params)) return false;
+
+  return storeTile(x, y, std::string(buf.begin(), buf.end()), provider);
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileLoader::findFallbackTile(int x, int y, fs::path& path) const
+{
+  for (size_t i=1; i<providers_.size(); i++) {
+    fs::path p = cachedPathForTile(x, y, zoom_, i);
+    if (fs::exists(p)) {
+      path = p;
+      return true;
+    }
+  }
+  return false;
+}
 
-      // Check if tile is already in the cache (or if we shouldn't download)
-      if (fs::exists(full_path) || !download) {
-        tiles_.push_back(MapTile(x, y, zoom_, full_path));
+// ----------------------------------------------------------------------------
+
+bool TileLoader::findSharedTile(int x, int y, std::string& data, int* provider,
+                                const CancelToken* cancel) const
+{
+  if (!shared_) return false;
+
+  for (size_t i=0; i<providers_.size(); i++) {
+    if (cancel != nullptr && cancel->cancelled()) return false;
+    if (shared_->get(providers_[i]->serviceHash(), x, y, zoom_, data, cancel)) {
+      if (provider != nullptr) *provider = i;
+      return true;
+    }
+  }
+  return false;
+}
 
-      } else {
-        const std::string url = uriForTile(x, y);
+// ----------------------------------------------------------------------------
 
-        // send blocking request
-        auto r = cpr::Get(cpr::Url{url});
+bool TileLoader::findQueuedTile(int x, int y, std::string& data, int* provider) const
+{
+  if (!write_queue_) return false;
 
-        // process the response
-        if (r.status_code == 200) {
-          // Save the response text (which is image data) as a binary
-          std::fstream imgout(full_path.string(), std::ios::out | std::ios::binary);
-          imgout.write(r.text.c_str(), r.text.size());
-          imgout.close();
+  for (size_t i=0; i<providers_.size(); i++) {
+    if (write_queue_->find(cachedPathForTile(x, y, zoom_, i), data)) {
+      if (provider != nullptr) *provider = i;
+      return true;
+    }
+  }
+  return false;
+}
 
-          // Let everyone know we have an image for this tile
-          tiles_.push_back(MapTile(x, y, zoom_, full_path));
+// ----------------------------------------------------------------------------
 
-        } else {
-          std::cerr << "Failed loading " << r.url << " with code " << r.status_code << std::endl;
-        }
+TileLoader::Crop TileLoader::planCrop(double north, double west,
+                                     double south, double east,
+                                     double resolution) const
+{
+  if (north <= south || east <= west)
+    throw std::invalid_argument("Empty bounding box");
+
+  // corners in tile coordinates (throws for invalid lat/lon)
+  double x0, y0, x1, y1;
+  latLonToTileCoords(north, west, zoom_, x0, y0);
+  latLonToTileCoords(south, east, zoom_, x1, y1);
+
+  // ground resolution of the tiles, and the pixels of a tile per pixel of
+  // the crop (upsampled below 1)
+  const double native = zoomToResolution((north + south) / 2, zoom_)
+                      * baseTileSize() / tile_size_;
+  const double ratio = resolution > 0 ? resolution / native : 1;
+
+  // Tiles are decoded at a fraction of their size that is still fine
+  // enough (JPEG decoders do 1/2, 1/4 and 1/8 in the DCT domain), and the
+  // crop covers whole decoded pixels of the zoom level
+  Crop c;
+  c.scale = 1;
+  while (c.scale < 8 && 2*c.scale <= ratio && tile_size_ % (2*c.scale) == 0)
+    c.scale *= 2;
+
+  const int s = c.scale;
+  const double world = double(1 << zoom_) * tile_size_;
+  c.x = std::floor(std::max(0.0, x0 * tile_size_) / s) * s;
+  c.y = std::floor(std::max(0.0, y0 * tile_size_) / s) * s;
+  c.width  = std::ceil(std::min(world, x1 * tile_size_) / s) * s - c.x;
+  c.height = std::ceil(std::min(world, y1 * tile_size_) / s) * s - c.y;
+
+  if (c.width / s > maxCropSize() || c.height / s > maxCropSize())
+    throw std::invalid_argument("Crop of " + std::to_string(c.width / s) + "x"
+                                + std::to_string(c.height / s) + " px too large");
+
+  // georeference the pixel edges
+  tileCoordsToLatLon(double(c.x) / tile_size_, double(c.y) / tile_size_,
+                     zoom_, c.north, c.west);
+  tileCoordsToLatLon(double(c.x + c.width) / tile_size_,
+                     double(c.y + c.height) / tile_size_, zoom_, c.south, c.east);
+
+  c.out_width  = std::max(1, int(std::round(c.width / ratio)));
+  c.out_height = std::max(1, int(std::round(c.height / ratio)));
+  c.resolution = zoomToResolution((c.north + c.south) / 2, zoom_)
+               * baseTileSize() / tile_size_ * c.width / c.out_width;
+
+  if (c.out_width > maxCropSize() || c.out_height > maxCropSize())
+    throw std::invalid_argument("Resolution " + std::to_string(resolution)
+                                + " m/px too fine for the bounding box");
+
+  return c;
+}
+
+// ----------------------------------------------------------------------------
+
+int TileLoader::crop(const Crop& crop, cv::Mat& image) const
+{
+  image.create(crop.out_height, crop.out_width, CV_8UC3);
+
+  // assemble at the decoded size, in place if there is no rescaling
+  const int s = crop.scale;
+  const int width = crop.width / s, height = crop.height / s;
+  const bool rescale = crop.out_width != width || crop.out_height != height;
+  cv::Mat native = rescale ? cv::Mat(height, width, CV_8UC3) : image;
+
+  const int T = tile_size_ / s;
+  const int x0 = crop.x / s, y0 = crop.y / s;
+  int missing = 0;
+  for (int ty = y0 / T; ty <= (y0 + height - 1) / T; ty++) {
+    for (int tx = x0 / T; tx <= (x0 + width - 1) / T; tx++) {
+      // part of the tile inside the crop, in crop pixels
+      const cv::Rect tile_rect(tx*T - x0, ty*T - y0, T, T);
+      const cv::Rect dst = tile_rect & cv::Rect(0, 0, width, height);
+
+      cv::Mat roi = native(dst);
+      if (!cropTile(tx, ty, s, dst - tile_rect.tl(), roi)) {
+        roi.setTo(cv::Scalar::all(0));
+        missing++;
       }
     }
   }
 
-  return tiles_;
+  if (rescale)
+    cv::resize(native, image, image.size(), 0, 0,
+               crop.out_width < width ? cv::INTER_AREA : cv::INTER_LINEAR);
+
+  return missing;
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::setHedging(double percentile, const std::vector<std::string>& mirrors)
+{
+  providers_[0]->setHedging(percentile, mirrors);
+  for (size_t i=1; i<providers_.size(); i++)
+    providers_[i]->setHedging(percentile, std::vector<std::string>());
+}
+
+// ----------------------------------------------------------------------------
+
+int TileLoader::tilesPerRequest() const
+{
+  return isWms() ? std::max(1, max_request_size_ / tile_size_) : 1;
 }
 
 // ----------------------------------------------------------------------------
@@ -176,7 +639,7 @@ bool TileLoader::insideCentreTile(double lat, double lon) const
 void TileLoader::latLonToTileCoords(double lat, double lon, unsigned int zoom,
                                     double &x, double &y)
 {
-  if (zoom > 31) {
+  if (zoom > kMaxZoom) {
     throw std::invalid_argument("Zoom level " + std::to_string(zoom) + " too high");
   } else if (lat < -85.0511 || lat > 85.0511) {
     throw std::invalid_argument("Latitude " + std::to_string(lat) + " invalid");
@@ -211,7 +674,8 @@ void TileLoader::tileCoordsToLatLon(double x, double y, unsigned int zoom,
 
 double TileLoader::resolution() const
 {
-  return zoomToResolution(latitude_, zoom_);
+  // zoom levels are defined for 256 px tiles; larger tiles are finer
+  return zoomToResolution(latitude_, zoom_) * baseTileSize() / tile_size_;
 }
 
 // ----------------------------------------------------------------------------
@@ -226,23 +690,32 @@ double TileLoader::zoomToResolution(double lat, unsigned int zoom)
 
 void TileLoader::abort()
 {
-  tiles_.clear();
+  std::lock_guard<std::mutex> lock(cancel_mutex_);
+  cancel_.cancel();
+  cancel_ = CancelToken();
 }
 
 // ----------------------------------------------------------------------------
 
-const int TileLoader::numTilesToDownload() const
+CancelToken TileLoader::cancelToken() const
 {
-  // determine what range of tiles we can load
-  int min_x, max_x, min_y, max_y;
-  tileRange(min_x, max_x, min_y, max_y);
+  std::lock_guard<std::mutex> lock(cancel_mutex_);
+  return cancel_;
+}
+
+// ----------------------------------------------------------------------------
 
+const int TileLoader::numTilesToDownload() const
+{
   // Simply count how many tiles don't have an image on file
   unsigned int n = 0;
-  for (int y = min_y; y <= max_y; y++)
-    for (int x = min_x; x <= max_x; x++)
-      if (!fs::exists(cachedPathForTile(x, y, zoom_)))
-        n++;
+  fs::path path;
+  std::string data;
+  for (const auto& tile : range())
+    if (!fs::exists(cachedPathForTile(tile.x, tile.y, tile.z))
+        && !findFallbackTile(tile.x, tile.y, path)
+        && !findQueuedTile(tile.x, tile.y, data))
+      n++;
 
   return n;
 }
@@ -262,16 +735,34 @@ const int TileLoader::numTiles(int* x, int* y) const
 
 // ----------------------------------------------------------------------------
 
+int TileLoader::numTilesAt(unsigned int zoom, int* x, int* y) const
+{
+  int x_below, x_above, y_below, y_above;
+  tileCounts(zoom, x_below, x_above, y_below, y_above);
+  const int xx = x_above + x_below + 1;
+  const int yy = y_above + y_below + 1;
+
+  if (x != nullptr) *x = xx;
+  if (y != nullptr) *y = yy;
+
+  return xx*yy;
+}
+
+// ----------------------------------------------------------------------------
+
 const std::string TileLoader::hash() const
 {
   std::ostringstream os;
 
-  // The service URI makes it unique
+  // The service URIs make it unique
   os << serviceHash();
 
   // geographic info
   os << latitude_ << longitude_ << zoom_;
 
+  // tile size changes the resolution of the world image
+  if (tile_size_ != baseTileSize()) os << "ts" << tile_size_;
+
   // size information
   os << width_ << height_;
 
@@ -283,34 +774,87 @@ const std::string TileLoader::hash() const
 // Private Methods
 // ----------------------------------------------------------------------------
 
-std::string TileLoader::uriForTile(int x, int y) const
+std::vector<int> TileLoader::providerOrder() const
 {
-  std::string object = object_uri_;
-  //  place {x},{y},{z} with appropriate values
-  replaceRegex(boost::regex("\\{x\\}", boost::regex::icase), object,
-               std::to_string(x));
-  replaceRegex(boost::regex("\\{y\\}", boost::regex::icase), object,
-               std::to_string(y));
-  replaceRegex(boost::regex("\\{z\\}", boost::regex::icase), object,
-               std::to_string(zoom_));
-  return object;
+  std::vector<int> healthy, degraded;
+  for (size_t i=0; i<providers_.size(); i++) {
+    const TileProvider::Health h = providers_[i]->health();
+    if (h.circuit == TileProvider::Circuit::Closed && h.error_rate < 0.5)
+      healthy.push_back(i);
+    else
+      degraded.push_back(i);
+  }
+
+  // degraded providers are a last resort, the least bad one first
+  std::vector<double> score(providers_.size());
+  for (int i : degraded) score[i] = providers_[i]->score();
+  std::stable_sort(degraded.begin(), degraded.end(),
+                   [&score](int a, int b) { return score[a] < score[b]; });
+
+  healthy.insert(healthy.end(), degraded.begin(), degraded.end());
+  return healthy;
 }
 
 // ----------------------------------------------------------------------------
 
-std::string TileLoader::cachedNameForTile(int x, int y, int z) const
+fs::path TileLoader::cachedPathForTile(int x, int y, int z, int provider) const
 {
-  std::ostringstream os;
-  os << "x" << x << "_y" << y << "_z" << z << ".jpg";
-  return os.str();
+  return providers_[provider]->tilePath(x, y, z);
 }
 
 // ----------------------------------------------------------------------------
 
-fs::path TileLoader::cachedPathForTile(int x, int y, int z) const
+bool TileLoader::cropTile(int x, int y, int scale, const cv::Rect& part, cv::Mat& dst) const
 {
-  fs::path p = cache_path_ / cachedNameForTile(x, y, z);
-  return p;
+  const int size = tile_size_ / scale;
+
+  // A tile is kept at the finest scale it was decoded at, which coarser
+  // crops reduce
+  const TileKey key = packTileKey(x, y, zoom_);
+  cv::Mat tile;
+  if (decoded_.get(key, tile) && tile.cols >= size) {
+    if (tile.cols != size)
+      cv::resize(tile, tile, cv::Size(size, size), 0, 0, cv::INTER_AREA);
+    tile(part).copyTo(dst);
+    return true;
+  }
+
+  // (a tile that is still queued to be written is in memory)
+  std::string data;
+  if (!findQueuedTile(x, y, data)) {
+    fs::path path = tilePath(x, y);
+    if (!fs::exists(path) && !findFallbackTile(x, y, path)) return false;
+
+    std::ifstream in(path.string(), std::ios::in | std::ios::binary);
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+
+  // Little of the tile is needed (e.g., at the edges of the crop): decode
+  // just that, and don't keep it
+  int w, h;
+  if (scale == 1 && part.area() < tile_size_*tile_size_/4 && imageDimensions(data, w, h)
+      && w == tile_size_ && h == tile_size_ && decodeJpegRegion(data, part, dst))
+    return true;
+
+  tile.release();
+  if (scale > 1 && isJpeg(data.data(), data.size()))
+    tile = decodeJpegScaled(data.data(), data.size(), scale);
+
+  if (tile.empty()) {
+    try {
+      const cv::Mat buf(1, data.size(), CV_8UC1, &data[0]);
+      tile = cv::imdecode(buf, cv::IMREAD_COLOR);
+    } catch (const cv::Exception&) {}
+  }
+  if (tile.empty()) return false;
+
+  // fallback services may have a different tile size
+  if (tile.cols != size || tile.rows != size)
+    cv::resize(tile, tile, cv::Size(size, size), 0, 0, cv::INTER_AREA);
+
+  decoded_.put(key, tile);
+  tile(part).copyTo(dst);
+  return true;
 }
 
 // ----------------------------------------------------------------------------
@@ -331,4 +875,83 @@ void TileLoader::tileRange(int& min_x, int& max_x, int& min_y, int& max_y) const
   max_y = std::min(maxTiles(), center_tile_y_ + y_tiles_above_);
 }
 
+// ----------------------------------------------------------------------------
+
+void TileLoader::setupTileSize(int tileSize)
+{
+  // The tile size is a property of the service, recorded next to its tiles
+  const fs::path record = providers_[0]->cachePath() / "tilesize";
+
+  // WMS servers and GeoTIFFs render whatever size is asked for
+  if (tileSize <= 0 && (isWms() || providers_[0]->isLocal())) tileSize = baseTileSize();
+
+  if (tileSize <= 0) {
+    std::ifstream in(record.string());
+    if (in >> tileSize && tileSize > 0) {
+      tile_size_ = tileSize;
+      return;
+    }
+
+    // Nothing recorded: look at the center tile, if it is cached. Otherwise
+    // the size is assumed until detectTileSize() downloads it.
+    const fs::path center = cachedPathForTile(center_tile_x_, center_tile_y_, zoom_);
+    std::ifstream img(center.string(), std::ios::in | std::ios::binary);
+    const std::string data((std::istreambuf_iterator<char>(img)), std::istreambuf_iterator<char>());
+
+    int w, h;
+    if (!imageDimensions(data, w, h) || w != h || w <= 0) {
+      tile_size_ = baseTileSize();
+      tile_size_pending_ = true;
+      return;
+    }
+
+    tileSize = w;
+  }
+
+  tile_size_ = tileSize;
+  recordTileSize();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::detectTileSize(const CancelToken* cancel)
+{
+  if (!tile_size_pending_) return;
+
+  // the center tile is needed anyway
+  std::string data;
+  if (providers_[0]->fetchTile(center_tile_x_, center_tile_y_, zoom_, baseTileSize(), data, cancel))
+    storeTile(center_tile_x_, center_tile_y_, data);
+  if (cancel != nullptr) cancel->throwIfCancelled();
+  tile_size_pending_ = false;
+
+  int w, h;
+  if (!imageDimensions(data, w, h) || w != h || w <= 0) {
+    std::cerr << "Could not detect the tile size of " << objectURI()
+              << ", assuming " << baseTileSize() << " px" << std::endl;
+    return;
+  }
+
+  tile_size_ = w;
+  computeTileCounts();
+  recordTileSize();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileLoader::recordTileSize() const
+{
+  std::ofstream out((providers_[0]->cachePath() / "tilesize").string());
+  out << tile_size_ << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+TileRange TileLoader::range() const
+{
+  int min_x, max_x, min_y, max_y;
+  tileRange(min_x, max_x, min_y, max_y);
+  return TileRange(min_x, max_x, min_y, max_y, zoom_);
+}
+
 } // namespace gzsatellite
\ No newline at end of file
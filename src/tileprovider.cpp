@@ -0,0 +1,335 @@
+#include "gzsatellite/tileprovider.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+#include <boost/regex.hpp>
+
+namespace gzsatellite {
+
+namespace fs = boost::filesystem;
+
+static size_t replaceRegex(const boost::regex &ex, std::string &str,
+                           const std::string &replace)
+{
+  std::string::const_iterator start = str.begin(), end = str.end();
+  boost::match_results<std::string::const_iterator> what;
+  boost::match_flag_type flags = boost::match_default;
+  size_t count = 0;
+  while (boost::regex_search(start, end, what, ex, flags)) {
+    str.replace(what.position(), what.length(), replace);
+    start = what[0].second;
+    count++;
+  }
+  return count;
+}
+
+// circuit breaker and health tuning
+static constexpr unsigned int kTripAfterFailures = 5;
+static constexpr double kMinCooldown = 10;  // s
+static constexpr double kMaxCooldown = 300; // s
+static constexpr double kAverageWeight = 0.2;
+
+// ----------------------------------------------------------------------------
+
+TileProvider::TileProvider(const std::string& cacheRoot, const std::string& service,
+                           CacheLayout layout)
+  : service_(service), hedge_percentile_(0), next_mirror_(0),
+    num_hedged_(0), num_hedge_wins_(0),
+    num_requests_(0), num_failures_(0), consecutive_failures_(0),
+    latency_avg_(0), error_rate_(0), circuit_(Circuit::Closed), probing_(false),
+    cooldown_(kMinCooldown)
+{
+  // WMS services are queried by bounding box instead of tile index
+  wms_ = boost::regex_search(service_, boost::regex("\\{bbox\\}", boost::regex::icase));
+
+  // geotiff://<path> serves the tiles of a local orthophoto
+  static const std::string geotiff = "geotiff://";
+  if (service_.compare(0, geotiff.size(), geotiff) == 0)
+    geotiff_.reset(new GeoTiffSource(service_.substr(geotiff.size())));
+
+  // Hash the service URL so that tiles from different services are indepdendent
+  std::hash<std::string> hash_fn;
+  service_hash_ = std::to_string(hash_fn(service_));
+
+  // Create the directory structure for the tile images
+  cache_path_ = fs::absolute(fs::path(cacheRoot + "/" + service_hash_));
+  fs::create_directories(cache_path_);
+  layout_ = openCacheLayout(cache_path_, layout);
+}
+
+// ----------------------------------------------------------------------------
+
+void TileProvider::setHedging(double percentile, const std::vector<std::string>& mirrors)
+{
+  hedge_percentile_ = percentile;
+  mirrors_ = mirrors;
+}
+
+// ----------------------------------------------------------------------------
+
+TileProvider::HedgeStats TileProvider::hedgeStats() const
+{
+  HedgeStats stats;
+  {
+    std::lock_guard<std::mutex> lock(health_mutex_);
+    stats.requests = num_requests_;
+  }
+  stats.hedged = num_hedged_;
+  stats.hedge_wins = num_hedge_wins_;
+  stats.p99 = latency_.percentile(99);
+  stats.p99_unhedged = primary_latency_.percentile(99);
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileProvider::fetchTile(int x, int y, int z, int tile_size, std::string& data,
+                             const CancelToken* cancel)
+{
+  if (geotiff_) {
+    if (cancel != nullptr && cancel->cancelled()) return false;
+
+    // a tile outside of the image is missing, which is no failure
+    const Clock::time_point start = Clock::now();
+    bool error;
+    const bool ok = geotiff_->readTile(x, y, z, tile_size, data, &error);
+    const double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    if (error) reportFailure(elapsed);
+    else reportSuccess(elapsed);
+    return ok;
+  }
+
+  return get(uriForTile(x, y, z, tile_size, service_),
+             uriForTile(x, y, z, tile_size, hedgeService()), data, cancel);
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileProvider::fetchBlock(const TileRange& block, int tile_size, std::string& data,
+                              const CancelToken* cancel)
+{
+  return get(uriForBlock(block, tile_size, service_),
+             uriForBlock(block, tile_size, hedgeService()), data, cancel);
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileProvider::acquire()
+{
+  std::lock_guard<std::mutex> lock(health_mutex_);
+
+  if (circuit_ == Circuit::Closed) return true;
+  if (probing_ || Clock::now() < retry_at_) return false;
+
+  // cool-down is over: let a single request find out if we recovered
+  circuit_ = Circuit::HalfOpen;
+  probing_ = true;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+double TileProvider::score() const
+{
+  std::lock_guard<std::mutex> lock(health_mutex_);
+  if (circuit_ != Circuit::Closed) return std::numeric_limits<double>::infinity();
+  return latency_avg_ * (1 + 10*error_rate_);
+}
+
+// ----------------------------------------------------------------------------
+
+TileProvider::Health TileProvider::health() const
+{
+  std::lock_guard<std::mutex> lock(health_mutex_);
+
+  Health h;
+  h.requests = num_requests_;
+  h.failures = num_failures_;
+  h.latency = latency_avg_;
+  h.error_rate = error_rate_;
+  h.circuit = circuit_;
+  return h;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+std::string TileProvider::uriForTile(int x, int y, int z, int tile_size,
+                                     const std::string& service) const
+{
+  if (wms_) return uriForBlock(TileRange(x, x, y, y, z), tile_size, service);
+
+  std::string object = service;
+  //  place {x},{y},{z} with appropriate values
+  replaceRegex(boost::regex("\\{x\\}", boost::regex::icase), object,
+               std::to_string(x));
+  replaceRegex(boost::regex("\\{y\\}", boost::regex::icase), object,
+               std::to_string(y));
+  replaceRegex(boost::regex("\\{z\\}", boost::regex::icase), object,
+               std::to_string(z));
+  return object;
+}
+
+// ----------------------------------------------------------------------------
+
+std::string TileProvider::uriForBlock(const TileRange& block, int tile_size,
+                                      const std::string& service) const
+{
+  // Web Mercator (EPSG:3857) extent of the block, in meters
+  const double extent = M_PI * 6378137.0;
+  const double n = (1 << block.zoom());
+
+  std::ostringstream bbox;
+  bbox << std::fixed << std::setprecision(3)
+       << (block.minX() / n) * 2*extent - extent << ","
+       << extent - ((block.maxY() + 1) / n) * 2*extent << ","
+       << ((block.maxX() + 1) / n) * 2*extent - extent << ","
+       << extent - (block.minY() / n) * 2*extent;
+
+  std::string object = service;
+  //  place {bbox},{width},{height} with appropriate values
+  replaceRegex(boost::regex("\\{bbox\\}", boost::regex::icase), object, bbox.str());
+  replaceRegex(boost::regex("\\{width\\}", boost::regex::icase), object,
+               std::to_string(block.cols()*tile_size));
+  replaceRegex(boost::regex("\\{height\\}", boost::regex::icase), object,
+               std::to_string(block.rows()*tile_size));
+  return object;
+}
+
+// ----------------------------------------------------------------------------
+
+const std::string& TileProvider::hedgeService()
+{
+  if (mirrors_.empty()) return service_;
+  return mirrors_[next_mirror_++ % mirrors_.size()];
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileProvider::get(const std::string& url, const std::string& hedge_url,
+                       std::string& data, const CancelToken* cancel)
+{
+  HttpClient::Request request;
+  request.url = url;
+  request.hedge_url = hedge_url;
+  request.cancel = cancel;
+
+  if (latency_.samples() >= kMinHedgeSamples) {
+    // hedge once a request is slower than most recent ones
+    if (hedge_percentile_ > 0)
+      request.hedge_after = latency_.percentile(hedge_percentile_);
+
+    // don't wait for minutes on a provider that has become slow
+    request.timeout = std::min(30.0, std::max(2.0, 8*latency_.percentile(95)));
+  } else {
+    request.timeout = 30;
+  }
+
+  // send blocking request
+  auto r = HttpClient::get(request);
+
+  if (r.cancelled) {
+    reportCancelled();
+    return false;
+  }
+
+  if (r.hedged) num_hedged_++;
+  if (r.hedge_won) num_hedge_wins_++;
+
+  if (r.status != 200) {
+    std::cerr << "Failed loading " << url << " with code " << r.status;
+    if (!r.error.empty()) std::cerr << " (" << r.error << ")";
+    std::cerr << std::endl;
+
+    // a missing tile (404, ...) does not make the provider unhealthy
+    if (r.status == 0 || r.status == 429 || r.status >= 500) reportFailure(r.elapsed);
+    else reportSuccess(r.elapsed);
+    return false;
+  }
+
+  latency_.add(r.elapsed);
+  primary_latency_.add(r.primary);
+  reportSuccess(r.elapsed);
+
+  // the response body is the image data
+  data = std::move(r.body);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void TileProvider::reportSuccess(double latency)
+{
+  std::lock_guard<std::mutex> lock(health_mutex_);
+
+  num_requests_++;
+  addLatency(latency);
+  error_rate_ = (1 - kAverageWeight)*error_rate_;
+  consecutive_failures_ = 0;
+
+  // a successful probe closes the circuit again
+  if (circuit_ == Circuit::HalfOpen) {
+    circuit_ = Circuit::Closed;
+    probing_ = false;
+    cooldown_ = kMinCooldown;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void TileProvider::reportFailure(double latency)
+{
+  std::lock_guard<std::mutex> lock(health_mutex_);
+
+  // waiting for a failure costs time, too
+  num_requests_++;
+  num_failures_++;
+  addLatency(latency);
+  error_rate_ = (1 - kAverageWeight)*error_rate_ + kAverageWeight;
+  consecutive_failures_++;
+
+  if (circuit_ == Circuit::HalfOpen) {
+    // still broken: back off for longer
+    cooldown_ = std::min(kMaxCooldown, 2*cooldown_);
+    probing_ = false;
+  } else if (circuit_ == Circuit::Open || consecutive_failures_ < kTripAfterFailures) {
+    return;
+  }
+
+  circuit_ = Circuit::Open;
+  retry_at_ = Clock::now() + std::chrono::milliseconds(static_cast<long>(cooldown_*1000));
+  std::cerr << "Tileserver " << service_ << " is failing, not using it for "
+            << cooldown_ << " s" << std::endl;
+}
+
+// ----------------------------------------------------------------------------
+
+void TileProvider::reportCancelled()
+{
+  std::lock_guard<std::mutex> lock(health_mutex_);
+
+  // let the next request probe instead
+  if (circuit_ == Circuit::HalfOpen) {
+    circuit_ = Circuit::Open;
+    probing_ = false;
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+void TileProvider::addLatency(double latency)
+{
+  latency_avg_ = (num_requests_ == 1) ? latency
+               : (1 - kAverageWeight)*latency_avg_ + kAverageWeight*latency;
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,365 @@
+#include "gzsatellite/tilereader.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef GZSATELLITE_HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+namespace gzsatellite {
+
+PooledBuffer::PooledBuffer(BufferPool* pool, std::vector<char>&& storage)
+  : pool_(pool), storage_(std::move(storage)), size_(0)
+{}
+
+// ----------------------------------------------------------------------------
+
+PooledBuffer::PooledBuffer(PooledBuffer&& other)
+  : pool_(other.pool_), storage_(std::move(other.storage_)), size_(other.size_)
+{
+  other.pool_ = nullptr;
+  other.size_ = 0;
+}
+
+// ----------------------------------------------------------------------------
+
+PooledBuffer& PooledBuffer::operator=(PooledBuffer&& other)
+{
+  if (this != &other) {
+    if (pool_ != nullptr) pool_->release(std::move(storage_));
+
+    pool_ = other.pool_;
+    storage_ = std::move(other.storage_);
+    size_ = other.size_;
+
+    other.pool_ = nullptr;
+    other.size_ = 0;
+  }
+  return *this;
+}
+
+// ----------------------------------------------------------------------------
+
+PooledBuffer::~PooledBuffer()
+{
+  if (pool_ != nullptr) pool_->release(std::move(storage_));
+}
+
+// ----------------------------------------------------------------------------
+
+void PooledBuffer::resize(size_t size)
+{
+  if (size > storage_.size()) storage_.resize(size);
+  size_ = size;
+}
+
+// ----------------------------------------------------------------------------
+
+BufferPool::BufferPool(size_t buffer_size, size_t max_free)
+  : buffer_size_(buffer_size), max_free_(max_free)
+{}
+
+// ----------------------------------------------------------------------------
+
+PooledBuffer BufferPool::acquire()
+{
+  std::vector<char> storage;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!free_.empty()) {
+      storage = std::move(free_.back());
+      free_.pop_back();
+    }
+  }
+
+  if (storage.size() < buffer_size_) storage.resize(buffer_size_);
+  return PooledBuffer(this, std::move(storage));
+}
+
+// ----------------------------------------------------------------------------
+
+void BufferPool::release(std::vector<char>&& storage)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (free_.size() < max_free_ && !storage.empty())
+    free_.push_back(std::move(storage));
+}
+
+// ----------------------------------------------------------------------------
+
+TileReader::TileReader(BufferPool& pool, unsigned int threads, unsigned int batch_size)
+  : pool_(pool), threads_(std::max(1u, threads)), batch_size_(std::max(1u, batch_size)),
+    uring_unavailable_(false)
+{}
+
+// ----------------------------------------------------------------------------
+
+void TileReader::read(size_t count, const PathFn& path_for, const Callback& done,
+                      const CancelToken* cancel)
+{
+  if (count == 0) return;
+
+  if (uring_unavailable_ || !readUring(count, path_for, done, cancel))
+    readThreaded(count, path_for, done, cancel);
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+#ifdef GZSATELLITE_HAVE_LIBURING
+
+struct TileReader::Ring
+{
+  io_uring ring;
+
+  explicit Ring(unsigned int entries)
+  {
+    if (io_uring_queue_init(entries, &ring, 0) < 0)
+      throw std::runtime_error("io_uring_queue_init");
+  }
+
+  ~Ring() { io_uring_queue_exit(&ring); }
+};
+
+// ----------------------------------------------------------------------------
+
+TileReader::~TileReader() = default;
+
+// ----------------------------------------------------------------------------
+
+bool TileReader::readUring(size_t count, const PathFn& path_for, const Callback& done,
+                           const CancelToken* cancel)
+{
+  // a batch reads and stats each file at once
+  if (!ring_) {
+    try {
+      ring_.reset(new Ring(2*batch_size_));
+    } catch (const std::runtime_error&) {
+      uring_unavailable_ = true;
+      return false;
+    }
+  }
+  io_uring& ring = ring_->ring;
+
+  struct Slot;
+
+  /// An operation in flight on the file of a slot
+  struct Op
+  {
+    Slot* slot;
+    int res;
+  };
+
+  struct Slot
+  {
+    size_t index;
+    std::string path;
+    int fd;
+    struct statx stx;
+    PooledBuffer buffer;
+    Op open, read, stat, close;
+  };
+
+  std::vector<Slot> slots(batch_size_);
+
+  auto submit = [&ring](Op& op, Slot& slot) {
+    op.slot = &slot;
+    op.res = -ECANCELED;
+    io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+    io_uring_sqe_set_data(sqe, &op);
+    return sqe;
+  };
+
+  // Submit everything queued and reap exactly `n` completions
+  auto complete = [&ring](unsigned int n) {
+    io_uring_submit(&ring);
+    for (unsigned int i=0; i<n; i++) {
+      io_uring_cqe* cqe;
+      if (io_uring_wait_cqe(&ring, &cqe) < 0) break;
+      static_cast<Op*>(io_uring_cqe_get_data(cqe))->res = cqe->res;
+      io_uring_cqe_seen(&ring, cqe);
+    }
+  };
+
+  for (size_t first=0; first<count; first+=batch_size_)
+  {
+    if (cancel != nullptr && cancel->cancelled()) break;
+
+    const unsigned int n = std::min<size_t>(batch_size_, count - first);
+
+    // 1. open every file of the batch
+    for (unsigned int i=0; i<n; i++) {
+      Slot& slot = slots[i];
+      slot.index = first + i;
+      slot.path = path_for(slot.index);
+      io_uring_prep_openat(submit(slot.open, slot), AT_FDCWD, slot.path.c_str(),
+                           O_RDONLY | O_CLOEXEC, 0);
+    }
+    complete(n);
+
+    bool unsupported = false;
+    for (unsigned int i=0; i<n; i++) {
+      slots[i].fd = slots[i].open.res;
+      if (slots[i].fd == -EINVAL || slots[i].fd == -EOPNOTSUPP) unsupported = true;
+    }
+
+    // kernels before 5.6 cannot open files through io_uring
+    if (unsupported && first == 0) {
+      for (unsigned int i=0; i<n; i++)
+        if (slots[i].fd >= 0) ::close(slots[i].fd);
+      ring_.reset();
+      uring_unavailable_ = true;
+      return false;
+    }
+
+    // 2. read every opened file into a pooled buffer, and get its size
+    // (of the file that is open, even if it was replaced in the meantime)
+    unsigned int opened = 0;
+    for (unsigned int i=0; i<n; i++) {
+      Slot& slot = slots[i];
+      if (slot.fd < 0) continue;
+
+      slot.buffer = pool_.acquire();
+      io_uring_prep_read(submit(slot.read, slot), slot.fd, slot.buffer.data(),
+                         slot.buffer.capacity(), 0);
+      io_uring_prep_statx(submit(slot.stat, slot), slot.fd, "", AT_EMPTY_PATH,
+                          STATX_SIZE, &slot.stx);
+      opened++;
+    }
+    complete(2*opened);
+
+    for (unsigned int i=0; i<n; i++) {
+      Slot& slot = slots[i];
+      if (slot.fd < 0) continue;
+
+      const bool sized = slot.stat.res == 0 && (slot.stx.stx_mask & STATX_SIZE);
+      if (!finishRead(slot.fd, slot.buffer, slot.read.res,
+                      sized ? static_cast<long long>(slot.stx.stx_size) : -1))
+        slot.buffer.resize(0);
+    }
+
+    // 3. close them all again, then hand out the data
+    for (unsigned int i=0; i<n; i++) {
+      Slot& slot = slots[i];
+      if (slot.fd >= 0) io_uring_prep_close(submit(slot.close, slot), slot.fd);
+    }
+    complete(opened);
+
+    for (unsigned int i=0; i<n; i++) {
+      Slot& slot = slots[i];
+      if (slot.fd >= 0 && slot.close.res < 0) ::close(slot.fd);
+      slot.fd = -1;
+      done(slot.index, std::move(slot.buffer));
+    }
+  }
+
+  return true;
+}
+
+#else
+
+struct TileReader::Ring {};
+
+// ----------------------------------------------------------------------------
+
+TileReader::~TileReader() = default;
+
+// ----------------------------------------------------------------------------
+
+bool TileReader::readUring(size_t, const PathFn&, const Callback&, const CancelToken*)
+{
+  uring_unavailable_ = true;
+  return false;
+}
+
+#endif
+
+// ----------------------------------------------------------------------------
+
+void TileReader::readThreaded(size_t count, const PathFn& path_for, const Callback& done,
+                              const CancelToken* cancel)
+{
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    for (size_t i = next++; i < count; i = next++)
+    {
+      if (cancel != nullptr && cancel->cancelled()) break;
+
+      PooledBuffer buffer;
+
+      const int fd = ::open(path_for(i).c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd >= 0) {
+        buffer = pool_.acquire();
+
+        ssize_t res;
+        do {
+          res = ::pread(fd, buffer.data(), buffer.capacity(), 0);
+        } while (res < 0 && errno == EINTR);
+
+        struct stat st;
+        const long long size = ::fstat(fd, &st) == 0 ? st.st_size : -1;
+        if (!finishRead(fd, buffer, res, size)) buffer.resize(0);
+
+        ::close(fd);
+      }
+
+      done(i, std::move(buffer));
+    }
+  };
+
+  std::vector<std::thread> pool;
+  const unsigned int n = std::min<size_t>(threads_, count);
+  for (unsigned int i=1; i<n; i++)
+    pool.emplace_back(worker);
+  worker();
+
+  for (auto& t : pool) t.join();
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileReader::finishRead(int fd, PooledBuffer& buffer, long res, long long size)
+{
+  if (res <= 0) return false;
+  buffer.resize(res);
+  if (res == size) return true;
+
+  // a short read, a file larger than the buffer, or one of unknown size
+  if (!readRemainder(fd, buffer)) return false;
+  return size < 0 || static_cast<long long>(buffer.size()) == size;
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileReader::readRemainder(int fd, PooledBuffer& buffer)
+{
+  size_t size = buffer.size();
+
+  while (true) {
+    if (size == buffer.capacity())
+      buffer.resize(2*size);
+
+    const ssize_t res = ::pread(fd, buffer.data() + size, buffer.capacity() - size, size);
+    if (res < 0 && errno == EINTR) continue;
+    if (res < 0) return false;
+    if (res == 0) break;
+    size += res;
+  }
+
+  buffer.resize(size);
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+}
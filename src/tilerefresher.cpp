@@ -0,0 +1,121 @@
+#include "gzsatellite/tilerefresher.h"
+
+#include <ctime>
+#include <iostream>
+
+#include "gzsatellite/tickscheduler.h"
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+TileRefresher::TileRefresher(const TileLoader& loader, double ttl)
+  : loader_(loader), ttl_(ttl)
+{}
+
+// ----------------------------------------------------------------------------
+
+TileRefresher::~TileRefresher()
+{
+  stop();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileRefresher::start(const Callback& done)
+{
+  stop();
+  cancel_ = loader_.cancelToken().child();
+  thread_ = std::thread(&TileRefresher::run, this, done);
+}
+
+// ----------------------------------------------------------------------------
+
+void TileRefresher::stop()
+{
+  cancel_.cancel();
+  if (thread_.joinable()) thread_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+size_t TileRefresher::countStale() const
+{
+  size_t n = 0;
+  fs::path path;
+  bool stale;
+  for (const auto& tile : loader_.range())
+    if (cachedTile(tile.x, tile.y, path, stale) && stale)
+      n++;
+
+  return n;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+bool TileRefresher::cachedTile(int x, int y, fs::path& path, bool& stale) const
+{
+  // the same lookup order as the pipeline: own cache, then the fallbacks'
+  path = loader_.tilePath(x, y);
+  if (!fs::exists(path) && !loader_.findFallbackTile(x, y, path)) return false;
+
+  boost::system::error_code ec;
+  const std::time_t fetched = fs::last_write_time(path, ec);
+  stale = !ec && std::difftime(std::time(nullptr), fetched) > ttl_;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void TileRefresher::run(Callback done)
+{
+  // Only use the CPU and the disk (and, by extension, the network) when
+  // nobody else does. Threads this one starts inherit its priority.
+  setBackgroundPriority(19, true);
+
+  size_t refreshed = 0, failed = 0;
+  for (const auto& tile : loader_.range())
+  {
+    if (cancel_.cancelled()) return;
+
+    fs::path path;
+    bool stale;
+    if (!cachedTile(tile.x, tile.y, path, stale) || !stale) continue;
+
+    // keep the stale image unless the new one is a proper image
+    std::string data;
+    int provider;
+    bool ok = loader_.fetchTile(tile.x, tile.y, data, &provider, &cancel_);
+    if (ok) {
+      try {
+        const cv::Mat buf(1, data.size(), CV_8UC1, &data[0]);
+        ok = !cv::imdecode(buf, cv::IMREAD_COLOR).empty();
+      } catch (const cv::Exception&) {
+        ok = false;
+      }
+    }
+
+    if (ok && loader_.storeTile(tile.x, tile.y, data, provider)) {
+      // the stale copy may be in another provider's cache, which could be
+      // looked up before the fresh one
+      if (path != loader_.tilePath(tile.x, tile.y, provider)) {
+        boost::system::error_code ec;
+        fs::remove(path, ec);
+      }
+      refreshed++;
+    } else {
+      failed++;
+    }
+  }
+
+  if (failed > 0)
+    std::cerr << "Could not refresh " << failed << " stale tiles, keeping them" << std::endl;
+
+  if (refreshed > 0 && !cancel_.cancelled()) done(refreshed, cancel_);
+}
+
+// ----------------------------------------------------------------------------
+
+}
@@ -0,0 +1,209 @@
+#include "gzsatellite/tilewritequeue.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <set>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fs = boost::filesystem;
+
+namespace gzsatellite {
+
+// ----------------------------------------------------------------------------
+
+TileWriteQueue::TileWriteQueue(size_t batch_size, double linger)
+  : batch_size_(std::max<size_t>(1, batch_size)), linger_(std::max(0.0, linger)),
+    writing_(0), stopping_(false), num_batches_(0), num_tiles_(0), num_failures_(0)
+{
+  writer_ = std::thread(&TileWriteQueue::run, this);
+}
+
+// ----------------------------------------------------------------------------
+
+TileWriteQueue::~TileWriteQueue()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  queued_.notify_all();
+  writer_.join();
+}
+
+// ----------------------------------------------------------------------------
+
+void TileWriteQueue::push(const fs::path& path, const std::string& data,
+                          const Callback& written)
+{
+  Tile tile;
+  tile.path = path;
+  tile.data = std::make_shared<const std::string>(data);
+  tile.written = written;
+
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  // a few batches ahead of the writer at most
+  written_.wait(lock, [this]{ return queue_.size() < 4*batch_size_ || stopping_; });
+
+  pending_[path.string()] = tile.data;
+  queue_.push_back(tile);
+  lock.unlock();
+  queued_.notify_one();
+}
+
+// ----------------------------------------------------------------------------
+
+bool TileWriteQueue::find(const fs::path& path, std::string& data) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto it = pending_.find(path.string());
+  if (it == pending_.end()) return false;
+  data = *it->second;
+  return true;
+}
+
+// ----------------------------------------------------------------------------
+
+void TileWriteQueue::flush()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  written_.wait(lock, [this]{ return queue_.empty() && writing_ == 0; });
+}
+
+// ----------------------------------------------------------------------------
+
+TileWriteQueue::Stats TileWriteQueue::stats() const
+{
+  Stats stats;
+  stats.batches = num_batches_;
+  stats.tiles = num_tiles_;
+  stats.failures = num_failures_;
+  return stats;
+}
+
+// ----------------------------------------------------------------------------
+// Private Methods
+// ----------------------------------------------------------------------------
+
+void TileWriteQueue::run()
+{
+  typedef std::chrono::steady_clock Clock;
+  const auto linger = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(linger_));
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true)
+  {
+    queued_.wait(lock, [this]{ return stopping_ || !queue_.empty(); });
+    if (queue_.empty()) break; // (stopping, and all written)
+
+    // let a batch fill up, unless we are shutting down
+    const Clock::time_point deadline = Clock::now() + linger;
+    queued_.wait_until(lock, deadline,
+                       [this]{ return stopping_ || queue_.size() >= batch_size_; });
+
+    std::vector<Tile> batch;
+    while (!queue_.empty() && batch.size() < batch_size_) {
+      batch.push_back(queue_.front());
+      queue_.pop_front();
+    }
+    writing_ = batch.size();
+    lock.unlock();
+    written_.notify_all(); // room in the queue
+
+    const std::vector<bool> written = writeBatch(batch);
+    num_batches_++;
+    for (size_t i=0; i<batch.size(); i++) {
+      if (!written[i]) {
+        num_failures_++;
+        continue;
+      }
+      num_tiles_++;
+      if (batch[i].written) batch[i].written(*batch[i].data);
+    }
+
+    // written tiles are read from the cache now, unless queued again since
+    lock.lock();
+    for (const auto& tile : batch) {
+      const auto it = pending_.find(tile.path.string());
+      if (it != pending_.end() && it->second == tile.data) pending_.erase(it);
+    }
+    writing_ = 0;
+    written_.notify_all();
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+std::vector<bool> TileWriteQueue::writeBatch(const std::vector<Tile>& batch)
+{
+  // 1. temporary files next to the final names, with their writeback
+  // started right away
+  std::vector<fs::path> tmp_paths(batch.size());
+  std::vector<int> fds(batch.size(), -1);
+  std::vector<bool> ok(batch.size(), false);
+  std::set<fs::path> dirs;
+  for (size_t i=0; i<batch.size(); i++) {
+    const fs::path dir = batch[i].path.parent_path();
+    boost::system::error_code ec;
+    if (dirs.insert(dir).second) fs::create_directories(dir, ec);
+
+    tmp_paths[i] = batch[i].path;
+    tmp_paths[i] += fs::unique_path(".%%%%%%%%.tmp");
+
+    fds[i] = ::open(tmp_paths[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fds[i] < 0) continue;
+
+    const std::string& data = *batch[i].data;
+    size_t done = 0;
+    while (done < data.size()) {
+      const ssize_t n = ::write(fds[i], data.data() + done, data.size() - done);
+      if (n <= 0) break;
+      done += n;
+    }
+    ok[i] = (done == data.size());
+
+#ifdef __linux__
+    if (ok[i]) ::sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+  }
+
+  // 2. wait for the data of the batch (and of nothing else) to be on disk;
+  // the writeback of most of it has finished by now
+  for (size_t i=0; i<batch.size(); i++) {
+    if (fds[i] < 0) continue;
+#ifdef __linux__
+    ok[i] = ok[i] && ::fdatasync(fds[i]) == 0;
+#else
+    ok[i] = ok[i] && ::fsync(fds[i]) == 0;
+#endif
+    ok[i] = (::close(fds[i]) == 0) && ok[i];
+  }
+
+  // 3. publish the tiles, and make their names durable
+  for (size_t i=0; i<batch.size(); i++) {
+    boost::system::error_code ec;
+    if (ok[i]) fs::rename(tmp_paths[i], batch[i].path, ec);
+    if (!ok[i] || ec) {
+      std::cerr << "Failed caching tile " << batch[i].path << std::endl;
+      fs::remove(tmp_paths[i], ec);
+      ok[i] = false;
+    }
+  }
+
+  for (const auto& dir : dirs) {
+    const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) continue;
+    ::fsync(fd);
+    ::close(fd);
+  }
+
+  return ok;
+}
+
+// ----------------------------------------------------------------------------
+
+}
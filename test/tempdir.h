@@ -0,0 +1,38 @@
+/**
+ * TempDir: a scratch directory for a test, removed with all it holds.
+ */
+
+#pragma once
+
+#include <string>
+
+#include <boost/filesystem.hpp>
+
+namespace gzsatellite {
+
+  class TempDir
+  {
+  public:
+    TempDir()
+      : path_(boost::filesystem::temp_directory_path()
+              / boost::filesystem::unique_path("gzsatellite-test-%%%%-%%%%-%%%%"))
+    {
+      boost::filesystem::create_directories(path_);
+    }
+
+    ~TempDir()
+    {
+      boost::system::error_code ec;
+      boost::filesystem::remove_all(path_, ec);
+    }
+
+    const boost::filesystem::path& path() const { return path_; }
+
+    /// Path of name in the directory, as a string
+    std::string file(const std::string& name) const { return (path_ / name).string(); }
+
+  private:
+    boost::filesystem::path path_;
+  };
+
+}
@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+#include "gzsatellite/cachelayout.h"
+#include "tempdir.h"
+
+using namespace gzsatellite;
+namespace fs = boost::filesystem;
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, PathsOfEachLayout)
+{
+  EXPECT_EQ(fs::path("x3_y5_z7.jpg"), cacheLayoutPath(CacheLayout::Flat, 3, 5, 7));
+  EXPECT_EQ(fs::path("7/3/5.jpg"), cacheLayoutPath(CacheLayout::Zxy, 3, 5, 7));
+
+  // {Z}/{HH}/{X}/{Y}.jpg
+  const fs::path sharded = cacheLayoutPath(CacheLayout::Sharded, 3, 5, 7);
+  const std::vector<fs::path> parts(sharded.begin(), sharded.end());
+  ASSERT_EQ(4u, parts.size());
+  EXPECT_EQ("7", parts[0].string());
+  EXPECT_EQ(2u, parts[1].string().size());
+  EXPECT_EQ("3", parts[2].string());
+  EXPECT_EQ("5.jpg", parts[3].string());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, ShardsNeighbouringColumnsApart)
+{
+  const fs::path a = cacheLayoutPath(CacheLayout::Sharded, 100, 0, 10);
+  const fs::path b = cacheLayoutPath(CacheLayout::Sharded, 101, 0, 10);
+  EXPECT_NE(*std::next(a.begin()), *std::next(b.begin()));
+
+  // the bucket only depends on the column
+  const fs::path c = cacheLayoutPath(CacheLayout::Sharded, 100, 9, 10);
+  EXPECT_EQ(*std::next(a.begin()), *std::next(c.begin()));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, ParsesFlatTileNames)
+{
+  int x, y, z;
+  ASSERT_TRUE(parseFlatTileName(cacheLayoutPath(CacheLayout::Flat, 123, 456, 17).string(), x, y, z));
+  EXPECT_EQ(123, x);
+  EXPECT_EQ(456, y);
+  EXPECT_EQ(17, z);
+
+  // temporary files of tiles being written, and metadata, are no tiles
+  EXPECT_FALSE(parseFlatTileName("x1_y2_z3.jpg.a1b2c3d4.tmp", x, y, z));
+  EXPECT_FALSE(parseFlatTileName("x1_y2_z3.png", x, y, z));
+  EXPECT_FALSE(parseFlatTileName("x1_y2.jpg", x, y, z));
+  EXPECT_FALSE(parseFlatTileName("layout", x, y, z));
+  EXPECT_FALSE(parseFlatTileName("tile_size", x, y, z));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, ParsesNames)
+{
+  for (CacheLayout layout : {CacheLayout::Flat, CacheLayout::Zxy, CacheLayout::Sharded})
+    EXPECT_EQ(layout, parseCacheLayout(cacheLayoutName(layout)));
+  EXPECT_THROW(parseCacheLayout("nested"), std::invalid_argument);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, NewDirectoryTakesThePreferredLayout)
+{
+  TempDir dir;
+  std::ofstream(dir.file("tile_size")) << 512;
+  std::ofstream(dir.file("x1_y2_z3.jpg.a1b2c3d4.tmp"));
+
+  EXPECT_EQ(CacheLayout::Sharded, openCacheLayout(dir.path(), CacheLayout::Sharded));
+  // ... and records it
+  EXPECT_EQ(CacheLayout::Sharded, openCacheLayout(dir.path(), CacheLayout::Zxy));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, DirectoryWithFlatTilesIsFlat)
+{
+  TempDir dir;
+  std::ofstream(dir.file("x1_y2_z3.jpg"));
+
+  EXPECT_EQ(CacheLayout::Flat, openCacheLayout(dir.path(), CacheLayout::Zxy));
+  EXPECT_EQ(CacheLayout::Flat, openCacheLayout(dir.path(), CacheLayout::Zxy));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(CacheLayout, RecordedLayoutWins)
+{
+  TempDir dir;
+  std::ofstream(dir.file("x1_y2_z3.jpg"));
+  ASSERT_TRUE(writeCacheLayout(dir.path(), CacheLayout::Zxy));
+
+  EXPECT_EQ(CacheLayout::Zxy, openCacheLayout(dir.path(), CacheLayout::Sharded));
+}
@@ -0,0 +1,148 @@
+#include <gtest/gtest.h>
+
+#include <cstdint>
+#include <fstream>
+
+#include "gzsatellite/downloadjournal.h"
+#include "tempdir.h"
+
+using namespace gzsatellite;
+namespace fs = boost::filesystem;
+
+namespace {
+
+  // A log record as the journal writes it: index (little endian), status
+  void appendRecord(const std::string& log_path, uint64_t i, TileStatus status, size_t size = 9)
+  {
+    char record[9];
+    for (size_t b=0; b<8; b++) record[b] = static_cast<char>((i >> (8*b)) & 0xFF);
+    record[8] = static_cast<char>(status);
+    std::ofstream(log_path, std::ios::binary | std::ios::app).write(record, size);
+  }
+
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(DownloadJournal, ResumesWhereItStopped)
+{
+  TempDir dir;
+  const std::string path = dir.file("prefetch.journal");
+  {
+    TileRange range(0, 9, 0, 9, 8);
+    DownloadJournal journal(path, "osm", range);
+    EXPECT_FALSE(journal.resumed());
+    journal.record(0, TileStatus::Available);
+    journal.record(42, TileStatus::Failed);
+    journal.record(99, TileStatus::Available);
+  }
+
+  TileRange range(0, 9, 0, 9, 8);
+  DownloadJournal journal(path, "osm", range);
+  EXPECT_TRUE(journal.resumed());
+  EXPECT_EQ(TileStatus::Available, range.status(0));
+  EXPECT_EQ(TileStatus::Failed, range.status(42));
+  EXPECT_EQ(TileStatus::Available, range.status(99));
+  EXPECT_EQ(97u, range.count(TileStatus::Pending));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(DownloadJournal, ReplaysTheLogAndDropsATornRecord)
+{
+  TempDir dir;
+  const std::string path = dir.file("prefetch.journal");
+  {
+    TileRange range(0, 9, 0, 9, 8);
+    DownloadJournal journal(path, "osm", range);
+    journal.record(1, TileStatus::Available);
+  }
+
+  // records written after the last checkpoint, then a crash
+  appendRecord(path + ".log", 2, TileStatus::Available);
+  appendRecord(path + ".log", 3, TileStatus::Failed);
+  appendRecord(path + ".log", 500, TileStatus::Available);
+  appendRecord(path + ".log", 4, TileStatus::Available, 5);
+
+  TileRange range(0, 9, 0, 9, 8);
+  DownloadJournal journal(path, "osm", range);
+  ASSERT_TRUE(journal.resumed());
+  EXPECT_EQ(TileStatus::Available, range.status(1));
+  EXPECT_EQ(TileStatus::Available, range.status(2));
+  EXPECT_EQ(TileStatus::Failed, range.status(3));
+  EXPECT_EQ(TileStatus::Pending, range.status(4));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(DownloadJournal, TilesInFlightArePendingAgain)
+{
+  TempDir dir;
+  const std::string path = dir.file("prefetch.journal");
+  {
+    TileRange range(0, 3, 0, 3, 8);
+    DownloadJournal journal(path, "osm", range);
+    journal.record(5, TileStatus::InFlight);
+  }
+
+  TileRange range(0, 3, 0, 3, 8);
+  DownloadJournal journal(path, "osm", range);
+  ASSERT_TRUE(journal.resumed());
+  EXPECT_EQ(16u, range.count(TileStatus::Pending));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(DownloadJournal, StartsOverForAnotherJobOrRange)
+{
+  TempDir dir;
+  const std::string path = dir.file("prefetch.journal");
+  {
+    TileRange range(0, 3, 0, 3, 8);
+    DownloadJournal journal(path, "osm", range);
+    journal.record(0, TileStatus::Available);
+  }
+  {
+    TileRange range(0, 3, 0, 3, 8);
+    DownloadJournal journal(path, "bing", range);
+    EXPECT_FALSE(journal.resumed());
+    EXPECT_EQ(TileStatus::Pending, range.status(0));
+  }
+
+  TileRange range(0, 4, 0, 3, 8);
+  DownloadJournal journal(path, "bing", range);
+  EXPECT_FALSE(journal.resumed());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(DownloadJournal, CheckpointsEverySoManyRecords)
+{
+  TempDir dir;
+  const std::string path = dir.file("prefetch.journal");
+  TileRange range(0, 9, 0, 9, 8);
+  DownloadJournal journal(path, "osm", range, 4);
+
+  for (size_t i=0; i<4; i++) journal.record(i, TileStatus::Available);
+  EXPECT_EQ(0u, fs::file_size(path + ".log"));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(DownloadJournal, FinishedDownloadLeavesNothing)
+{
+  TempDir dir;
+  const std::string path = dir.file("prefetch.journal");
+  {
+    TileRange range(0, 3, 0, 3, 8);
+    DownloadJournal journal(path, "osm", range);
+    journal.record(0, TileStatus::Available);
+    journal.remove();
+  }
+  EXPECT_FALSE(fs::exists(path));
+  EXPECT_FALSE(fs::exists(path + ".log"));
+
+  TileRange range(0, 3, 0, 3, 8);
+  DownloadJournal journal(path, "osm", range);
+  EXPECT_FALSE(journal.resumed());
+}
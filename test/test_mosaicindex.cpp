@@ -0,0 +1,103 @@
+#include <gtest/gtest.h>
+
+#include <fstream>
+
+#include "gzsatellite/mosaicindex.h"
+#include "tempdir.h"
+
+using namespace gzsatellite;
+namespace fs = boost::filesystem;
+
+namespace {
+
+  // World images only have to exist to be indexed
+  class MosaicIndexTest : public ::testing::Test
+  {
+  protected:
+    TempDir dir_;
+
+    std::string image(const std::string& name)
+    {
+      const std::string path = dir_.file(name + ".jpg");
+      std::ofstream(path) << name;
+      return path;
+    }
+
+    std::string indexPath() const { return dir_.file("mosaics.index"); }
+  };
+
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(MosaicIndexTest, FindsTheSmallestCoveringImage)
+{
+  MosaicIndex index(indexPath());
+  const std::string large = image("large"), small = image("small");
+  index.add(large, "osm", TileRange(100, 119, 200, 219, 12));
+  index.add(small, "osm", TileRange(104, 110, 204, 210, 12));
+  index.add(image("other"), "osm", TileRange(300, 310, 200, 210, 12));
+
+  MosaicIndex::Entry found;
+  ASSERT_TRUE(index.findCovering("osm", TileRange(105, 108, 205, 208, 12), found));
+  EXPECT_EQ(small, found.image);
+  EXPECT_EQ(TileStatus::Available, found.tiles.status(0));
+
+  // only the large one has all of these
+  ASSERT_TRUE(index.findCovering("osm", TileRange(102, 110, 204, 210, 12), found));
+  EXPECT_EQ(large, found.image);
+
+  // the bounds are inclusive
+  ASSERT_TRUE(index.findCovering("osm", TileRange(100, 119, 200, 219, 12), found));
+  EXPECT_EQ(large, found.image);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(MosaicIndexTest, OnlyCoversTheSameImageryAndZoom)
+{
+  MosaicIndex index(indexPath());
+  index.add(image("world"), "osm", TileRange(100, 119, 200, 219, 12));
+
+  MosaicIndex::Entry found;
+  EXPECT_FALSE(index.findCovering("bing", TileRange(105, 108, 205, 208, 12), found));
+  EXPECT_FALSE(index.findCovering("osm", TileRange(210, 216, 410, 416, 13), found));
+  EXPECT_FALSE(index.findCovering("osm", TileRange(115, 125, 205, 208, 12), found));
+  EXPECT_FALSE(index.findCovering("osm", TileRange(1, 0, 205, 208, 12), found));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(MosaicIndexTest, SkipsImagesThatAreGone)
+{
+  MosaicIndex index(indexPath());
+  const std::string small = image("small");
+  index.add(image("large"), "osm", TileRange(100, 119, 200, 219, 12));
+  index.add(small, "osm", TileRange(104, 110, 204, 210, 12));
+  fs::remove(small);
+
+  MosaicIndex::Entry found;
+  ASSERT_TRUE(index.findCovering("osm", TileRange(105, 108, 205, 208, 12), found));
+  EXPECT_EQ(dir_.file("large.jpg"), found.image);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST_F(MosaicIndexTest, IsLoadedFromItsFile)
+{
+  {
+    MosaicIndex index(indexPath());
+    index.add(image("world"), "osm", TileRange(100, 119, 200, 219, 12));
+    index.add(image("world"), "osm", TileRange(100, 119, 200, 219, 12));
+    index.add(image("gone"), "osm", TileRange(0, 9, 0, 9, 12));
+    EXPECT_EQ(2u, index.size());
+  }
+  fs::remove(dir_.file("gone.jpg"));
+
+  MosaicIndex index(indexPath());
+  EXPECT_EQ(1u, index.size());
+  MosaicIndex::Entry found;
+  ASSERT_TRUE(index.findCovering("osm", TileRange(105, 108, 205, 208, 12), found));
+  EXPECT_EQ(dir_.file("world.jpg"), found.image);
+  EXPECT_EQ(20, found.tiles.cols());
+}
@@ -0,0 +1,190 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "gzsatellite/tileprovider.h"
+#include "tempdir.h"
+
+using namespace gzsatellite;
+
+namespace {
+
+  // A tileserver on the loopback interface that answers every request
+  // with the status it is set to
+  class StatusServer
+  {
+  public:
+    StatusServer() : status_(200), port_(0)
+    {
+      fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+      sockaddr_in addr = {};
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      socklen_t len = sizeof(addr);
+      if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), len) == 0
+          && ::listen(fd_, 16) == 0
+          && ::getsockname(fd_, reinterpret_cast<sockaddr*>(&addr), &len) == 0)
+        port_ = ntohs(addr.sin_port);
+      thread_ = std::thread(&StatusServer::serve, this);
+    }
+
+    ~StatusServer()
+    {
+      ::shutdown(fd_, SHUT_RDWR);
+      thread_.join();
+      ::close(fd_);
+    }
+
+    void setStatus(int status) { status_ = status; }
+
+    std::string service() const
+    { return "http://127.0.0.1:" + std::to_string(port_) + "/{z}/{x}/{y}.png"; }
+
+  private:
+    int fd_;
+    std::atomic<int> status_;
+    int port_;
+    std::thread thread_;
+
+    void serve()
+    {
+      int client;
+      while ((client = ::accept(fd_, nullptr, nullptr)) >= 0) {
+        std::string request;
+        char buf[1024];
+        ssize_t n;
+        while (request.find("\r\n\r\n") == std::string::npos
+               && (n = ::read(client, buf, sizeof(buf))) > 0)
+          request.append(buf, n);
+
+        const std::string response = "HTTP/1.1 " + std::to_string(status_) + " Status\r\n"
+            "Content-Length: 4\r\nConnection: close\r\n\r\ntile";
+        if (::write(client, response.data(), response.size()) < 0) {}
+        ::close(client);
+      }
+    }
+  };
+
+  // Fail until the circuit opens (after 5 failures in a row)
+  void trip(TileProvider& provider)
+  {
+    std::string data;
+    for (int i=0; i<5; i++) {
+      EXPECT_EQ(TileProvider::Circuit::Closed, provider.health().circuit);
+      ASSERT_TRUE(provider.acquire());
+      EXPECT_FALSE(provider.fetchTile(i, 0, 3, 256, data));
+    }
+  }
+
+  // The circuit stays open for 10 s at first
+  void waitForCooldown()
+  {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10100));
+  }
+
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileProvider, MissingTilesDoNotOpenTheCircuit)
+{
+  TempDir cache;
+  StatusServer server;
+  server.setStatus(404);
+  TileProvider provider(cache.path().string(), server.service());
+
+  std::string data;
+  for (int i=0; i<10; i++) EXPECT_FALSE(provider.fetchTile(i, 0, 3, 256, data));
+
+  const TileProvider::Health health = provider.health();
+  EXPECT_EQ(TileProvider::Circuit::Closed, health.circuit);
+  EXPECT_EQ(10u, health.requests);
+  EXPECT_EQ(0u, health.failures);
+  EXPECT_TRUE(std::isfinite(provider.score()));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileProvider, SuccessResetsTheFailuresInARow)
+{
+  TempDir cache;
+  StatusServer server;
+  TileProvider provider(cache.path().string(), server.service());
+
+  std::string data;
+  for (int i=0; i<8; i++) {
+    server.setStatus(i == 4 ? 200 : 503);
+    provider.fetchTile(i, 0, 3, 256, data);
+  }
+  EXPECT_EQ(TileProvider::Circuit::Closed, provider.health().circuit);
+  EXPECT_EQ(7u, provider.health().failures);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileProvider, CircuitOpensAndASuccessfulProbeClosesIt)
+{
+  TempDir cache;
+  StatusServer server;
+  server.setStatus(503);
+  TileProvider provider(cache.path().string(), server.service());
+
+  trip(provider);
+  EXPECT_EQ(TileProvider::Circuit::Open, provider.health().circuit);
+  EXPECT_FALSE(provider.acquire());
+  EXPECT_TRUE(std::isinf(provider.score()));
+
+  // after the cool-down, a single request probes the tileserver
+  waitForCooldown();
+  ASSERT_TRUE(provider.acquire());
+  EXPECT_EQ(TileProvider::Circuit::HalfOpen, provider.health().circuit);
+  EXPECT_FALSE(provider.acquire());
+  EXPECT_TRUE(std::isinf(provider.score()));
+
+  server.setStatus(200);
+  std::string data;
+  ASSERT_TRUE(provider.fetchTile(0, 0, 3, 256, data));
+  EXPECT_EQ("tile", data);
+  EXPECT_EQ(TileProvider::Circuit::Closed, provider.health().circuit);
+  EXPECT_TRUE(provider.acquire());
+  EXPECT_TRUE(std::isfinite(provider.score()));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileProvider, FailedProbeOpensTheCircuitAgain)
+{
+  TempDir cache;
+  StatusServer server;
+  server.setStatus(503);
+  TileProvider provider(cache.path().string(), server.service());
+
+  trip(provider);
+  waitForCooldown();
+
+  // a cancelled probe says nothing: the next request probes instead
+  ASSERT_TRUE(provider.acquire());
+  CancelToken cancel;
+  cancel.cancel();
+  std::string data;
+  EXPECT_FALSE(provider.fetchTile(0, 0, 3, 256, data, &cancel));
+  EXPECT_EQ(TileProvider::Circuit::Open, provider.health().circuit);
+
+  ASSERT_TRUE(provider.acquire());
+  EXPECT_EQ(TileProvider::Circuit::HalfOpen, provider.health().circuit);
+  EXPECT_FALSE(provider.fetchTile(0, 0, 3, 256, data));
+  EXPECT_EQ(TileProvider::Circuit::Open, provider.health().circuit);
+
+  // (for twice as long now)
+  waitForCooldown();
+  EXPECT_FALSE(provider.acquire());
+}
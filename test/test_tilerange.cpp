@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+
+#include <set>
+#include <vector>
+
+#include "gzsatellite/tilerange.h"
+
+using namespace gzsatellite;
+
+// ----------------------------------------------------------------------------
+
+TEST(TileKey, RoundTripsUpToTheHighestZoom)
+{
+  const int max_index = (1 << kMaxZoom) - 1;
+  const int tiles[][3] = {{0, 0, 0}, {1, 2, 3}, {max_index, 0, kMaxZoom},
+                          {0, max_index, kMaxZoom}, {max_index, max_index, kMaxZoom}};
+
+  for (const auto& t : tiles) {
+    int x, y, z;
+    unpackTileKey(packTileKey(t[0], t[1], t[2]), x, y, z);
+    EXPECT_EQ(t[0], x);
+    EXPECT_EQ(t[1], y);
+    EXPECT_EQ(t[2], z);
+  }
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileKey, FieldsDoNotOverlap)
+{
+  const int max_index = (1 << kMaxZoom) - 1;
+  std::set<TileKey> keys;
+  keys.insert(packTileKey(1, 0, 0));
+  keys.insert(packTileKey(0, 1, 0));
+  keys.insert(packTileKey(0, 0, 1));
+  keys.insert(packTileKey(max_index, 0, 0));
+  keys.insert(packTileKey(0, max_index, 0));
+  keys.insert(packTileKey(0, 0, kMaxZoom));
+  EXPECT_EQ(6u, keys.size());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileRange, RejectsZoomLevelsWithoutKeys)
+{
+  EXPECT_NO_THROW(TileRange(0, 0, 0, 0, kMaxZoom));
+  EXPECT_THROW(TileRange(0, 0, 0, 0, kMaxZoom + 1), std::invalid_argument);
+  EXPECT_THROW(TileRange(0, 0, 0, 0, -1), std::invalid_argument);
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileRange, IndexesTilesRowMajor)
+{
+  const TileRange range(10, 12, 20, 21, 5);
+  ASSERT_EQ(6u, range.size());
+  EXPECT_EQ(3, range.cols());
+  EXPECT_EQ(2, range.rows());
+
+  for (size_t i=0; i<range.size(); i++) {
+    const TileRange::Tile t = range.tile(i);
+    EXPECT_EQ(i, range.indexOf(t.x, t.y));
+    EXPECT_TRUE(range.contains(t.x, t.y));
+    EXPECT_EQ(packTileKey(t.x, t.y, 5), t.key());
+  }
+  EXPECT_EQ(11, range.tile(4).x);
+  EXPECT_EQ(21, range.tile(4).y);
+  EXPECT_FALSE(range.contains(13, 20));
+  EXPECT_FALSE(range.contains(10, 19));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileRange, InvertedBoundsAreEmpty)
+{
+  const TileRange range(5, 4, 0, 3, 3);
+  EXPECT_TRUE(range.empty());
+  EXPECT_TRUE(range.begin() == range.end());
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileRange, PacksFourStatusesPerByte)
+{
+  TileRange range(0, 4, 0, 0, 3);
+  EXPECT_EQ(2u, range.statusBits().size());
+  EXPECT_EQ(5u, range.count(TileStatus::Pending));
+
+  // neighbours share a byte, and keep their own status
+  range.setStatus(0, TileStatus::Failed);
+  range.setStatus(1, TileStatus::Available);
+  range.setStatus(2, TileStatus::InFlight);
+  range.setStatus(4, TileStatus::Available);
+  range.setStatus(1, TileStatus::Pending);
+
+  EXPECT_EQ(TileStatus::Failed, range.status(0));
+  EXPECT_EQ(TileStatus::Pending, range.status(1));
+  EXPECT_EQ(TileStatus::InFlight, range.status(2));
+  EXPECT_EQ(TileStatus::Pending, range.status(3));
+  EXPECT_EQ(TileStatus::Available, range.status(4));
+  EXPECT_EQ(2u, range.count(TileStatus::Pending));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileRange, SelectsTilesByStatus)
+{
+  TileRange range(0, 3, 0, 2, 4);
+  range.setStatus(1, TileStatus::Failed);
+  range.setStatus(7, TileStatus::Failed);
+  range.setStatus(11, TileStatus::Failed);
+
+  std::vector<size_t> failed;
+  for (const auto& tile : range.select(TileStatus::Failed)) {
+    EXPECT_EQ(TileStatus::Failed, tile.status);
+    failed.push_back(tile.index);
+  }
+  EXPECT_EQ(std::vector<size_t>({1, 7, 11}), failed);
+
+  size_t all = 0;
+  for (const auto& tile : range) all += (tile.index == all);
+  EXPECT_EQ(range.size(), all);
+}
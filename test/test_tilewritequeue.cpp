@@ -0,0 +1,136 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <fstream>
+#include <iterator>
+
+#include "gzsatellite/tilewritequeue.h"
+#include "tempdir.h"
+
+using namespace gzsatellite;
+namespace fs = boost::filesystem;
+
+namespace {
+
+  std::string readFile(const fs::path& path)
+  {
+    std::ifstream in(path.string(), std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  }
+
+  size_t countFiles(const fs::path& dir)
+  {
+    size_t n = 0;
+    for (fs::recursive_directory_iterator it(dir), end; it != end; ++it)
+      n += fs::is_regular_file(it->path());
+    return n;
+  }
+
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileWriteQueue, ConfirmsTilesOnceTheyAreInPlace)
+{
+  TempDir dir;
+  std::atomic<int> confirmed(0), misplaced(0);
+  {
+    TileWriteQueue queue(8, 0.01);
+    for (int i=0; i<50; i++) {
+      const fs::path path = dir.path() / std::to_string(i % 5) / (std::to_string(i) + ".jpg");
+      const std::string data(100 + i, 'a' + i % 26);
+      queue.push(path, data, [&, path, data](const std::string& written) {
+        if (written != data || readFile(path) != data) misplaced++;
+        confirmed++;
+      });
+    }
+    queue.flush();
+
+    // every tile was confirmed by the time flush returns
+    EXPECT_EQ(50, confirmed);
+    EXPECT_EQ(0, misplaced);
+
+    const TileWriteQueue::Stats stats = queue.stats();
+    EXPECT_EQ(50u, stats.tiles);
+    EXPECT_EQ(0u, stats.failures);
+    EXPECT_GE(stats.batches, 50u/8);
+  }
+
+  // and nothing but the tiles is left behind
+  EXPECT_EQ(50u, countFiles(dir.path()));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileWriteQueue, ServesQueuedTilesUntilWritten)
+{
+  TempDir dir;
+  const fs::path path = dir.path() / "1/2/3.jpg";
+
+  // a linger keeps the tile queued for a while
+  TileWriteQueue queue(64, 1);
+  queue.push(path, "tile");
+
+  std::string data;
+  ASSERT_TRUE(queue.find(path, data));
+  EXPECT_EQ("tile", data);
+  EXPECT_FALSE(fs::exists(path));
+
+  queue.flush();
+  EXPECT_FALSE(queue.find(path, data));
+  EXPECT_EQ("tile", readFile(path));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileWriteQueue, LastDataQueuedForATileWins)
+{
+  TempDir dir;
+  const fs::path path = dir.path() / "tile.jpg";
+
+  TileWriteQueue queue(1, 0);
+  for (int i=0; i<20; i++) queue.push(path, std::to_string(i));
+
+  std::string data;
+  if (queue.find(path, data)) {
+    EXPECT_EQ("19", data);
+  }
+
+  queue.flush();
+  EXPECT_EQ("19", readFile(path));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileWriteQueue, FailedTilesAreNotConfirmed)
+{
+  TempDir dir;
+  std::ofstream(dir.file("file")) << "not a directory";
+
+  std::atomic<int> confirmed(0);
+  TileWriteQueue queue(4, 0.01);
+  queue.push(dir.path() / "file/1.jpg", "tile", [&](const std::string&) { confirmed++; });
+  queue.push(dir.path() / "2.jpg", "tile", [&](const std::string&) { confirmed++; });
+  queue.flush();
+
+  EXPECT_EQ(1, confirmed);
+  EXPECT_EQ(1u, queue.stats().failures);
+
+  std::string data;
+  EXPECT_FALSE(queue.find(dir.path() / "file/1.jpg", data));
+}
+
+// ----------------------------------------------------------------------------
+
+TEST(TileWriteQueue, WritesWhatIsStillQueuedWhenDestroyed)
+{
+  TempDir dir;
+  {
+    TileWriteQueue queue(64, 10);
+    for (int i=0; i<10; i++)
+      queue.push(dir.path() / (std::to_string(i) + ".jpg"), std::to_string(i));
+  }
+
+  for (int i=0; i<10; i++)
+    EXPECT_EQ(std::to_string(i), readFile(dir.path() / (std::to_string(i) + ".jpg")));
+}